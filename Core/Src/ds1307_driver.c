@@ -34,6 +34,14 @@ uint8_t DS1307_GetClockHalt(void) {
 	return (DS1307_GetRegByte(DS1307_REG_SECOND) & 0x80) >> 7;
 }
 
+/**
+ * @brief Waits for the shared bus: an interrupt driven EEPROM transfer may be in progress.
+ */
+static void DS1307_WaitBus(void) {
+	uint32_t start = HAL_GetTick();
+	while (HAL_I2C_GetState(&CLOCK_I2C) != HAL_I2C_STATE_READY && HAL_GetTick() - start < DS1307_TIMEOUT);
+}
+
 /**
  * @brief Sets the byte in the designated DS1307 register to value.
  * @param regAddr Register address to write.
@@ -41,6 +49,7 @@ uint8_t DS1307_GetClockHalt(void) {
  */
 void DS1307_SetRegByte(uint8_t regAddr, uint8_t val) {
 	uint8_t bytes[2] = { regAddr, val };
+	DS1307_WaitBus();
 	HAL_I2C_Master_Transmit(&CLOCK_I2C, DS1307_I2C_ADDR << 1, bytes, 2, DS1307_TIMEOUT);
 }
 
@@ -51,6 +60,7 @@ void DS1307_SetRegByte(uint8_t regAddr, uint8_t val) {
  */
 uint8_t DS1307_GetRegByte(uint8_t regAddr) {
 	uint8_t val;
+	DS1307_WaitBus();
 	HAL_I2C_Master_Transmit(&CLOCK_I2C, DS1307_I2C_ADDR << 1, &regAddr, 1, DS1307_TIMEOUT);
 	HAL_I2C_Master_Receive(&CLOCK_I2C, DS1307_I2C_ADDR << 1, (uint8_t*)&val, 1, DS1307_TIMEOUT);
 	return val;
@@ -35,8 +35,10 @@
 #include "soul.h"
 #include "gutils.h"
 #include "system.h"
+#include "uart_tx.h"
 #include "at24cm01.h"
 #include "settings.h"
+#include "sim_uart.h"
 #include "sim_module.h"
 #include "ds1307_driver.h"
 #include "liquid_sensor.h"
@@ -85,13 +87,16 @@ void error_loop();
 
 StorageDriver storageDriver;
 StorageAT storage(
+#if RECORD_DB_RING_LOG
+	(eeprom_get_size() - RECORD_LOG_SIZE) / STORAGE_PAGE_SIZE,
+#else
 	eeprom_get_size() / STORAGE_PAGE_SIZE,
+#endif
 	&storageDriver,
   EEPROM_PAGE_SIZE
 );
 
 char cmd_input_chr = 0;
-char sim_input_chr = 0;
 
 SoulGuard<
 	RestartWatchdog,
@@ -173,7 +178,7 @@ int main(void)
     // Commands
     HAL_UART_Receive_IT(&COMMAND_UART, (uint8_t*) &cmd_input_chr, sizeof(char));
     // Sim module
-    HAL_UART_Receive_IT(&SIM_MODULE_UART, (uint8_t*) &sim_input_chr, sizeof(char));
+    sim_uart_begin();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -194,9 +199,9 @@ int main(void)
 
     system_post_load();
 
-    HAL_Delay(5000);
+    RecordDB::mount();
 
-    printTagLog(MAIN_TAG, "The device has been loaded\n");
+    HAL_Delay(5000);
 
 #ifdef DEBUG
 	static unsigned last_error = get_first_error();
@@ -204,8 +209,12 @@ int main(void)
 
 	set_status(WORKING);
 	set_status(HAS_NEW_RECORD);
+	system_boot_done();
+	printTagLog(MAIN_TAG, "The device has been loaded in %lu ms\n", HAL_GetTick());
 	errTimer.start();
     while (1) {
+		system_loop_begin();
+
 		soulGuard.defend();
 
 #ifdef DEBUG
@@ -217,6 +226,7 @@ int main(void)
 #endif
 
 		if (!errTimer.wait()) {
+			RecordDB::unmount();
 			system_error_handler((SOUL_STATUS)get_first_error(), error_loop);
 		}
 
@@ -248,7 +258,15 @@ int main(void)
         // Logger
         LogService::update();
 
+        // Staged records
+        RecordDB::update();
+
+        // Asynchronous EEPROM requests
+        StorageDriver::tick();
+
 		errTimer.start();
+
+		system_loop_end();
     }
   /* USER CODE END 3 */
 }
@@ -313,14 +331,37 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
         cmd_proccess_input(cmd_input_chr);
         HAL_UART_Receive_IT(&COMMAND_UART, (uint8_t*) &cmd_input_chr, 1);
     }
+}
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Pos) {
+    if (huart == &SIM_MODULE_UART) {
+        sim_uart_rx_event(Pos);
+    }
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+    uart_tx_complete(huart);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+    uart_tx_error(huart);
     if (huart == &SIM_MODULE_UART) {
-        sim_proccess_input(sim_input_chr);
-        HAL_UART_Receive_IT(&SIM_MODULE_UART, (uint8_t*) &sim_input_chr, 1);
+        sim_uart_error();
     }
 }
 
 int _write(int, uint8_t *ptr, int len) {
-    HAL_UART_Transmit(&BEDUG_UART, (uint8_t*)ptr, static_cast<uint16_t>(len), GENERAL_TIMEOUT_MS);
+    uint32_t queued = uart_tx_write_some(&BEDUG_UART, ptr, static_cast<uint32_t>(len));
+    // An output longer than the free queue waits for the line in the main loop only
+    util_old_timer_t timer = {};
+    util_old_timer_start(&timer, GENERAL_TIMEOUT_MS);
+    while (queued < static_cast<uint32_t>(len) && !__get_IPSR() && !__get_PRIMASK() && util_old_timer_wait(&timer)) {
+        uint32_t part = __min(static_cast<uint32_t>(len) - queued, uart_tx_free(&BEDUG_UART));
+        if (part) {
+            queued += uart_tx_write_some(&BEDUG_UART, ptr + queued, part);
+            util_old_timer_start(&timer, GENERAL_TIMEOUT_MS);
+        }
+    }
 #ifdef DEBUG
     for (int DataIdx = 0; DataIdx < len; DataIdx++) {
         ITM_SendChar(*ptr++);
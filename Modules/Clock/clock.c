@@ -2,7 +2,9 @@
 
 #include "clock.h"
 
+#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include "glog.h"
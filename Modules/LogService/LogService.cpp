@@ -26,9 +26,24 @@ extern settings_t settings;
 util_old_timer_t LogService::logTimer = {};
 util_old_timer_t LogService::settingsTimer = {};
 uint32_t LogService::logId = 0;
-std::unique_ptr<RecordDB> LogService::nextRecord = std::make_unique<RecordDB>(0);
+RecordCursor LogService::uploadCursor;
 bool LogService::newRecordLoaded = false;
 
+uint32_t LogService::uploadPosts = 0;
+uint32_t LogService::uploadRecords = 0;
+uint32_t LogService::uploadBytes = 0;
+uint32_t LogService::uploadAcked = 0;
+uint32_t LogService::uploadStartMs = 0;
+
+LogService::Response LogService::response = {};
+
+#if LOG_SERVICE_BATCH
+char     LogService::batchHeader[HEADER_SIZE] = {};
+bool     LogService::batchHeaderSent = false;
+uint32_t LogService::batchCount = 0;
+uint32_t LogService::batchSent = 0;
+#endif
+
 
 const char* LogService::TAG                = "LOG";
 
@@ -54,11 +69,11 @@ const char* LogService::CF_URL_FIELD       = "url";
 void LogService::update()
 {
 	if (if_network_ready()) {
+#if LOG_SERVICE_BATCH
+		LogService::sendBatchRequest();
+#else
 		LogService::sendRequest();
-	}
-
-	if (has_http_response()) {
-		LogService::parse();
+#endif
 	}
 
 	if (logTimer.delay != settings.sleep_time) {
@@ -88,14 +103,11 @@ void LogService::updateSleep(uint32_t time)
 	LogService::logTimer.delay = time;
 }
 
-void LogService::sendRequest()
+uint32_t LogService::formatHeader(char* dst, uint32_t size, bool is_base_server)
 {
-	bool is_base_server = strncmp(get_sim_url(), settings.url, strlen(settings.url));
-
-	char data[SIM_LOG_SIZE] = {};
 	snprintf(
-		data,
-		sizeof(data),
+		dst,
+		size,
 		"id=%s\n"
 		"fw_id=%u\n"
 		"cf_id=%lu\n",
@@ -105,23 +117,111 @@ void LogService::sendRequest()
 	);
 	if (!settings.calibrated) {
 		snprintf(
-			data + strlen(data),
-			sizeof(data) - strlen(data),
+			dst + strlen(dst),
+			size - strlen(dst),
 			"adclevel=%lu\n",
 			get_level_adc()
 		);
 	}
 	snprintf(
-		data + strlen(data),
-		sizeof(data) - strlen(data),
+		dst + strlen(dst),
+		size - strlen(dst),
 		"t=%s\n",
 		get_clock_time_format()
 	);
+	return strlen(dst);
+}
+
+uint32_t LogService::formatRecord(char* dst, uint32_t size, const RecordDB::Record& record)
+{
+	int len = snprintf(
+		dst,
+		size,
+		"d="
+			"id=%lu;"
+			"t=20%02d-%02d-%02dT%02d:%02d:%02d;"
+			"level=%ld;"
+			"press_1=%u.%02u;"
+//			"press_2=%lu.%02lu;"
+			"pumpw=%lu;"
+			"pumpd=%lu\r\n",
+		record.id,
+		record.time[0], record.time[1], record.time[2], record.time[3], record.time[4], record.time[5],
+		record.level,
+		record.press_1 / 100, record.press_1 % 100,
+//		record.press_2 / 100, record.press_2 % 100,
+		record.pump_wok_time,
+		record.pump_downtime
+	);
+	if (len < 0) {
+		return 0;
+	}
+	return __min(static_cast<uint32_t>(len), size - 1);
+}
+
+#if RECORD_DB_ROLLUP
+uint32_t LogService::formatRollup(char* dst, uint32_t size, const RollupDB::Rollup& rollup)
+{
+	RecordDB::Record record = {};
+	RollupDB::toRecord(&rollup, &record);
+
+	int len = snprintf(
+		dst,
+		size,
+		"d="
+			"id=%lu;"
+			"t=20%02d-%02d-%02dT%02d:%02d:%02d;"
+			"level=%ld;"
+			"press_1=%u.%02u;"
+			"pumpw=%lu;"
+			"pumpd=%lu;"
+			"n=%u;"
+			"level_min=%ld;"
+			"level_max=%ld;"
+			"press_1_min=%u.%02u;"
+			"press_1_max=%u.%02u\r\n",
+		record.id,
+		record.time[0], record.time[1], record.time[2], record.time[3], record.time[4], record.time[5],
+		record.level,
+		record.press_1 / 100, record.press_1 % 100,
+		record.pump_wok_time,
+		record.pump_downtime,
+		rollup.count,
+		rollup.level_min,
+		rollup.level_max,
+		rollup.press_min / 100, rollup.press_min % 100,
+		rollup.press_max / 100, rollup.press_max % 100
+	);
+	if (len < 0) {
+		return 0;
+	}
+	return __min(static_cast<uint32_t>(len), size - 1);
+}
+#endif
+
+uint32_t LogService::formatUpload(char* dst, uint32_t size)
+{
+#if RECORD_DB_ROLLUP
+	if (uploadCursor.isRollup) {
+		return formatRollup(dst, size, uploadCursor.rollup);
+	}
+#endif
+	return formatRecord(dst, size, uploadCursor.record);
+}
+
+void LogService::sendRequest()
+{
+	bool is_base_server = strncmp(get_sim_url(), settings.url, strlen(settings.url));
+
+	char data[SIM_LOG_SIZE] = {};
+	formatHeader(data, sizeof(data), is_base_server);
 
 	RecordDB::RecordStatus recordStatus = RecordDB::RECORD_ERROR;
 	if (!newRecordLoaded && is_status(HAS_NEW_RECORD)) {
-		nextRecord   = std::make_unique<RecordDB>(static_cast<uint32_t>(settings.server_log_id));
-		recordStatus = nextRecord->loadNext();
+		// The server must not acknowledge records which are not in the memory yet
+		RecordDB::flush();
+		uploadCursor.reset(static_cast<uint32_t>(settings.server_log_id) + 1);
+		recordStatus = uploadCursor.next();
 	}
 	if (recordStatus == RecordDB::RECORD_NO_LOG) {
 	    reset_status(HAS_NEW_RECORD);
@@ -130,25 +230,7 @@ void LogService::sendRequest()
 		recordStatus == RecordDB::RECORD_OK &&
 		!is_base_server
 	) {
-		snprintf(
-			data + strlen(data),
-			sizeof(data) - strlen(data),
-			"d="
-				"id=%lu;"
-				"t=20%02d-%02d-%02dT%02d:%02d:%02d;"
-				"level=%ld;"
-				"press_1=%u.%02u;"
-//				"press_2=%lu.%02lu;"
-				"pumpw=%lu;"
-				"pumpd=%lu\r\n",
-			nextRecord->record.id,
-			nextRecord->record.time[0], nextRecord->record.time[1], nextRecord->record.time[2], nextRecord->record.time[3], nextRecord->record.time[4], nextRecord->record.time[5],
-			nextRecord->record.level,
-			nextRecord->record.press_1 / 100, nextRecord->record.press_1 % 100,
-//			nextRecord->record.press_2 / 100, record.record.press_2 % 100,
-			nextRecord->record.pump_wok_time,
-			nextRecord->record.pump_downtime
-		);
+		formatUpload(data + strlen(data), sizeof(data) - strlen(data));
 		newRecordLoaded = true;
 	}
 
@@ -165,117 +247,285 @@ void LogService::sendRequest()
 	printTagLog(TAG, "request:\n%s\n", data);
 #endif
 
-	send_sim_http_post(data);
+	memset(&response, 0, sizeof(response));
+	send_sim_http_post(data, LogService::parse);
 	util_old_timer_start(&settingsTimer, settingsDelayMs);
-	LogService::logId = nextRecord->record.id;
+	LogService::logId = uploadCursor.record.id;
+
+	if (!uploadStartMs) {
+		uploadStartMs = HAL_GetTick();
+	}
+	uploadPosts++;
+	uploadBytes += strlen(data);
+	if (recordStatus == RecordDB::RECORD_OK && !is_base_server) {
+		uploadRecords++;
+	}
 }
 
-void LogService::parse()
+#if LOG_SERVICE_BATCH
+void LogService::sendBatchRequest()
 {
-	char* var_ptr = get_response();
-	char* data_ptr = var_ptr;
+	bool is_base_server = strncmp(get_sim_url(), settings.url, strlen(settings.url));
+
+	uint32_t length = formatHeader(batchHeader, sizeof(batchHeader), is_base_server);
+	uint32_t lastId = settings.server_log_id;
+	batchCount = 0;
+
+	// First pass: count the records which fit into the body
+	if (!is_base_server && is_status(HAS_NEW_RECORD)) {
+		// The server must not acknowledge records which are not in the memory yet
+		RecordDB::flush();
+
+		char line[SIM_LOG_SIZE] = {};
+		uploadCursor.reset(lastId + 1);
+		while (length < LOG_BATCH_BODY_SIZE) {
+			RecordDB::RecordStatus status = uploadCursor.next();
+			if (status == RecordDB::RECORD_NO_LOG && !batchCount) {
+				reset_status(HAS_NEW_RECORD);
+			}
+			if (status != RecordDB::RECORD_OK) {
+				break;
+			}
+
+			uint32_t len = formatUpload(line, sizeof(line));
+			if (length + len > LOG_BATCH_BODY_SIZE) {
+				break;
+			}
+
+			length += len;
+			lastId  = uploadCursor.record.id;
+			batchCount++;
+		}
+	}
+
+	if (!batchCount && util_old_timer_wait(&LogService::settingsTimer)) {
+		return;
+	}
+
+	batchHeaderSent = false;
+	batchSent       = 0;
+	uploadCursor.reset(static_cast<uint32_t>(settings.server_log_id) + 1, lastId);
 
 #if LOG_SERVICE_BEDUG
-	printTagLog(TAG, "response: %s\n", var_ptr);
+	printTagLog(TAG, "request: %lu records (%lu bytes)\n%s\n", batchCount, length, batchHeader);
 #endif
 
-	if (!var_ptr) {
+	// Second pass: the modem reads the records while sending
+	memset(&response, 0, sizeof(response));
+	send_sim_http_stream(length, LogService::readBatch, LogService::parse);
+	util_old_timer_start(&settingsTimer, settingsDelayMs);
+	LogService::logId = lastId;
+
+	if (!uploadStartMs) {
+		uploadStartMs = HAL_GetTick();
+	}
+	uploadPosts++;
+	uploadRecords += batchCount;
+	uploadBytes   += length;
+}
+
+uint32_t LogService::readBatch(char* buf, uint32_t size)
+{
+	if (!batchHeaderSent) {
+		batchHeaderSent = true;
+		uint32_t len = __min(strlen(batchHeader), size);
+		memcpy(buf, batchHeader, len);
+		return len;
+	}
+
+	if (batchSent >= batchCount) {
+		return 0;
+	}
+
+	uint32_t lastId = uploadCursor.record.id;
+	if (uploadCursor.next() != RecordDB::RECORD_OK) {
 #if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "unable to parse response (no response)\n");
+		printTagLog(TAG, "unable to load record after id=%lu\n", lastId);
 #endif
-		return;
+		return 0;
 	}
 
-	if (!LogService::findParam(&data_ptr, var_ptr, TIME_FIELD)) {
-#if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "unable to parse response (no time) - [%s]\n", var_ptr);
+	batchSent++;
+
+	return formatUpload(buf, size);
+}
 #endif
+
+void LogService::showUpload()
+{
+	uint32_t minutes = uploadStartMs ? (HAL_GetTick() - uploadStartMs) / (60 * MILLIS_IN_SECOND) : 0;
+
+	gprint("####################UPLOAD######################\n");
+#if LOG_SERVICE_BATCH
+	gprint("Mode:            batch (%u bytes)\n", LOG_BATCH_BODY_SIZE);
+#else
+	gprint("Mode:            single\n");
+#endif
+	gprint("POST requests:   %lu\n", uploadPosts);
+	gprint("Records sent:    %lu\n", uploadRecords);
+	gprint("Records acked:   %lu\n", uploadAcked);
+	gprint("Body bytes:      %lu\n", uploadBytes);
+	gprint("Bytes/record:    %lu\n", uploadRecords ? uploadBytes / uploadRecords : 0);
+	gprint("Records/min:     %lu\n", minutes ? uploadAcked / minutes : uploadAcked);
+	gprint("AT commands:     %lu\n", sim_at_commands());
+	uint32_t at_per_record_x100 = uploadRecords ? (sim_at_commands() * 100) / uploadRecords : 0;
+	gprint("AT/record:       %lu.%02lu\n", at_per_record_x100 / 100, at_per_record_x100 % 100);
+	gprint("Last server ID:  %lu\n", static_cast<uint32_t>(settings.server_log_id));
+	gprint("################################################\n");
+}
+
+void LogService::parse(const char* data, uint32_t len)
+{
+	if (!len) {
+		parseField();
+		applyResponse();
+		memset(&response, 0, sizeof(response));
 		return;
 	}
 
-	if (LogService::updateTime(data_ptr)) {
+	for (uint32_t i = 0; i < len; i++) {
+		if (data[i] == ';' || data[i] == '\r' || data[i] == '\n') {
+			parseField();
+		} else if (response.fieldLen < sizeof(response.field) - 1) {
+			response.field[response.fieldLen++] = data[i];
+		}
+	}
+}
+
+void LogService::parseField()
+{
+	response.field[response.fieldLen] = 0;
+	response.fieldLen = 0;
+
+	char* key   = response.field;
+	char* value = strchr(key, '=');
+	if (!value) {
+		return;
+	}
+	*value++ = 0;
+
+	if (!strcmp(key, CF_DATA_FIELD) && strchr(value, '=')) {
+		key   = value;
+		value = strchr(key, '=');
+		*value++ = 0;
+	}
+
 #if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "time updated\n");
+	printTagLog(TAG, "response field: %s=%s\n", key, value);
 #endif
-	} else {
+
+	if (!strcmp(key, TIME_FIELD)) {
+		if (LogService::updateTime(value)) {
+			response.fields |= (1 << RESPONSE_TIME);
+		}
+		return;
+	}
+
+	if (!strcmp(key, CF_URL_FIELD)) {
+		unsigned i = 0;
+		for (; i < sizeof(response.url) - 1 && value[i] && !isspace(value[i]); i++) {
+			response.url[i] = value[i];
+		}
+		response.url[i] = 0;
+		response.fields |= (1 << RESPONSE_URL);
+		return;
+	}
+
+	const char* names[RESPONSE_VALUES_COUNT] = {
+		CF_LOGID_FIELD,
+		CF_ID_FIELD,
+		CF_PWR_FIELD,
+		CF_LTRMIN_FIELD,
+		CF_LTRMAX_FIELD,
+		CF_TRGT_FIELD,
+		CF_SLEEP_FIELD,
+		CF_SPEED_FIELD,
+		CF_CLEAR_FIELD
+	};
+	for (unsigned i = 0; i < RESPONSE_VALUES_COUNT; i++) {
+		if (!strcmp(key, names[i])) {
+			response.values[i] = atoi(value);
+			response.fields   |= (1 << i);
+			return;
+		}
+	}
+}
+
+void LogService::applyResponse()
+{
+	if (!(response.fields & (1 << RESPONSE_TIME))) {
 #if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "unable to parse response (unable to update time) - [%s]\n", var_ptr);
+		printTagLog(LogService::TAG, "unable to parse response (no time)\n");
 #endif
 		return;
 	}
 
+#if LOG_SERVICE_BEDUG
+	printTagLog(LogService::TAG, "time updated\n");
+#endif
+
 	// Parse configuration:
-	if (!LogService::findParam(&data_ptr, var_ptr, CF_LOGID_FIELD)) {
+	if (!(response.fields & (1 << RESPONSE_LOG_ID))) {
 #if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "unable to parse response (log_id not found) - %s\n", var_ptr);
+		printTagLog(LogService::TAG, "unable to parse response (log_id not found)\n");
 #endif
 		return;
 	}
-	settings.server_log_id = atoi(data_ptr);
+	uint32_t server_log_id = static_cast<uint32_t>(response.values[RESPONSE_LOG_ID]);
+	if (server_log_id > settings.server_log_id) {
+		uploadAcked += server_log_id - settings.server_log_id;
+	}
+	settings.server_log_id = server_log_id;
 
 #if LOG_SERVICE_BEDUG
 	printTagLog(LogService::TAG, "Recieved response from the server\n");
 #endif
 
-	if (!LogService::findParam(&data_ptr, var_ptr, CF_ID_FIELD)) {
+	if (!(response.fields & (1 << RESPONSE_CF_ID))) {
 #if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "unable to parse response (cf_id not found) - %s\n", var_ptr);
+		printTagLog(LogService::TAG, "unable to parse response (cf_id not found)\n");
 #endif
-		LogService::saveResponse();
+		// Only the server log ID counter is changed
+		set_status(NEED_SAVE_COUNTERS);
 		return;
 	}
-	uint32_t new_cf_id = atoi(data_ptr);
+	uint32_t new_cf_id = static_cast<uint32_t>(response.values[RESPONSE_CF_ID]);
 	if (new_cf_id == settings.cf_id) {
-		LogService::saveResponse();
+		set_status(NEED_SAVE_COUNTERS);
 		return;
 	}
 	settings.cf_id = new_cf_id;
 
-	if (!LogService::findParam(&data_ptr, var_ptr, CF_DATA_FIELD)) {
-#if LOG_SERVICE_BEDUG
-		printTagLog(LogService::TAG, "warning: no cf_id data - [%s]\n", var_ptr);
-#endif
+	if (response.fields & (1 << RESPONSE_PWR)) {
+		pump_update_enable_state(response.values[RESPONSE_PWR]);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_PWR_FIELD)) {
-		pump_update_enable_state(atoi(data_ptr));
+	if (response.fields & (1 << RESPONSE_LTRMIN)) {
+		pump_update_ltrmin(response.values[RESPONSE_LTRMIN]);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_LTRMIN_FIELD)) {
-		pump_update_ltrmin(atoi(data_ptr));
+	if (response.fields & (1 << RESPONSE_LTRMAX)) {
+		pump_update_ltrmax(response.values[RESPONSE_LTRMAX]);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_LTRMAX_FIELD)) {
-		pump_update_ltrmax(atoi(data_ptr));
+	if (response.fields & (1 << RESPONSE_TRGT)) {
+		pump_update_target(response.values[RESPONSE_TRGT]);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_TRGT_FIELD)) {
-		pump_update_target(atoi(data_ptr));
+	if (response.fields & (1 << RESPONSE_SLEEP)) {
+		LogService::updateSleep(response.values[RESPONSE_SLEEP] * MILLIS_IN_SECOND);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_SLEEP_FIELD)) {
-		LogService::updateSleep(atoi(data_ptr) * MILLIS_IN_SECOND);
+	if (response.fields & (1 << RESPONSE_SPEED)) {
+		pump_update_speed(response.values[RESPONSE_SPEED]);
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_SPEED_FIELD)) {
-		pump_update_speed(atoi(data_ptr));
+	if (response.fields & (1 << RESPONSE_CLEAR)) {
+		if (response.values[RESPONSE_CLEAR] == 1) LogService::clear();
 	}
 
-	if (LogService::findParam(&data_ptr, var_ptr, CF_CLEAR_FIELD)) {
-		if (atoi(data_ptr) == 1) LogService::clearLog();
-	}
-
-	if (LogService::findParam(&data_ptr, var_ptr, CF_URL_FIELD)) {
-		char url[CHAR_SETIINGS_SIZE] = "";
-		for (unsigned i = 0; i < __min(strlen(data_ptr), sizeof(url) - 1); i++) {
-			if (data_ptr[i] == ';' ||
-				isspace(data_ptr[i])
-			) {
-				break;
-			}
-			url[i] = data_ptr[i];
-		}
-		set_settings_url(url);
+	if (response.fields & (1 << RESPONSE_URL)) {
+		set_settings_url(response.url);
 	}
 
 	LogService::saveResponse();
@@ -303,45 +553,11 @@ void LogService::saveNewLog()
 	if (record.save() == RecordDB::RECORD_OK) {
 		settings.pump_work_sec = 0;
 		settings.pump_downtime_sec = 0;
-		set_status(NEED_SAVE_SETTINGS);
-	}
-}
-
-bool LogService::findParam(char** dst, const char* src, const char* param)
-{
-	char search_param[CHAR_PARAM_SIZE] = {0};
-	if (strlen(param) > sizeof(search_param) - 3) {
-		return false;
-	}
-
-	char* ptr = NULL;
-
-	snprintf(search_param, sizeof(search_param), "\n%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		goto do_success;
-	}
-
-	snprintf(search_param, sizeof(search_param), "=%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		goto do_success;
-	}
-
-	snprintf(search_param, sizeof(search_param), ";%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		goto do_success;
+#if !RECORD_DB_STAGING
+		// RecordDB requests the counters save when the record is written
+		set_status(NEED_SAVE_COUNTERS);
+#endif
 	}
-
-	goto do_error;
-
-do_success:
-	*dst = ptr + strlen(search_param);
-	return true;
-
-do_error:
-	return false;
 }
 
 bool LogService::updateTime(char* data)
@@ -398,8 +614,14 @@ bool LogService::updateTime(char* data)
 	return true;
 }
 
-void LogService::clearLog()
+void LogService::clear()
 {
+	if (RecordDB::clear() != RecordDB::RECORD_OK) {
+#if LOG_SERVICE_BEDUG
+		printTagLog(LogService::TAG, "error clear log");
+#endif
+	}
+
 	settings.server_log_id = 0;
 	settings.cf_id = 0;
 	settings.pump_work_sec = 0;
@@ -3,12 +3,13 @@
 #pragma once
 
 
-#include <memory>
 #include <stdint.h>
 
 #include "gutils.h"
+#include "settings.h"
 
 #include "RecordDB.h"
+#include "RecordCursor.h"
 
 
 #ifdef DEBUG
@@ -16,6 +17,15 @@
 #endif
 
 
+/*
+ * Batched upload: every POST carries as many unsent records ("d=" lines) as
+ * fit into LOG_BATCH_BODY_SIZE, the server acknowledges them through d_hwm.
+ * The body is streamed from EEPROM to the modem line by line.
+ */
+#define LOG_SERVICE_BATCH   (1)
+#define LOG_BATCH_BODY_SIZE (1024)
+
+
 class LogService
 {
 private:
@@ -46,23 +56,86 @@ private:
 
 	static uint32_t logId;
 
-	static std::unique_ptr<RecordDB> nextRecord;
+	// Unsent records: one memory read per cluster
+	static RecordCursor uploadCursor;
 	static bool newRecordLoaded;
 
 	static constexpr uint32_t settingsDelayMs = 60000;
 
+	static uint32_t uploadPosts;
+	static uint32_t uploadRecords;
+	static uint32_t uploadBytes;
+	static uint32_t uploadAcked;
+	static uint32_t uploadStartMs;
+
+	/*
+	 * The server response is parsed by parts as the modem reads it: the
+	 * "key=value" fields are split by ';' and line breaks ("cf=" starts the
+	 * configuration fields), only the field split between two parts is kept.
+	 * The time is set when its field comes, the other fields are checked
+	 * against d_hwm and cf_id and applied when the response is over.
+	 */
+	typedef enum _ResponseValue {
+		RESPONSE_LOG_ID = 0,
+		RESPONSE_CF_ID,
+		RESPONSE_PWR,
+		RESPONSE_LTRMIN,
+		RESPONSE_LTRMAX,
+		RESPONSE_TRGT,
+		RESPONSE_SLEEP,
+		RESPONSE_SPEED,
+		RESPONSE_CLEAR,
+		RESPONSE_VALUES_COUNT,
+		RESPONSE_TIME = RESPONSE_VALUES_COUNT,
+		RESPONSE_URL
+	} ResponseValue;
+
+	typedef struct _Response {
+		uint32_t fields;                        // (1 << ResponseValue) of the received fields
+		int32_t  values[RESPONSE_VALUES_COUNT];
+		char     url[CHAR_SETIINGS_SIZE];
+		char     field[CHAR_SETIINGS_SIZE + 16]; // The current field
+		uint32_t fieldLen;
+	} Response;
+
+	static Response response;
+
+#if LOG_SERVICE_BATCH
+	static constexpr uint32_t HEADER_SIZE = 120;
+
+	static char     batchHeader[HEADER_SIZE];
+	static bool     batchHeaderSent;
+	static uint32_t batchCount;
+	static uint32_t batchSent;
+
+	static void sendBatchRequest();
+	static uint32_t readBatch(char* buf, uint32_t size);
+#endif
+
+	static uint32_t formatHeader(char* dst, uint32_t size, bool is_base_server);
+	static uint32_t formatRecord(char* dst, uint32_t size, const RecordDB::Record& record);
+#if RECORD_DB_ROLLUP
+	// Record line with the hour rollup fields: n, level_min, level_max, press_1_min, press_1_max
+	static uint32_t formatRollup(char* dst, uint32_t size, const RollupDB::Rollup& rollup);
+#endif
+	// The current upload cursor record or rollup
+	static uint32_t formatUpload(char* dst, uint32_t size);
 	static void sendRequest();
-	static void parse();
+	// sim_response_handler_t for the server responses
+	static void parse(const char* data, uint32_t len);
+	static void parseField();
+	static void applyResponse();
 	static void saveNewLog();
-	static bool findParam(char** dst, const char* src, const char* param);
 	static bool updateTime(char* data);
-	static void clearLog();
 	static void saveResponse();
 
 public:
 	static void update();
-	static void clear() {} // TODO
+	// Drops the records and the upload state (server clr=1 or the clearlog command)
+	static void clear();
 
 	static void updateSleep(uint32_t time);
 
+	static void showUpload();
+
 };
@@ -167,7 +167,7 @@ void pump_clear_log()
     settings.pump_work_sec = 0;
     settings.pump_work_day_sec = 0;
 	_pump_clear_state();
-	set_status(NEED_SAVE_SETTINGS);
+	set_status(NEED_SAVE_COUNTERS);
 }
 
 void pump_show_status()
@@ -413,7 +413,7 @@ void _pump_log_work_time()
 	printTagLog(PUMP_TAG, "update work log: time added (%lu s)", time);
 #endif
 
-	set_status(NEED_SAVE_SETTINGS);
+	set_status(NEED_SAVE_COUNTERS);
 }
 
 void _pump_log_downtime()
@@ -434,7 +434,7 @@ void _pump_log_downtime()
     printTagLog(PUMP_TAG, "update downtime log: time added (%ld s)", time);
 #endif
 
-	set_status(NEED_SAVE_SETTINGS);
+	set_status(NEED_SAVE_COUNTERS);
 }
 
 void _pump_check_log_date()
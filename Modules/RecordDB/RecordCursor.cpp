@@ -0,0 +1,175 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "RecordCursor.h"
+
+#include <string.h>
+
+#include "glog.h"
+#include "StorageAT.h"
+
+
+extern StorageAT storage;
+
+
+const char* RecordCursor::TAG = "RCRC";
+
+uint32_t RecordCursor::clustLoads = 0;
+
+
+RecordCursor::RecordCursor(uint32_t firstId, uint32_t lastId)
+{
+	reset(firstId, lastId);
+}
+
+void RecordCursor::reset(uint32_t firstId, uint32_t lastId)
+{
+	memset(reinterpret_cast<void*>(&record), 0, sizeof(record));
+#if RECORD_DB_ROLLUP
+	isRollup = false;
+#endif
+	m_clust  = nullptr;
+	m_gen    = 0;
+	m_nextId = firstId;
+	m_lastId = lastId;
+	m_loaded = false;
+	m_found  = false;
+	m_cutId  = 0;
+}
+
+RecordDB::RecordStatus RecordCursor::next()
+{
+	if (m_nextId < RecordDB::logFirstId()) {
+		// The log may be cleared while the cursor waits
+		m_nextId = RecordDB::logFirstId();
+		m_loaded = false;
+	}
+
+#if RECORD_DB_ROLLUP
+	// The records may be rolled up while the cursor waits
+	RecordDB::RecordStatus rollupStatus = nextRollup();
+	if (rollupStatus != RecordDB::RECORD_NO_LOG) {
+		return rollupStatus;
+	}
+	isRollup = false;
+#endif
+
+	while (m_nextId <= m_lastId) {
+		if (m_loaded && m_gen != RecordDB::clustGen) {
+			// The view has been taken by another cluster: the position is found again by ID
+			m_loaded = false;
+		}
+		if (!m_loaded) {
+			RecordDB::RecordStatus status = loadClust();
+			if (status != RecordDB::RECORD_OK) {
+				return status;
+			}
+			if (!m_loaded) {
+				// A broken cluster has been skipped
+				continue;
+			}
+		}
+
+		if (!RecordDB::clustNext(m_clust, &m_it)) {
+			// The next cluster or the same one with the records saved after the load
+			if (!m_found) {
+				m_loaded = false;
+				if (m_cutId >= m_nextId) {
+					// The cut records are lost: the upload goes on after them
+					m_nextId = m_cutId + 1;
+					continue;
+				}
+				return RecordDB::RECORD_NO_LOG;
+			}
+			m_loaded = false;
+			continue;
+		}
+		if (m_it.record.id < m_nextId) {
+			continue;
+		}
+		if (m_it.record.id > m_lastId) {
+			break;
+		}
+
+		memcpy(reinterpret_cast<void*>(&record), reinterpret_cast<void*>(&m_it.record), sizeof(record));
+		m_nextId = record.id + 1;
+		m_found  = true;
+		return RecordDB::RECORD_OK;
+	}
+	return RecordDB::RECORD_NO_LOG;
+}
+
+RecordDB::RecordStatus RecordCursor::loadClust()
+{
+	uint32_t address = 0;
+
+	uint32_t lastId  = 0;
+
+	StorageStatus storageStatus = STORAGE_OK;
+	if (RecordDB::indexReady) {
+		storageStatus = RecordDB::indexFind(m_nextId, &address, &lastId) ? STORAGE_OK : STORAGE_NOT_FOUND;
+	} else {
+		storageStatus = storage.find(FIND_MODE_NEXT, &address, RecordDB::RECORD_PREFIX, m_nextId ? m_nextId - 1 : 0);
+	}
+	if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RecordCursor::TAG, "error next: find clust after id=%lu", m_nextId);
+#endif
+		return (storageStatus == STORAGE_NOT_FOUND) ? RecordDB::RECORD_NO_LOG : RecordDB::RECORD_ERROR;
+	}
+
+	uint32_t broken = RecordDB::clustBroken;
+	if (RecordDB::loadClust(address, &m_clust) != RecordDB::RECORD_OK) {
+		if (RecordDB::indexReady && RecordDB::clustBroken != broken) {
+			// The records of a broken cluster are lost: the upload goes on after them
+#if RECORD_BEDUG
+			printTagLog(RecordCursor::TAG, "next: skip broken clust address=%08X", (unsigned int)address);
+#endif
+			m_nextId = lastId + 1;
+			m_loaded = false;
+			return RecordDB::RECORD_OK;
+		}
+#if RECORD_BEDUG
+		printTagLog(RecordCursor::TAG, "error next: load clust address=%08X", (unsigned int)address);
+#endif
+		return RecordDB::RECORD_ERROR;
+	}
+
+	memset(reinterpret_cast<void*>(&m_it), 0, sizeof(m_it));
+	m_gen    = RecordDB::clustGen;
+	m_loaded = true;
+	m_found  = false;
+	m_cutId  = (RecordDB::indexReady && RecordDB::clustBroken != broken) ? lastId : 0;
+	clustLoads++;
+
+	return RecordDB::RECORD_OK;
+}
+
+#if RECORD_DB_ROLLUP
+RecordDB::RecordStatus RecordCursor::nextRollup()
+{
+	if (m_nextId > m_lastId) {
+		return RecordDB::RECORD_NO_LOG;
+	}
+	if (RecordDB::indexReady &&
+		RecordDB::indexCount &&
+		m_nextId >= RecordDB::indexAt(0)->min_id
+	) {
+		// The rollups are older than the oldest cluster
+		return RecordDB::RECORD_NO_LOG;
+	}
+
+	RecordDB::RecordStatus status = RollupDB::find(m_nextId, &rollup);
+	if (status != RecordDB::RECORD_OK) {
+		return status;
+	}
+	if (rollup.id > m_lastId) {
+		return RecordDB::RECORD_NO_LOG;
+	}
+
+	RollupDB::toRecord(&rollup, &record);
+	isRollup = true;
+	m_nextId = rollup.id + 1;
+	m_loaded = false;
+	return RecordDB::RECORD_OK;
+}
+#endif
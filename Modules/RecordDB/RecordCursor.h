@@ -0,0 +1,54 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "RecordDB.h"
+#include "RollupDB.h"
+
+
+/*
+ * Iterates the records with IDs from firstId to lastId in the ID order.
+ * The cursor keeps a view of the current cluster (RecordDB shared buffer or
+ * the staged cluster): the memory is read once per cluster unless the buffer
+ * is taken by another cluster meanwhile.
+ * The rollups (older than all the records) are given first, as records
+ * with the average values and isRollup set.
+ */
+class RecordCursor
+{
+public:
+    RecordCursor(uint32_t firstId = 0, uint32_t lastId = UINT32_MAX);
+
+    void reset(uint32_t firstId, uint32_t lastId = UINT32_MAX);
+    // Loads the next record to record, RECORD_NO_LOG after the last one
+    RecordDB::RecordStatus next();
+
+    RecordDB::Record record = {};
+#if RECORD_DB_ROLLUP
+    RollupDB::Rollup rollup = {};
+    bool isRollup = false;
+#endif
+
+    // Clusters loaded by all the cursors
+    static uint32_t clustLoads;
+
+private:
+    static const char* TAG;
+
+    const RecordDB::RecordClust* m_clust; // Current cluster view
+    uint32_t            m_gen;    // RecordDB::clustGen of the view
+    RecordDB::ClustIter m_it;
+    uint32_t            m_nextId;
+    uint32_t            m_lastId;
+    bool                m_loaded;
+    bool                m_found;  // The current cluster has given a record
+    uint32_t            m_cutId;  // Last ID of the current cluster when its broken records are cut off, 0 else
+
+    RecordDB::RecordStatus loadClust();
+#if RECORD_DB_ROLLUP
+    RecordDB::RecordStatus nextRollup();
+#endif
+};
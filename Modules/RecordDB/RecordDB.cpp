@@ -3,18 +3,31 @@
 #include "RecordDB.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "StorageAT.h"
 
 #include "glog.h"
 #include "soul.h"
+#include "clock.h"
 #include "gutils.h"
+#include "defines.h"
+#include "system.h"
 #include "settings.h"
 #include "liquid_sensor.h"
 
+#include "RollupDB.h"
+#include "SettingsDB.h"
+#include "StorageDriver.h"
+
+
+#define __zigzag_encode(value) ((uint32_t)(((uint32_t)(value) << 1) ^ (uint32_t)((int32_t)(value) >> 31)))
+#define __zigzag_decode(value) ((uint32_t)(((uint32_t)(value) >> 1) ^ (uint32_t)(-(int32_t)((value) & 1))))
+
 
 extern StorageAT storage;
+extern StorageDriver storageDriver;
 
 extern settings_t settings;
 
@@ -22,19 +35,83 @@ extern settings_t settings;
 const char* RecordDB::RECORD_PREFIX = "RCR";
 const char* RecordDB::TAG = "RCR";
 
+RecordDB::ClustEntry RecordDB::index[RECORD_INDEX_SIZE] = {};
+uint32_t RecordDB::indexHead   = 0;
+uint32_t RecordDB::indexCount  = 0;
+bool     RecordDB::indexReady  = false;
+bool     RecordDB::storageFull = false;
+
+bool     RecordDB::mountFast   = false;
+uint32_t RecordDB::mountMs     = 0;
+uint32_t RecordDB::clearMs     = 0;
+#if !RECORD_DB_RING_LOG
+bool     RecordDB::staleClusters = false;
+#endif
+
+#if RECORD_DB_FAST_MOUNT
+const char* RecordDB::MOUNT_PREFIX = "MNT";
+const char* RecordDB::DIR_PREFIX   = "DIR";
+
+RecordDB::MountSummary RecordDB::mountSummary = {};
+uint32_t RecordDB::mountAddress = 0;
+bool     RecordDB::mountFound   = false;
+bool     RecordDB::mountClean   = false;
+#endif
+
+#if RECORD_DB_RING_LOG
+uint32_t RecordDB::logHead     = 0;
+uint32_t RecordDB::logSeq      = 0;
+RecordDB::ClustIter RecordDB::logTail = {};
+#endif
+
+#if RECORD_DB_STAGING
+RecordDB::RecordClust RecordDB::stageClust = {};
+RecordDB::ClustIter RecordDB::stageTail    = {};
+uint32_t RecordDB::stageAddress   = 0;
+uint32_t RecordDB::stageOffset    = 0;
+bool     RecordDB::stageValid     = false;
+bool     RecordDB::stageDirty     = false;
+util_old_timer_t RecordDB::stageTimer = {};
+#endif
+
+#if RECORD_DB_STAGING && RECORD_DB_RING_LOG
+bool     RecordDB::stageFlushing  = false;
+RecordDB::ClustIter RecordDB::flushTail = {};
+uint32_t RecordDB::flushEnd       = 0;
+#endif
+
+RecordDB::RecordClust RecordDB::clust = {};
+uint32_t RecordDB::clustGen       = 0;
+
+uint32_t RecordDB::savedCount     = 0;
+uint32_t RecordDB::saveReadBytes  = 0;
+uint32_t RecordDB::saveWriteBytes = 0;
+uint32_t RecordDB::clustWrites    = 0;
+uint32_t RecordDB::clustBroken    = 0;
+
 
 RecordDB::RecordDB(uint32_t recordId): m_recordId(recordId) { }
 
 RecordDB::RecordStatus RecordDB::load()
 {
+    if (this->m_recordId < logFirstId()) {
+    	// Cleared with the log
+    	return RECORD_NO_LOG;
+    }
+
     uint32_t address = 0;
 
-    StorageStatus storageStatus = storage.find(FIND_MODE_EQUAL, &address, RECORD_PREFIX, this->record.id);
-    if (storageStatus == STORAGE_BUSY) {
-    	return RECORD_ERROR;
-    }
-    if (storageStatus != STORAGE_OK) {
-    	storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, this->record.id);
+    StorageStatus storageStatus = STORAGE_OK;
+    if (indexReady) {
+    	storageStatus = indexFind(this->m_recordId, &address) ? STORAGE_OK : STORAGE_NOT_FOUND;
+    } else {
+		storageStatus = storage.find(FIND_MODE_EQUAL, &address, RECORD_PREFIX, this->m_recordId);
+		if (storageStatus == STORAGE_BUSY) {
+			return RECORD_ERROR;
+		}
+		if (storageStatus != STORAGE_OK) {
+			storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, this->m_recordId);
+		}
     }
     if (storageStatus != STORAGE_OK) {
 #if RECORD_BEDUG
@@ -43,7 +120,8 @@ RecordDB::RecordStatus RecordDB::load()
         return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
     }
 
-    RecordStatus recordStatus = this->loadClust(address);
+    const RecordClust* view = nullptr;
+    RecordStatus recordStatus = loadClust(address, &view);
     if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
         printTagLog(RecordDB::TAG, "error load: load clust");
@@ -52,11 +130,10 @@ RecordDB::RecordStatus RecordDB::load()
     }
 
     bool recordFound = false;
-    unsigned id;
-    for (unsigned i = 0; i < CLUST_SIZE; i++) {
-    	if (this->m_clust.records[i].id == this->m_recordId) {
+    ClustIter it = {};
+    while (clustNext(view, &it)) {
+    	if (it.record.id == this->m_recordId) {
     		recordFound = true;
-    		id = i;
     		break;
     	}
     }
@@ -67,7 +144,7 @@ RecordDB::RecordStatus RecordDB::load()
         return RECORD_NO_LOG;
     }
 
-    memcpy(reinterpret_cast<void*>(&(this->record)), reinterpret_cast<void*>(&(this->m_clust.records[id])), sizeof(this->record));
+    memcpy(reinterpret_cast<void*>(&(this->record)), reinterpret_cast<void*>(&(it.record)), sizeof(this->record));
 
 #if RECORD_BEDUG
     printTagLog(RecordDB::TAG, "record loaded from address=%08X", (unsigned int)address);
@@ -79,8 +156,15 @@ RecordDB::RecordStatus RecordDB::load()
 RecordDB::RecordStatus RecordDB::loadNext()
 {
     uint32_t address = 0;
+    // The cleared records are skipped
+    uint32_t afterId = __max(this->m_recordId, logFirstId() ? logFirstId() - 1 : 0);
 
-    StorageStatus storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, this->m_recordId);
+    StorageStatus storageStatus = STORAGE_OK;
+    if (indexReady) {
+    	storageStatus = indexFind(afterId + 1, &address) ? STORAGE_OK : STORAGE_NOT_FOUND;
+    } else {
+    	storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, afterId);
+    }
     if (storageStatus != STORAGE_OK) {
 #if RECORD_BEDUG
         printTagLog(RecordDB::TAG, "error load next: find next record");
@@ -88,7 +172,8 @@ RecordDB::RecordStatus RecordDB::loadNext()
         return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
     }
 
-    RecordStatus recordStatus = this->loadClust(address);
+    const RecordClust* view = nullptr;
+    RecordStatus recordStatus = loadClust(address, &view);
     if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
         printTagLog(RecordDB::TAG, "error load next: load clust");
@@ -97,13 +182,10 @@ RecordDB::RecordStatus RecordDB::loadNext()
     }
 
     bool recordFound = false;
-	unsigned idx;
-	uint32_t curId = 0xFFFFFFFF;
-	for (unsigned i = 0; i < CLUST_SIZE; i++) {
-		if (this->m_clust.records[i].id > this->m_recordId && curId > this->m_clust.records[i].id) {
-			curId =this->m_clust.records[i].id;
+    ClustIter it = {};
+	while (clustNext(view, &it)) {
+		if (it.record.id > afterId) {
 			recordFound = true;
-			idx = i;
 			break;
 		}
 	}
@@ -116,7 +198,7 @@ RecordDB::RecordStatus RecordDB::loadNext()
 
     memcpy(
 		reinterpret_cast<void*>(&(this->record)),
-		reinterpret_cast<void*>(&(this->m_clust.records[idx])),
+		reinterpret_cast<void*>(&(it.record)),
 		sizeof(this->record)
 	);
 
@@ -129,6 +211,18 @@ RecordDB::RecordStatus RecordDB::loadNext()
 
 RecordDB::RecordStatus RecordDB::save()
 {
+    uint32_t readBytes  = StorageDriver::readBytes;
+    uint32_t writeBytes = StorageDriver::writeBytes;
+
+#if RECORD_DB_RING_LOG
+    if (!indexReady && buildIndex() != RECORD_OK) {
+#   if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error save: build index");
+#   endif
+        return RECORD_ERROR;
+    }
+#endif
+
     uint32_t id = 0;
     RecordStatus recordStatus = getNewId(&id);
     if (recordStatus != RECORD_OK) {
@@ -141,99 +235,57 @@ RecordDB::RecordStatus RecordDB::save()
     this->record.id = id;
 
     uint32_t address = 0;
-    StorageFindMode findMode = FIND_MODE_MAX;
-    StorageStatus storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-    if (storageStatus == STORAGE_BUSY) {
-    	return RECORD_ERROR;
-    }
-
-	bool idFound = false;
-	uint32_t idx;
-    while (storageStatus != STORAGE_OOM) {
-		if (storageStatus != STORAGE_OK) {
-			findMode = FIND_MODE_EMPTY;
-			storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-		}
-		if (storageStatus != STORAGE_OK) {
-			findMode = FIND_MODE_MIN;
-			storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-		}
-		if (storageStatus == STORAGE_BUSY) {
-#if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: find address for save record (storage busy)");
-#endif
-			return RECORD_ERROR;
-		}
-		if (storageStatus != STORAGE_OK) {
-#if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: find address for save record");
-#endif
-			return RECORD_ERROR;
-		}
-
-		if (findMode != FIND_MODE_EMPTY) {
-			recordStatus = this->loadClust(address);
-		}
-		if (recordStatus != RECORD_OK) {
-#if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: load clust");
+    uint32_t offset  = 0;
+    uint32_t size    = 0;
+    ClustIter tail   = {};
+#if RECORD_DB_STAGING
+    if (indexReady && stageValid && clustAppend(&stageClust, &stageTail, &this->record)) {
+    	// The record stays in RAM until the next flush
+    	address = stageAddress;
+    } else {
+    	recordStatus = flushStage();
+    	if (recordStatus == RECORD_OK) {
+    		recordStatus = findSaveClust(&address, &offset, &size, &tail);
+    	}
+    	if (recordStatus == RECORD_OK && indexReady) {
+    		recordStatus = stageNewClust(address, offset, size, &tail);
+#if !RECORD_DB_RING_LOG
+    		if (recordStatus == RECORD_OK) {
+    			// The new cluster takes its page at once: the settings, counters, rollups
+    			// and the directory find the free pages by the storage headers
+    			stageDirty   = true;
+    			recordStatus = flushStage();
+    		}
 #endif
-			return RECORD_ERROR;
-		}
-		if (findMode == FIND_MODE_MIN || findMode == FIND_MODE_EMPTY) {
-			memset(reinterpret_cast<void*>(&(this->m_clust)), 0, sizeof(this->m_clust));
-		}
-
-		idFound = false;
-		for (unsigned i = 0; i < __arr_len(this->m_clust.records); i++) {
-			if (this->m_clust.records[i].id == 0) {
-				idFound = true;
-				idx = i;
-				break;
-			}
-		}
-		if (idFound) {
-			break;
-		}
-
-		storageStatus = STORAGE_ERROR;
+    	} else if (recordStatus == RECORD_OK) {
+    		recordStatus = commitClust(&clust, &tail, address, offset);
+    	}
     }
-
-    if (!idFound) {
-#if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error save: find record id in clust");
-#endif
-        return RECORD_ERROR;
+    if (recordStatus == RECORD_OK && indexReady && !stageDirty && clustOffset(&stageTail) != stageOffset) {
+    	stageDirty = true;
+    	util_old_timer_start(&stageTimer, RECORD_STAGE_DELAY_MS);
     }
-
-    this->m_clust.record_magic = CLUST_MAGIC;
-    memcpy(
-		reinterpret_cast<void*>(&(this->m_clust.records[idx])),
-		reinterpret_cast<void*>(&(this->record)),
-		sizeof(this->record)
-	);
-    if (idx < CLUST_SIZE) {
-    	memset(
-			reinterpret_cast<void*>(&(this->m_clust.records[idx + 1])),
-			0,
-			((CLUST_SIZE - idx - 1) * sizeof(struct _Record))
-		);
+#else
+    recordStatus = findSaveClust(&address, &offset, &size, &tail);
+    if (recordStatus == RECORD_OK) {
+    	recordStatus = commitClust(&clust, &tail, address, offset);
     }
-
-    storageStatus = storage.rewrite(
-        address,
-        RECORD_PREFIX,
-        this->record.id,
-        reinterpret_cast<uint8_t*>(&this->m_clust),
-        sizeof(this->m_clust)
-    );
-    if (storageStatus != STORAGE_OK) {
+#endif
+    if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
         printTagLog(RecordDB::TAG, "error save: save clust");
 #endif
         return RECORD_ERROR;
     }
 
+    if (indexReady) {
+    	indexUpdate(address, this->record.id);
+    }
+
+    savedCount++;
+    saveReadBytes  += StorageDriver::readBytes - readBytes;
+    saveWriteBytes += StorageDriver::writeBytes - writeBytes;
+
     set_status(HAS_NEW_RECORD);
 
 #if RECORD_BEDUG
@@ -257,73 +309,1702 @@ RecordDB::RecordStatus RecordDB::save()
     return RECORD_OK;
 }
 
-RecordDB::RecordStatus RecordDB::loadClust(uint32_t address)
+RecordDB::RecordStatus RecordDB::mount()
 {
-    RecordClust tmpClust;
-    StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(&tmpClust), sizeof(tmpClust));
-    if (status != STORAGE_OK) {
+	uint32_t start = HAL_GetTick();
+	RecordStatus recordStatus = RECORD_ERROR;
+
+	mountFast = false;
+#if RECORD_DB_FAST_MOUNT
+	if (loadDirectory() == RECORD_OK) {
+		mountFast    = true;
+		recordStatus = RECORD_OK;
+	}
+#endif
+	if (!mountFast) {
+		recordStatus = buildIndex();
+	}
+
+	mountMs = HAL_GetTick() - start;
+
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load clust");
+	printTagLog(RecordDB::TAG, "storage mounted (%s) in %lu ms", mountFast ? "clean" : "rebuilt", mountMs);
 #endif
-        return RECORD_ERROR;
-    }
 
-    if (tmpClust.record_magic != CLUST_MAGIC) {
+	return recordStatus;
+}
+
+RecordDB::RecordStatus RecordDB::unmount()
+{
+	RecordStatus recordStatus = flush();
+#if RECORD_DB_FAST_MOUNT
+	if (recordStatus == RECORD_OK && indexReady && !mountClean) {
+		recordStatus = saveDirectory();
+	}
+#endif
+	return recordStatus;
+}
+
+RecordDB::RecordStatus RecordDB::buildIndex()
+{
+#if RECORD_DB_STAGING
+	flushStage();
+	stageValid = false;
+#endif
+
+#if RECORD_DB_FAST_MOUNT
+	// The directory pages are looked up again on the next unmount (the storage may be formatted)
+	mountFound = false;
+	mountReset();
+#endif
+
+	indexReady  = false;
+	indexHead   = 0;
+	indexCount  = 0;
+	storageFull = false;
+
+	// The clusters are scanned in the shared buffer
+	clustGen++;
+	// The clusters of the cleared log generations are skipped
+	uint32_t lastId = logFirstId() ? logFirstId() - 1 : 0;
+#if !RECORD_DB_RING_LOG
+	staleClusters = (lastId > 0);
+#endif
+
+#if RECORD_DB_RING_LOG
+	uint32_t head = 0;
+	uint32_t seq  = 0;
+	RecordStatus recordStatus = findLogHead(&head, &seq);
+	if (recordStatus == RECORD_NO_LOG) {
+		logHead    = RECORD_LOG_SLOTS - 1;
+		logSeq     = 0;
+		indexReady = true;
+		return RECORD_OK;
+	}
+	if (recordStatus != RECORD_OK) {
+#   if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "error build index: find log head");
+#   endif
+		return RECORD_ERROR;
+	}
+
+	// The slots after the head belong to the previous lap if the log has been wrapped,
+	// the slot after the head may be torn by an interrupted re-open
+	uint32_t oldest = 0;
+	StorageStatus status = STORAGE_OK;
+	for (uint32_t distance = 1; distance <= 2; distance++) {
+		uint32_t slotSeq = 0;
+		status = readLogSeq((head + distance) % RECORD_LOG_SLOTS, &slotSeq);
+		if (status != STORAGE_OK && status != STORAGE_NOT_FOUND) {
+			return RECORD_ERROR;
+		}
+		if (status == STORAGE_OK && slotSeq + RECORD_LOG_SLOTS - distance == seq) {
+			oldest      = (head + 1) % RECORD_LOG_SLOTS;
+			storageFull = true;
+			break;
+		}
+	}
+
+	for (uint32_t slot = oldest; ; slot = (slot + 1) % RECORD_LOG_SLOTS) {
+		uint32_t address = logAddress(slot);
+		status = storageDriver.read(address, reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+		if (status != STORAGE_OK) {
+#   if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error build index: load slot address=%08X", (unsigned int)address);
+#   endif
+			return RECORD_ERROR;
+		}
+
+		// Torn or foreign slots are skipped: the log continues from the head
+		uint32_t minId = 0xFFFFFFFF;
+		uint32_t maxId = 0;
+		ClustIter it = {};
+		if (clustValid(&clust)) {
+			while (clustNext(&clust, &it)) {
+				minId = __min(minId, it.record.id);
+				maxId = __max(maxId, it.record.id);
+			}
+		}
+		if (maxId > lastId && minId > lastId && maxId - minId <= UINT8_MAX) {
+			ClustEntry* entry = &index[indexCount++];
+			entry->min_id = minId;
+			entry->page   = static_cast<uint16_t>(address / STORAGE_PAGE_SIZE);
+			entry->span   = static_cast<uint8_t>(maxId - minId);
+
+			lastId = maxId;
+		}
+
+		if (slot == head) {
+			logTail = it;
+			break;
+		}
+	}
+
+	logHead = head;
+	logSeq  = seq;
+#else
+	// One pass over the pages, the index is kept sorted by the record IDs
+	uint32_t start = HAL_GetTick();
+	for (uint32_t page = 0; page < EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE / STORAGE_PAGE_SIZE; page++) {
+		if (HAL_GetTick() - start > RECORD_INDEX_BUILD_MS) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error record magic clust");
+			printTagLog(RecordDB::TAG, "error build index: timeout, %lu clusters indexed", indexCount);
 #endif
-        return RECORD_ERROR;
-    }
+			return RECORD_ERROR;
+		}
 
-    memcpy(reinterpret_cast<void*>(&this->m_clust), reinterpret_cast<void*>(&tmpClust), sizeof(this->m_clust));
+		uint32_t address = page * STORAGE_PAGE_SIZE;
+		StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+		if (status == STORAGE_BUSY) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error build index: load page address=%08X", (unsigned int)address);
+#endif
+			return RECORD_ERROR;
+		}
+		// Empty pages and the other records are skipped
+		if (status != STORAGE_OK || !clustValid(&clust)) {
+			continue;
+		}
 
+		uint32_t minId = 0xFFFFFFFF;
+		uint32_t maxId = 0;
+		ClustIter it = {};
+		while (clustNext(&clust, &it)) {
+			minId = __min(minId, it.record.id);
+			maxId = __max(maxId, it.record.id);
+		}
+		if (maxId <= lastId || minId <= lastId || maxId - minId > UINT8_MAX) {
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "clust loaded from address=%08X", (unsigned int)address);
+			printTagLog(RecordDB::TAG, "build index: skip clust address=%08X", (unsigned int)address);
+#endif
+			continue;
+		}
+		if (indexCount >= __arr_len(index)) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error build index: index overflow");
 #endif
+			return RECORD_ERROR;
+		}
 
-    return RECORD_OK;
+		// The clusters are written in the ID order, the reused pages break it
+		uint32_t position = indexCount;
+		while (position && index[position - 1].min_id > minId) {
+			index[position] = index[position - 1];
+			position--;
+		}
+		index[position].min_id = minId;
+		index[position].page   = static_cast<uint16_t>(page);
+		index[position].span   = static_cast<uint8_t>(maxId - minId);
+		indexCount++;
+	}
+
+	// The overlapping clusters (an interrupted reuse) are dropped
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < indexCount; i++) {
+		if (index[i].min_id <= lastId) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "build index: skip clust address=%08X", (unsigned int)(index[i].page * STORAGE_PAGE_SIZE));
+#endif
+			continue;
+		}
+		lastId = index[i].min_id + index[i].span;
+		index[count++] = index[i];
+	}
+	indexCount = count;
+#endif
+
+	indexReady = true;
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "index built: %lu clusters, max ID=%lu", indexCount, lastId);
+#endif
+
+	return RECORD_OK;
 }
 
-RecordDB::RecordStatus RecordDB::getNewId(uint32_t *newId)
+RecordDB::RecordStatus RecordDB::flush()
 {
-    uint32_t address = 0;
+	uint32_t readBytes  = StorageDriver::readBytes;
+	uint32_t writeBytes = StorageDriver::writeBytes;
 
-    StorageStatus status = storage.find(FIND_MODE_MAX, &address, RECORD_PREFIX);
-    if (status == STORAGE_NOT_FOUND) {
-        *newId = 1;
+	RecordStatus recordStatus = flushStage();
+
+	saveReadBytes  += StorageDriver::readBytes - readBytes;
+	saveWriteBytes += StorageDriver::writeBytes - writeBytes;
+
+	return recordStatus;
+}
+
+RecordDB::RecordStatus RecordDB::flushStage()
+{
+#if RECORD_DB_STAGING
+#if RECORD_DB_RING_LOG
+	if (stageFlushing) {
+		// The background flush moves the stage offset
+		StorageDriver::wait();
+	}
+#endif
+	if (!stageDirty) {
+		return RECORD_OK;
+	}
+
+	RecordStatus recordStatus = commitClust(&stageClust, &stageTail, stageAddress, stageOffset);
+	if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "max ID not found, reset max ID");
+		printTagLog(RecordDB::TAG, "error flush: save clust address=%08X", (unsigned int)stageAddress);
 #endif
-        return RECORD_OK;
-    }
-    if (status != STORAGE_OK) {
+		return RECORD_ERROR;
+	}
+
+	// The next records are appended after the written ones
+	stageOffset = clustOffset(&stageTail);
+	stageDirty  = false;
+
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error get new id");
+	printTagLog(RecordDB::TAG, "clust flushed to address=%08X", (unsigned int)stageAddress);
 #endif
-        return RECORD_ERROR;
-    }
+#endif
+	return RECORD_OK;
+}
 
-    RecordClust tmpClust;
-    status = storage.load(address, reinterpret_cast<uint8_t*>(&tmpClust), sizeof(tmpClust));
-    if (status != STORAGE_OK) {
+#if RECORD_DB_STAGING && RECORD_DB_RING_LOG
+void RecordDB::flushAsync()
+{
+	if (!stageDirty || stageFlushing) {
+		return;
+	}
+#if RECORD_DB_FAST_MOUNT
+	if (mountDirty() != RECORD_OK) {
+		return;
+	}
+#endif
+
+#if RECORD_LOG_CRC && RECORD_DB_PACKED
+	clustSeal(&stageClust, &stageTail);
+#endif
+
+	// The new records are appended after flushEnd: the written bytes stay unchanged
+	uint32_t offset = stageOffset;
+	uint32_t size   = offset ? clustOffset(&stageTail) - offset : sizeof(stageClust);
+	uint32_t writeBytes = StorageDriver::writeBytes;
+
+	flushTail     = stageTail;
+	flushEnd      = clustOffset(&stageTail);
+	stageFlushing = true;
+	stageDirty    = false;
+	StorageStatus status = StorageDriver::writeAsync(
+		stageAddress + offset,
+		reinterpret_cast<uint8_t*>(&stageClust) + offset,
+		size,
+		flushDone
+	);
+	if (status != STORAGE_OK) {
+		stageFlushing = false;
+		stageDirty    = true;
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error get new id");
+		printTagLog(RecordDB::TAG, "error flush: queue clust address=%08X", (unsigned int)stageAddress);
 #endif
-        return RECORD_ERROR;
-    }
+	}
 
-    *newId = 0;
-    for (unsigned i = 0; i < __arr_len(tmpClust.records); i++) {
-    	if (*newId < tmpClust.records[i].id) {
-    		*newId = tmpClust.records[i].id;
-    	}
-    }
+	saveWriteBytes += StorageDriver::writeBytes - writeBytes;
+}
 
-    *newId = *newId + 1;
+void RecordDB::flushDone(StorageStatus status)
+{
+	stageFlushing = false;
+	if (status != STORAGE_OK) {
+		// Written again by the next flush
+		stageDirty = true;
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "error flush: save clust address=%08X", (unsigned int)stageAddress);
+#endif
+		return;
+	}
+
+	clustCommitted(&stageClust, &flushTail, stageAddress, stageOffset);
+	stageOffset = flushEnd;
 
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "new ID received from address=%08X id=%lu", (unsigned int)address, *newId);
+	printTagLog(RecordDB::TAG, "clust flushed to address=%08X", (unsigned int)stageAddress);
+#endif
+}
 #endif
 
-    return RECORD_OK;
+RecordDB::RecordStatus RecordDB::clear()
+{
+	uint32_t start = HAL_GetTick();
+
+	uint32_t firstId = 0;
+	if (RecordDB().getNewId(&firstId) != RECORD_OK) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "error clear: get new id");
+#endif
+		return RECORD_ERROR;
+	}
+
+#if RECORD_DB_STAGING
+#if RECORD_DB_RING_LOG
+	if (stageFlushing) {
+		// The background flush moves the stage offset
+		StorageDriver::wait();
+	}
+#endif
+#endif
+
+	// The clusters are not erased: IDs below the new generation are free space.
+	// The generation is saved at once, a reset must not bring the records back.
+	uint32_t prevFirstId = settings.log_first_id;
+	settings.log_first_id = firstId;
+	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
+	if (settingsDB.save() != SETTINGS_OK) {
+		settings.log_first_id = prevFirstId;
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "error clear: save settings");
+#endif
+		return RECORD_ERROR;
+	}
+
+#if RECORD_DB_STAGING
+	// The staged records are cleared without the write
+	stageValid = false;
+	stageDirty = false;
+#endif
+
+	indexHead  = 0;
+	indexCount = 0;
+#if !RECORD_DB_RING_LOG
+	staleClusters = true;
+#endif
+	// The cursor views are loaded again
+	clustGen++;
+#if RECORD_DB_ROLLUP
+	// The rollups are cleared with the records: the newest page is not continued
+	RollupDB::invalidate();
+#endif
+
+	clearMs = HAL_GetTick() - start;
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "log cleared in %lu ms, first ID=%lu", clearMs, firstId);
+#endif
+
+	return RECORD_OK;
 }
+
+RecordDB::RecordStatus RecordDB::format()
+{
+#if RECORD_DB_RING_LOG
+#   if RECORD_DB_STAGING
+	if (stageFlushing) {
+		StorageDriver::wait();
+	}
+#   endif
+
+	// The ring log is out of the StorageAT area: the slot headers are erased as on a new chip
+	uint8_t header[offsetof(RecordClust, record_magic) + sizeof(uint8_t)];
+	memset(header, 0xFF, sizeof(header));
+	for (uint32_t slot = 0; slot < RECORD_LOG_SLOTS; slot++) {
+		StorageStatus status = storageDriver.write(logAddress(slot), header, sizeof(header));
+		if (status != STORAGE_OK) {
+#   if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error format: erase slot=%lu (error=%02X)", slot, status);
+#   endif
+			return RECORD_ERROR;
+		}
+	}
+#endif
+
+	settings.log_first_id = 0;
+
+#if RECORD_DB_STAGING
+	stageValid = false;
+	stageDirty = false;
+#endif
+
+	return buildIndex();
+}
+
+void RecordDB::update()
+{
+#if RECORD_DB_STAGING
+	if (stageDirty && !util_old_timer_wait(&stageTimer)) {
+#if RECORD_DB_RING_LOG
+		// The main loop is not blocked by the slot write
+		flushAsync();
+#else
+		// StorageAT writes are synchronous
+		flush();
+#endif
+		util_old_timer_start(&stageTimer, RECORD_STAGE_DELAY_MS);
+	}
+#endif
+}
+
+void RecordDB::showStorage()
+{
+	if (!indexReady) {
+		gprint("Record index is not ready\n");
+		return;
+	}
+
+	uint32_t minId = 0;
+	uint32_t maxId = 0;
+	uint32_t records = 0;
+	for (uint32_t i = 0; i < indexCount; i++) {
+		records += static_cast<uint32_t>(indexAt(i)->span) + 1;
+	}
+	if (indexCount) {
+		minId = indexAt(0)->min_id;
+		maxId = indexAt(indexCount - 1)->min_id + indexAt(indexCount - 1)->span;
+	}
+
+	uint32_t retention = (records * (settings.sleep_time / MILLIS_IN_SECOND)) / SECONDS_PER_MINUTE;
+
+	// Records per KB of the memory taken by the clusters
+#if RECORD_DB_RING_LOG
+	uint32_t clustBytes = RECORD_LOG_SLOT_SIZE;
+#else
+	uint32_t clustBytes = STORAGE_PAGE_SIZE;
+#endif
+	uint32_t densityX100 = indexCount ? (records * 1024 * 100) / (indexCount * clustBytes) : 0;
+
+	// Write amplification: EEPROM bytes written / record bytes
+	uint32_t recordBytes     = savedCount * sizeof(struct _Record);
+	uint32_t clustWritesX100 = savedCount ? (clustWrites * 100) / savedCount : 0;
+	uint32_t recordWafX100   = recordBytes ? (saveWriteBytes * 100) / recordBytes : 0;
+	uint32_t totalWafX100    = recordBytes ? (StorageDriver::writeBytes * 100) / recordBytes : 0;
+	uint32_t staged          = 0;
+#if RECORD_DB_STAGING
+	if (stageValid && stageDirty) {
+		ClustIter it = {};
+		while (clustNext(&stageClust, &it)) {
+			staged += (clustOffset(&it) > stageOffset) ? 1 : 0;
+		}
+	}
+#endif
+	gprint(
+		"\n####################STORAGE#####################\n"
+#if RECORD_DB_RING_LOG
+		"Layout:           ring log, %lu page segments\n"
+#else
+		"Layout:           StorageAT\n"
+#endif
+		"Mount:            %s, %lu ms\n"
+		"Last clear:       %lu ms (first ID %lu)\n"
+		"Clusters:         %lu (%s)\n"
+		"Records:          %lu (%lu per cluster, %lu.%02lu per KB)\n"
+		"Oldest ID:        %lu\n"
+		"Newest ID:        %lu\n"
+		"Retention:        %lu d %lu h %lu min\n"
+		"Saved records:    %lu\n"
+		"Cluster writes:   %lu (%lu.%02lu per record)\n"
+		"Staged records:   %lu\n"
+		"I2C per record:   %lu read, %lu write bytes\n"
+		"Write amplif.:    %lu.%02lu (records), %lu.%02lu (total)\n"
+		"Broken clusters:  %lu\n"
+#if RECORD_DB_ROLLUP
+		"Rollups:          %lu (%lu records, %lu pages dropped)\n"
+#endif
+		"####################STORAGE#####################\n",
+#if RECORD_DB_RING_LOG
+		static_cast<uint32_t>(RECORD_LOG_SEGMENT_PAGES),
+#endif
+		mountFast ? "clean" : "rebuilt",
+		mountMs,
+		clearMs,
+		logFirstId(),
+		indexCount,
+		storageFull ? "full" : "not full",
+		records,
+		indexCount ? records / indexCount : 0,
+		densityX100 / 100,
+		densityX100 % 100,
+		minId,
+		maxId,
+		retention / (MINUTES_PER_HOUR * HOURS_PER_DAY),
+		(retention / MINUTES_PER_HOUR) % HOURS_PER_DAY,
+		retention % MINUTES_PER_HOUR,
+		savedCount,
+		clustWrites,
+		clustWritesX100 / 100,
+		clustWritesX100 % 100,
+		staged,
+		savedCount ? saveReadBytes / savedCount : 0,
+		savedCount ? saveWriteBytes / savedCount : 0,
+		recordWafX100 / 100,
+		recordWafX100 % 100,
+		totalWafX100 / 100,
+		totalWafX100 % 100,
+		clustBroken
+#if RECORD_DB_ROLLUP
+		,
+		RollupDB::rollups,
+		RollupDB::rolledRecords,
+		RollupDB::dropped
+#endif
+	);
+}
+
+RecordDB::RecordStatus RecordDB::loadClust(uint32_t address, const RecordClust** view)
+{
+#if RECORD_DB_STAGING
+    if (stageValid && address == stageAddress) {
+    	// Staged records may be not written yet
+    	*view = &stageClust;
+    	return RECORD_OK;
+    }
+#endif
+
+    clustGen++;
+#if RECORD_DB_RING_LOG
+    StorageStatus status = storageDriver.read(address, reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+#else
+    StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+#endif
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error load clust");
+#endif
+        return RECORD_ERROR;
+    }
+
+    if (!clustValid(&clust)) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error record magic or CRC clust address=%08X", (unsigned int)address);
+#endif
+        return RECORD_ERROR;
+    }
+
+    *view = &clust;
+
+#if RECORD_BEDUG
+    printTagLog(RecordDB::TAG, "clust loaded from address=%08X", (unsigned int)address);
+#endif
+
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::getNewId(uint32_t *newId)
+{
+	if (indexReady) {
+		*newId = indexCount ? indexAt(indexCount - 1)->min_id + indexAt(indexCount - 1)->span + 1 : 1;
+		*newId = __max(*newId, logFirstId());
+		return RECORD_OK;
+	}
+
+    uint32_t address = 0;
+
+    StorageStatus status = storage.find(FIND_MODE_MAX, &address, RECORD_PREFIX);
+    if (status == STORAGE_NOT_FOUND) {
+        *newId = __max(1, logFirstId());
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "max ID not found, reset max ID");
+#endif
+        return RECORD_OK;
+    }
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error get new id");
+#endif
+        return RECORD_ERROR;
+    }
+
+    clustGen++;
+    status = storage.load(address, reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error get new id");
+#endif
+        return RECORD_ERROR;
+    }
+
+    *newId = 0;
+    ClustIter it = {};
+    while (clustNext(&clust, &it)) {
+    	if (*newId < it.record.id) {
+    		*newId = it.record.id;
+    	}
+    }
+
+    *newId = __max(*newId + 1, logFirstId());
+
+#if RECORD_BEDUG
+    printTagLog(RecordDB::TAG, "new ID received from address=%08X id=%lu", (unsigned int)address, *newId);
+#endif
+
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::findSaveClust(uint32_t *address, uint32_t *offset, uint32_t *size, ClustIter *tail)
+{
+	RecordStatus recordStatus = RECORD_OK;
+	StorageStatus storageStatus = STORAGE_OK;
+
+	*offset = 0;
+	*size   = sizeof(clust);
+
+	// The new record is appended in the shared buffer
+	clustGen++;
+
+#if RECORD_DB_RING_LOG
+	(void)recordStatus;
+	(void)storageStatus;
+
+	// Records are appended to the head slot
+	if (indexCount && indexAt(indexCount - 1)->page == logAddress(logHead) / STORAGE_PAGE_SIZE) {
+		*tail = logTail;
+		uint32_t start = clustOffset(tail);
+		// Only the new bytes are written: the record CRC takes the slot sequence number
+		clust.seq = logSeq;
+		if (clustAppend(&clust, tail, &this->record)) {
+			*address = logAddress(logHead);
+			*offset  = start;
+			*size    = clustOffset(tail) - start;
+			return RECORD_OK;
+		}
+	}
+
+#if RECORD_DB_ROLLUP
+	uint32_t nextAddress = logAddress((logHead + 1) % RECORD_LOG_SLOTS);
+	if (storageFull && indexCount && indexAt(0)->page == nextAddress / STORAGE_PAGE_SIZE) {
+		// Ring slots are not given to the rollups
+		bool spareUsed = false;
+		if (rollupClust(nextAddress, false, &spareUsed) != RECORD_OK) {
+#   if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error save: rollup oldest slot");
+#   endif
+			return RECORD_ERROR;
+		}
+	}
+#endif
+
+	memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+	memset(reinterpret_cast<void*>(tail), 0, sizeof(*tail));
+	clust.seq          = logSeq + 1;
+	clust.record_magic = CLUST_MAGIC;
+	clustAppend(&clust, tail, &this->record);
+	*address = logAddress((logHead + 1) % RECORD_LOG_SLOTS);
+	return RECORD_OK;
+#else
+	if (indexReady) {
+		if (indexCount) {
+			*address = static_cast<uint32_t>(indexAt(indexCount - 1)->page) * STORAGE_PAGE_SIZE;
+			const RecordClust* view = nullptr;
+			recordStatus = loadClust(*address, &view);
+			if (recordStatus == RECORD_OK) {
+				if (view != &clust) {
+					memcpy(reinterpret_cast<void*>(&clust), reinterpret_cast<const void*>(view), sizeof(clust));
+				}
+				memset(reinterpret_cast<void*>(tail), 0, sizeof(*tail));
+				while (clustNext(&clust, tail)) {}
+				if (clustAppend(&clust, tail, &this->record)) {
+					return RECORD_OK;
+				}
+			}
+#if RECORD_BEDUG
+			if (recordStatus != RECORD_OK) {
+				printTagLog(RecordDB::TAG, "save: newest clust is broken, start new clust");
+			}
+#endif
+		}
+
+		if (!storageFull) {
+			storageStatus = storage.find(FIND_MODE_EMPTY, address, RECORD_PREFIX);
+			if (storageStatus == STORAGE_NOT_FOUND || storageStatus == STORAGE_OOM) {
+				storageFull = true;
+			} else if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+				printTagLog(RecordDB::TAG, "error save: find empty address");
+#endif
+				return RECORD_ERROR;
+			}
+		}
+		bool reclaimed = false;
+		if (storageFull && staleClusters) {
+			recordStatus = findStaleClust(address);
+			if (recordStatus == RECORD_ERROR) {
+#if RECORD_BEDUG
+				printTagLog(RecordDB::TAG, "error save: find cleared clust");
+#endif
+				return RECORD_ERROR;
+			}
+			reclaimed = (recordStatus == RECORD_OK);
+		}
+#if RECORD_DB_ROLLUP
+		if (storageFull && !reclaimed) {
+			recordStatus = RollupDB::reclaim(address);
+			if (recordStatus == RECORD_ERROR) {
+#   if RECORD_BEDUG
+				printTagLog(RecordDB::TAG, "error save: reclaim rollups page");
+#   endif
+				return RECORD_ERROR;
+			}
+			reclaimed = (recordStatus == RECORD_OK);
+		}
+#endif
+		if (storageFull && !reclaimed) {
+#if RECORD_DB_ROLLUP
+			// The oldest cluster page may be taken by the rollups, the newest one is kept
+			bool spareUsed = true;
+			while (spareUsed && indexCount) {
+				*address = static_cast<uint32_t>(indexAt(0)->page) * STORAGE_PAGE_SIZE;
+				if (rollupClust(*address, indexCount > 1, &spareUsed) != RECORD_OK) {
+#   if RECORD_BEDUG
+					printTagLog(RecordDB::TAG, "error save: rollup oldest clust");
+#   endif
+					return RECORD_ERROR;
+				}
+				if (spareUsed) {
+					indexHead = (indexHead + 1) % __arr_len(index);
+					indexCount--;
+				}
+			}
+#endif
+			if (!indexCount) {
+#if RECORD_BEDUG
+				printTagLog(RecordDB::TAG, "error save: no address for save record");
+#endif
+				return RECORD_ERROR;
+			}
+			*address = static_cast<uint32_t>(indexAt(0)->page) * STORAGE_PAGE_SIZE;
+			// The oldest cluster leaves the index before the reuse: it may be the only one
+			indexHead = (indexHead + 1) % __arr_len(index);
+			indexCount--;
+		}
+
+		memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+		memset(reinterpret_cast<void*>(tail), 0, sizeof(*tail));
+		clust.record_magic = CLUST_MAGIC;
+		clustAppend(&clust, tail, &this->record);
+		return RECORD_OK;
+	}
+
+    StorageFindMode findMode = FIND_MODE_MAX;
+    storageStatus = storage.find(findMode, address, RECORD_PREFIX);
+    if (storageStatus == STORAGE_BUSY) {
+    	return RECORD_ERROR;
+    }
+
+    while (storageStatus != STORAGE_OOM) {
+		if (storageStatus != STORAGE_OK) {
+			findMode = FIND_MODE_EMPTY;
+			storageStatus = storage.find(findMode, address, RECORD_PREFIX);
+		}
+		if (storageStatus != STORAGE_OK) {
+			findMode = FIND_MODE_MIN;
+			storageStatus = storage.find(findMode, address, RECORD_PREFIX);
+		}
+		if (storageStatus == STORAGE_BUSY) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error save: find address for save record (storage busy)");
+#endif
+			return RECORD_ERROR;
+		}
+		if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error save: find address for save record");
+#endif
+			return RECORD_ERROR;
+		}
+
+		if (findMode != FIND_MODE_EMPTY) {
+			const RecordClust* view = nullptr;
+			recordStatus = loadClust(*address, &view);
+			if (recordStatus == RECORD_OK && view != &clust) {
+				memcpy(reinterpret_cast<void*>(&clust), reinterpret_cast<const void*>(view), sizeof(clust));
+			}
+		}
+#if RECORD_DB_ROLLUP
+		if (recordStatus == RECORD_OK && findMode == FIND_MODE_MIN) {
+			bool spareUsed = false;
+			recordStatus = rollupClust(*address, false, &spareUsed);
+		}
+#endif
+		if (recordStatus != RECORD_OK) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error save: load clust");
+#endif
+			return RECORD_ERROR;
+		}
+		if (findMode == FIND_MODE_MIN || findMode == FIND_MODE_EMPTY) {
+			memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+		}
+
+		clust.record_magic = CLUST_MAGIC;
+		memset(reinterpret_cast<void*>(tail), 0, sizeof(*tail));
+		while (clustNext(&clust, tail)) {}
+		if (tail->record.id && tail->record.id < logFirstId()) {
+			// The newest cluster has been cleared with the log: the page is free
+			memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+			memset(reinterpret_cast<void*>(tail), 0, sizeof(*tail));
+			clust.record_magic = CLUST_MAGIC;
+		}
+		if (clustAppend(&clust, tail, &this->record)) {
+			return RECORD_OK;
+		}
+
+		storageStatus = STORAGE_ERROR;
+    }
+
+#if RECORD_BEDUG
+    printTagLog(RecordDB::TAG, "error save: find record id in clust");
+#endif
+    return RECORD_ERROR;
+#endif
+}
+
+RecordDB::RecordStatus RecordDB::commitClust(RecordClust *clust, ClustIter *tail, uint32_t address, uint32_t offset)
+{
+#if RECORD_DB_FAST_MOUNT
+	if (mountDirty() != RECORD_OK) {
+		return RECORD_ERROR;
+	}
+#endif
+
+	StorageStatus status = STORAGE_OK;
+#if RECORD_DB_RING_LOG
+#   if RECORD_LOG_CRC && RECORD_DB_PACKED
+	clustSeal(clust, tail);
+#   endif
+	// Append only the new record bytes or open the next slot: the written bytes and the previous slots stay untouched
+	status = storageDriver.write(
+		address + offset,
+		reinterpret_cast<uint8_t*>(clust) + offset,
+		offset ? clustOffset(tail) - offset : sizeof(*clust)
+	);
+#else
+#   if RECORD_DB_CRC
+	clust->crc = clustCrc(clust);
+#   endif
+	status = storage.rewrite(
+		address,
+		RECORD_PREFIX,
+		tail->record.id,
+		reinterpret_cast<uint8_t*>(clust),
+		sizeof(*clust)
+	);
+#endif
+	if (status == STORAGE_OK) {
+		clustCommitted(clust, tail, address, offset);
+	}
+	return status == STORAGE_OK ? RECORD_OK : RECORD_ERROR;
+}
+
+void RecordDB::clustCommitted(const RecordClust *clust, const ClustIter *tail, uint32_t address, uint32_t offset)
+{
+#if RECORD_DB_RING_LOG
+	logTail = *tail;
+	if (!offset) {
+		logHead = (address - RECORD_LOG_ADDRESS) / RECORD_LOG_SLOT_SIZE;
+		logSeq  = clust->seq;
+		if (logHead == RECORD_LOG_SLOTS - 1) {
+			storageFull = true;
+		}
+	}
+#else
+	(void)clust;
+	(void)tail;
+	(void)address;
+	(void)offset;
+#endif
+	clustWrites++;
+#if RECORD_DB_STAGING
+	// The pump counters reset by the written records may be saved now
+	set_status(NEED_SAVE_COUNTERS);
+#endif
+}
+
+#if !RECORD_DB_RING_LOG
+RecordDB::RecordStatus RecordDB::findStaleClust(uint32_t *address)
+{
+	// The oldest cluster page is free if it has been left out of the index by a log clear
+	StorageStatus status = storage.find(FIND_MODE_MIN, address, RECORD_PREFIX);
+	if (status == STORAGE_NOT_FOUND) {
+		staleClusters = false;
+		return RECORD_NO_LOG;
+	}
+	if (status != STORAGE_OK) {
+		return RECORD_ERROR;
+	}
+	if (indexCount && indexAt(0)->page == *address / STORAGE_PAGE_SIZE) {
+		// All the cleared clusters have been reused
+		staleClusters = false;
+		return RECORD_NO_LOG;
+	}
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "save: reuse cleared clust address=%08X", (unsigned int)*address);
+#endif
+
+	return RECORD_OK;
+}
+#endif
+
+uint32_t RecordDB::logFirstId()
+{
+	return settings.log_first_id;
+}
+
+#if RECORD_DB_ROLLUP
+RecordDB::RecordStatus RecordDB::rollupClust(uint32_t address, bool useSpare, bool *spareUsed)
+{
+	*spareUsed = false;
+
+	if (indexReady) {
+		uint16_t page = static_cast<uint16_t>(address / STORAGE_PAGE_SIZE);
+		for (uint32_t i = 0; i < indexCount; i++) {
+			ClustEntry* entry = indexAt(i);
+			if (entry->page != page) {
+				continue;
+			}
+			if (entry->min_id + entry->span <= settings.server_log_id) {
+				// All the records have been sent
+				return RECORD_OK;
+			}
+			break;
+		}
+	}
+
+	const RecordClust* view = nullptr;
+	if (loadClust(address, &view) != RECORD_OK) {
+		// A broken cluster has nothing to keep
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "rollup: skip clust address=%08X", (unsigned int)address);
+#endif
+		return RECORD_OK;
+	}
+
+#if RECORD_DB_FAST_MOUNT
+	// The page may leave the index
+	if (mountDirty() != RECORD_OK) {
+		return RECORD_ERROR;
+	}
+#endif
+
+	return RollupDB::add(view, address, useSpare, spareUsed);
+}
+#endif
+
+#if RECORD_DB_STAGING
+RecordDB::RecordStatus RecordDB::stageNewClust(uint32_t address, uint32_t offset, uint32_t size, const ClustIter *tail)
+{
+	if (offset) {
+		// Only the appended bytes are in the buffer: the head of the cluster is in the memory
+		StorageStatus status = storageDriver.read(address, reinterpret_cast<uint8_t*>(&stageClust), offset);
+		if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "error stage: load clust address=%08X", (unsigned int)address);
+#endif
+			return RECORD_ERROR;
+		}
+		memcpy(
+			reinterpret_cast<uint8_t*>(&stageClust) + offset,
+			reinterpret_cast<uint8_t*>(&clust) + offset,
+			size
+		);
+		memset(
+			reinterpret_cast<uint8_t*>(&stageClust) + offset + size,
+			0,
+			sizeof(stageClust) - offset - size
+		);
+	} else {
+		memcpy(reinterpret_cast<void*>(&stageClust), reinterpret_cast<void*>(&clust), sizeof(stageClust));
+	}
+
+	clustGen++;
+	stageAddress = address;
+	stageOffset  = offset;
+	stageTail    = *tail;
+	stageValid   = true;
+	stageDirty   = false;
+
+	return RECORD_OK;
+}
+#endif
+
+bool RecordDB::clustNext(const RecordClust* clust, ClustIter* it)
+{
+#if RECORD_DB_PACKED
+	uint32_t pos    = it->pos;
+	uint32_t header = 0;
+	if (!unpackVarint(clust->data, sizeof(clust->data), &pos, &header) || !header) {
+		return false;
+	}
+#   if RECORD_LOG_CRC
+	if (header == CLUST_MARK) {
+		// The CRC mark is checked by clustValid()
+		pos += sizeof(uint32_t);
+		it->pos    = pos;
+		it->sealed = pos;
+		if (!unpackVarint(clust->data, sizeof(clust->data), &pos, &header) || !header) {
+			return false;
+		}
+	}
+#   endif
+
+	Record record = it->record;
+	if (header == 1) {
+		// Raw record
+		if (pos + sizeof(record) > sizeof(clust->data)) {
+			return false;
+		}
+		memcpy(reinterpret_cast<void*>(&record), clust->data + pos, sizeof(record));
+		pos += sizeof(record);
+
+		it->timeValid = timeToSeconds(record.time, &it->seconds);
+		it->delta     = 0;
+	} else if (!(header & 1) && it->count) {
+		// Delta record
+		uint32_t fields[6] = {};
+		for (unsigned i = 0; i < __arr_len(fields); i++) {
+			if (!unpackVarint(clust->data, sizeof(clust->data), &pos, &fields[i])) {
+				return false;
+			}
+		}
+
+		record.id += header >> 1;
+		it->delta   += __zigzag_decode(fields[0]);
+		it->seconds += it->delta;
+		secondsToTime(it->seconds, record.time);
+		record.cf_id         += __zigzag_decode(fields[1]);
+		record.level         += static_cast<int32_t>(__zigzag_decode(fields[2]));
+		record.press_1       += static_cast<uint16_t>(__zigzag_decode(fields[3]));
+		record.pump_wok_time  = fields[4];
+		record.pump_downtime  = pumpDowntime(it->delta, record.pump_wok_time) + __zigzag_decode(fields[5]);
+	} else {
+		return false;
+	}
+
+	it->pos    = pos;
+	it->record = record;
+	it->count++;
+	return true;
+#else
+	if (it->pos >= CLUST_SIZE) {
+		return false;
+	}
+#if RECORD_LOG_CRC
+	const Record* record = &clust->records[it->pos].record;
+#else
+	const Record* record = &clust->records[it->pos];
+#endif
+	if (!record->id || record->id == 0xFFFFFFFF) {
+		return false;
+	}
+	memcpy(reinterpret_cast<void*>(&it->record), reinterpret_cast<const void*>(record), sizeof(it->record));
+	it->pos++;
+	it->count++;
+	return true;
+#endif
+}
+
+bool RecordDB::clustAppend(RecordClust* clust, ClustIter* it, const Record* record)
+{
+#if RECORD_DB_PACKED
+	uint8_t  buffer[PACKED_RECORD_MAX] = {};
+	uint32_t len     = 0;
+	uint32_t seconds = 0;
+	bool timeValid = timeToSeconds(record->time, &seconds);
+	// A sensor error or a level jump out of the int32 range is stored raw
+	int64_t levelDelta = static_cast<int64_t>(record->level) - it->record.level;
+	bool levelValid = (record->level == LEVEL_ERROR) == (it->record.level == LEVEL_ERROR) &&
+		levelDelta >= INT32_MIN && levelDelta <= INT32_MAX;
+
+	if (it->count && it->timeValid && timeValid && levelValid && record->id > it->record.id) {
+		uint32_t delta = seconds - it->seconds;
+		len += packVarint(buffer + len, (record->id - it->record.id) << 1);
+		len += packVarint(buffer + len, __zigzag_encode(delta - it->delta));
+		len += packVarint(buffer + len, __zigzag_encode(record->cf_id - it->record.cf_id));
+		len += packVarint(buffer + len, __zigzag_encode(static_cast<int32_t>(levelDelta)));
+		len += packVarint(buffer + len, __zigzag_encode(static_cast<uint32_t>(static_cast<int16_t>(record->press_1 - it->record.press_1))));
+		len += packVarint(buffer + len, record->pump_wok_time);
+		len += packVarint(buffer + len, __zigzag_encode(record->pump_downtime - pumpDowntime(delta, record->pump_wok_time)));
+		if (it->pos + len + CLUST_MARK_SIZE > sizeof(clust->data)) {
+			return false;
+		}
+		it->delta = delta;
+	} else {
+		len += packVarint(buffer + len, 1);
+		if (it->pos + len + sizeof(*record) + CLUST_MARK_SIZE > sizeof(clust->data)) {
+			return false;
+		}
+		memcpy(buffer + len, reinterpret_cast<const void*>(record), sizeof(*record));
+		len += sizeof(*record);
+		it->delta = 0;
+	}
+
+	memcpy(clust->data + it->pos, buffer, len);
+	it->pos      += len;
+	it->seconds   = seconds;
+	it->timeValid = timeValid;
+#else
+	if (it->pos >= CLUST_SIZE) {
+		return false;
+	}
+#   if RECORD_LOG_CRC
+	LogRecord* logRecord = &clust->records[it->pos];
+	memcpy(reinterpret_cast<void*>(&logRecord->record), reinterpret_cast<const void*>(record), sizeof(*record));
+	logRecord->crc = logCrc(clust, reinterpret_cast<uint8_t*>(&logRecord->record), sizeof(logRecord->record));
+#   else
+	memcpy(reinterpret_cast<void*>(&clust->records[it->pos]), reinterpret_cast<const void*>(record), sizeof(*record));
+#   endif
+	it->pos++;
+#endif
+	memcpy(reinterpret_cast<void*>(&it->record), reinterpret_cast<const void*>(record), sizeof(it->record));
+	it->count++;
+	return true;
+}
+
+uint32_t RecordDB::clustOffset(const ClustIter* it)
+{
+#if RECORD_DB_PACKED
+	return offsetof(RecordClust, data) + it->pos;
+#else
+	return offsetof(RecordClust, records) + it->pos * sizeof(clust.records[0]);
+#endif
+}
+
+bool RecordDB::clustValid(RecordClust* clust)
+{
+#if RECORD_DB_CRC && !RECORD_DB_RING_LOG && !RECORD_DB_PACKED
+	if (clust->record_magic == CLUST_LEGACY_MAGIC) {
+		// The records are moved after the CRC field: the CRC is set on the next write
+		uint8_t* data = reinterpret_cast<uint8_t*>(clust);
+		memmove(
+			data + offsetof(RecordClust, records),
+			data + sizeof(clust->record_magic),
+			CLUST_LEGACY_SIZE * sizeof(clust->records[0])
+		);
+		memset(
+			data + offsetof(RecordClust, records) + CLUST_LEGACY_SIZE * sizeof(clust->records[0]),
+			0,
+			sizeof(*clust) - offsetof(RecordClust, records) - CLUST_LEGACY_SIZE * sizeof(clust->records[0])
+		);
+		clust->record_magic = CLUST_MAGIC;
+		clust->crc          = clustCrc(clust);
+		return true;
+	}
+#endif
+	if (clust->record_magic != CLUST_MAGIC) {
+		return false;
+	}
+#if RECORD_LOG_CRC
+	// The slot is read up to the first broken append: the bytes after it are cut off
+	uint8_t* data = reinterpret_cast<uint8_t*>(clust);
+#   if RECORD_DB_PACKED
+	uint32_t end  = offsetof(RecordClust, data);
+	ClustIter it = {};
+	while (true) {
+		uint32_t pos    = it.pos;
+		uint32_t header = 0;
+		if (!unpackVarint(clust->data, sizeof(clust->data), &pos, &header) || !header) {
+			break;
+		}
+		if (header == CLUST_MARK) {
+			uint32_t crc = 0;
+			if (pos + sizeof(crc) > sizeof(clust->data)) {
+				break;
+			}
+			memcpy(reinterpret_cast<void*>(&crc), clust->data + pos, sizeof(crc));
+			if (crc != logCrc(clust, clust->data + it.sealed, it.pos - it.sealed)) {
+				break;
+			}
+			it.pos    = pos + sizeof(crc);
+			it.sealed = it.pos;
+			end       = clustOffset(&it);
+		} else if (!clustNext(clust, &it)) {
+			break;
+		}
+	}
+#   else
+	uint32_t end  = offsetof(RecordClust, records);
+	for (unsigned i = 0; i < CLUST_SIZE; i++) {
+		const LogRecord* logRecord = &clust->records[i];
+		if (!logRecord->record.id || logRecord->record.id == 0xFFFFFFFF ||
+			logRecord->crc != logCrc(clust, reinterpret_cast<const uint8_t*>(&logRecord->record), sizeof(logRecord->record))
+		) {
+			break;
+		}
+		end += sizeof(*logRecord);
+	}
+#   endif
+	bool broken = false;
+	for (uint32_t i = end; i < sizeof(*clust); i++) {
+		broken |= data[i] != 0;
+	}
+	if (broken) {
+		clustBroken++;
+		memset(data + end, 0, sizeof(*clust) - end);
+	}
+#elif RECORD_DB_CRC
+	if (clust->crc != clustCrc(clust)) {
+		clustBroken++;
+		return false;
+	}
+#endif
+	return true;
+}
+
+#if RECORD_LOG_CRC
+uint32_t RecordDB::logCrc(const RecordClust* clust, const uint8_t* data, uint32_t size)
+{
+	// The sequence number keeps the records of the previous ring laps out
+	uint32_t crc = system_crc32(0, reinterpret_cast<const uint8_t*>(&clust->seq), sizeof(clust->seq));
+	return system_crc32(crc, data, size);
+}
+
+#   if RECORD_DB_PACKED
+void RecordDB::clustSeal(RecordClust* clust, ClustIter* it)
+{
+	// One CRC mark for the records appended after the last one
+	if (it->pos == it->sealed) {
+		return;
+	}
+	uint32_t crc = logCrc(clust, clust->data + it->sealed, it->pos - it->sealed);
+	it->pos += packVarint(clust->data + it->pos, CLUST_MARK);
+	memcpy(clust->data + it->pos, reinterpret_cast<const void*>(&crc), sizeof(crc));
+	it->pos   += sizeof(crc);
+	it->sealed = it->pos;
+}
+#   endif
+#elif RECORD_DB_CRC
+uint32_t RecordDB::clustCrc(const RecordClust* clust)
+{
+	const uint8_t* data  = reinterpret_cast<const uint8_t*>(clust);
+	const uint32_t field = offsetof(RecordClust, crc);
+	uint32_t crc = system_crc32(0, data, field);
+	return system_crc32(crc, data + field + sizeof(clust->crc), sizeof(*clust) - field - sizeof(clust->crc));
+}
+#endif
+
+#if RECORD_DB_PACKED
+
+bool RecordDB::timeToSeconds(const uint8_t* time, uint32_t* seconds)
+{
+	RTC_DateTypeDef date = {};
+	RTC_TimeTypeDef rtcTime = {};
+	date.Year       = time[0];
+	date.Month      = time[1];
+	date.Date       = time[2];
+	rtcTime.Hours   = time[3];
+	rtcTime.Minutes = time[4];
+	rtcTime.Seconds = time[5];
+	*seconds = clock_datetime_to_seconds(&date, &rtcTime);
+
+	// Only the time which is restored as is may be delta encoded
+	uint8_t restored[RECORD_TIME_ARRAY_SIZE] = {};
+	secondsToTime(*seconds, restored);
+	return !memcmp(restored, time, sizeof(restored));
+}
+
+void RecordDB::secondsToTime(uint32_t seconds, uint8_t* time)
+{
+	RTC_DateTypeDef date = {};
+	RTC_TimeTypeDef rtcTime = {};
+	clock_seconds_to_datetime(seconds, &date, &rtcTime);
+	time[0] = date.Year;
+	time[1] = date.Month;
+	time[2] = date.Date;
+	time[3] = rtcTime.Hours;
+	time[4] = rtcTime.Minutes;
+	time[5] = rtcTime.Seconds;
+}
+
+uint32_t RecordDB::pumpDowntime(uint32_t delta, uint32_t workTime)
+{
+	// The pump is either working or idle between two records
+	return delta > workTime ? delta - workTime : 0;
+}
+
+uint32_t RecordDB::packVarint(uint8_t* dst, uint32_t value)
+{
+	uint32_t len = 0;
+	while (value >= 0x80) {
+		dst[len++] = static_cast<uint8_t>(value | 0x80);
+		value >>= 7;
+	}
+	dst[len++] = static_cast<uint8_t>(value);
+	return len;
+}
+
+bool RecordDB::unpackVarint(const uint8_t* src, uint32_t size, uint32_t* pos, uint32_t* value)
+{
+	*value = 0;
+	for (uint32_t shift = 0; shift < 35 && *pos < size; shift += 7) {
+		uint8_t byte = src[(*pos)++];
+		*value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
+
+#if RECORD_DB_FAST_MOUNT
+RecordDB::RecordStatus RecordDB::loadDirectory()
+{
+	mountFound = false;
+	mountReset();
+
+	StorageStatus status = storage.find(FIND_MODE_EQUAL, &mountAddress, MOUNT_PREFIX, 1);
+	if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "mount: no summary (error=%02X)", status);
+#endif
+		return RECORD_NO_LOG;
+	}
+	mountFound = true;
+
+	status = storage.load(mountAddress, reinterpret_cast<uint8_t*>(&mountSummary), sizeof(mountSummary));
+	if (status != STORAGE_OK || mountSummary.crc != summaryCrc()) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "mount: broken summary (error=%02X)", status);
+#endif
+		mountReset();
+		return RECORD_ERROR;
+	}
+	if (mountSummary.clean != MOUNT_CLEAN ||
+		mountSummary.indexHead >= RECORD_INDEX_SIZE ||
+		mountSummary.indexCount > RECORD_INDEX_SIZE
+	) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "mount: dirty shutdown");
+#endif
+		return RECORD_ERROR;
+	}
+
+	indexReady = false;
+	indexHead  = mountSummary.indexHead;
+	indexCount = mountSummary.indexCount;
+
+	uint32_t used = directoryUsed();
+	for (uint32_t page = 0; page < DIR_PAGES; page++) {
+		if (!(used & (1UL << page))) {
+			continue;
+		}
+		if (mountSummary.dirPages[page] == DIR_NO_PAGE) {
+			return RECORD_ERROR;
+		}
+		uint32_t entries = __min(DIR_ENTRIES, RECORD_INDEX_SIZE - page * DIR_ENTRIES);
+		status = storage.load(
+			static_cast<uint32_t>(mountSummary.dirPages[page]) * STORAGE_PAGE_SIZE,
+			reinterpret_cast<uint8_t*>(&index[page * DIR_ENTRIES]),
+			entries * sizeof(ClustEntry)
+		);
+		if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "mount: load directory page=%lu (error=%02X)", page, status);
+#endif
+			return RECORD_ERROR;
+		}
+	}
+
+	uint32_t maxId = indexCount ? indexAt(indexCount - 1)->min_id + indexAt(indexCount - 1)->span : 0;
+	if (mountSummary.dirCrc != directoryCrc(used) || mountSummary.maxId != maxId) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "mount: broken directory");
+#endif
+		return RECORD_ERROR;
+	}
+
+	// The clusters of the cleared log generations are left out
+	while (indexCount && indexAt(0)->min_id < logFirstId()) {
+		indexHead = (indexHead + 1) % __arr_len(index);
+		indexCount--;
+	}
+#if !RECORD_DB_RING_LOG
+	staleClusters = (logFirstId() > 1);
+#endif
+
+	storageFull = mountSummary.storageFull;
+#if RECORD_DB_RING_LOG
+	logHead = mountSummary.logHead;
+	logSeq  = mountSummary.logSeq;
+
+	// The next records are appended after the last one of the head slot
+	clustGen++;
+	memset(reinterpret_cast<void*>(&logTail), 0, sizeof(logTail));
+	status = storageDriver.read(logAddress(logHead), reinterpret_cast<uint8_t*>(&clust), sizeof(clust));
+	if (status != STORAGE_OK) {
+		return RECORD_ERROR;
+	}
+	if (clustValid(&clust)) {
+		while (clustNext(&clust, &logTail)) {}
+	}
+#endif
+#if RECORD_DB_STAGING
+	stageValid = false;
+#endif
+
+	indexReady = true;
+	mountClean = true;
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "mount: directory loaded, %lu clusters, max ID=%lu", indexCount, maxId);
+#endif
+
+	return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::saveDirectory()
+{
+	uint32_t used = directoryUsed();
+	for (uint32_t page = 0; page < DIR_PAGES; page++) {
+		if (!(used & (1UL << page))) {
+			continue;
+		}
+
+		StorageStatus status = STORAGE_OK;
+		uint32_t address = static_cast<uint32_t>(mountSummary.dirPages[page]) * STORAGE_PAGE_SIZE;
+		if (mountSummary.dirPages[page] == DIR_NO_PAGE) {
+			status = storage.find(FIND_MODE_EQUAL, &address, DIR_PREFIX, page);
+			if (status == STORAGE_NOT_FOUND) {
+				status = storage.find(FIND_MODE_EMPTY, &address);
+			}
+		}
+		if (status == STORAGE_OK) {
+			// Only the changed entries are written: the page is in the physical index order
+			uint32_t entries = __min(DIR_ENTRIES, RECORD_INDEX_SIZE - page * DIR_ENTRIES);
+			status = storage.rewrite(
+				address,
+				DIR_PREFIX,
+				page,
+				reinterpret_cast<uint8_t*>(&index[page * DIR_ENTRIES]),
+				entries * sizeof(ClustEntry)
+			);
+		}
+		if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RecordDB::TAG, "unmount: save directory page=%lu (error=%02X)", page, status);
+#endif
+			return RECORD_ERROR;
+		}
+		mountSummary.dirPages[page] = static_cast<uint16_t>(address / STORAGE_PAGE_SIZE);
+	}
+
+	mountSummary.clean       = MOUNT_CLEAN;
+	mountSummary.indexHead   = indexHead;
+	mountSummary.indexCount  = indexCount;
+	mountSummary.maxId       = indexCount ? indexAt(indexCount - 1)->min_id + indexAt(indexCount - 1)->span : 0;
+	mountSummary.storageFull = storageFull;
+#if RECORD_DB_RING_LOG
+	mountSummary.logHead     = logHead;
+	mountSummary.logSeq      = logSeq;
+#endif
+	mountSummary.dirCrc      = directoryCrc(used);
+	mountSummary.crc         = summaryCrc();
+
+	StorageStatus status = STORAGE_OK;
+	if (!mountFound) {
+		status = storage.find(FIND_MODE_EQUAL, &mountAddress, MOUNT_PREFIX, 1);
+		if (status == STORAGE_NOT_FOUND) {
+			status = storage.find(FIND_MODE_EMPTY, &mountAddress);
+		}
+	}
+	if (status == STORAGE_OK) {
+		status = storage.rewrite(mountAddress, MOUNT_PREFIX, 1, reinterpret_cast<uint8_t*>(&mountSummary), sizeof(mountSummary));
+	}
+	if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "unmount: save summary (error=%02X)", status);
+#endif
+		return RECORD_ERROR;
+	}
+
+	mountFound = true;
+	mountClean = true;
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "unmount: directory saved, %lu clusters", indexCount);
+#endif
+
+	return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::mountDirty()
+{
+	if (!mountClean) {
+		return RECORD_OK;
+	}
+
+	mountSummary.clean = 0;
+	mountSummary.crc   = summaryCrc();
+	StorageStatus status = storage.rewrite(mountAddress, MOUNT_PREFIX, 1, reinterpret_cast<uint8_t*>(&mountSummary), sizeof(mountSummary));
+	if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RecordDB::TAG, "error clear clean shutdown mark (error=%02X)", status);
+#endif
+		return RECORD_ERROR;
+	}
+
+	mountClean = false;
+	return RECORD_OK;
+}
+
+void RecordDB::mountReset()
+{
+	memset(reinterpret_cast<void*>(&mountSummary), 0, sizeof(mountSummary));
+	for (uint32_t page = 0; page < DIR_PAGES; page++) {
+		mountSummary.dirPages[page] = DIR_NO_PAGE;
+	}
+	mountClean = false;
+}
+
+uint32_t RecordDB::directoryUsed()
+{
+	uint32_t used = 0;
+	for (uint32_t i = 0; i < indexCount; i++) {
+		used |= 1UL << (((indexHead + i) % RECORD_INDEX_SIZE) / DIR_ENTRIES);
+	}
+	return used;
+}
+
+uint32_t RecordDB::directoryCrc(uint32_t used)
+{
+	uint32_t crc = 0;
+	for (uint32_t page = 0; page < DIR_PAGES; page++) {
+		if (used & (1UL << page)) {
+			uint32_t entries = __min(DIR_ENTRIES, RECORD_INDEX_SIZE - page * DIR_ENTRIES);
+			crc = system_crc32(crc, &index[page * DIR_ENTRIES], entries * sizeof(ClustEntry));
+		}
+	}
+	return crc;
+}
+
+uint32_t RecordDB::summaryCrc()
+{
+	return system_crc32(0, &mountSummary, offsetof(MountSummary, crc));
+}
+#endif
+
+RecordDB::ClustEntry* RecordDB::indexAt(uint32_t position)
+{
+	return &index[(indexHead + position) % __arr_len(index)];
+}
+
+bool RecordDB::indexFind(uint32_t id, uint32_t *address, uint32_t *lastId)
+{
+	// Binary search of the first cluster with the last record ID >= id
+	uint32_t left  = 0;
+	uint32_t right = indexCount;
+	while (left < right) {
+		uint32_t middle = left + (right - left) / 2;
+		ClustEntry* entry = indexAt(middle);
+		if (entry->min_id + entry->span < id) {
+			left = middle + 1;
+		} else {
+			right = middle;
+		}
+	}
+	if (left >= indexCount) {
+		return false;
+	}
+
+	*address = static_cast<uint32_t>(indexAt(left)->page) * STORAGE_PAGE_SIZE;
+	if (lastId) {
+		*lastId = indexAt(left)->min_id + indexAt(left)->span;
+	}
+	return true;
+}
+
+void RecordDB::indexUpdate(uint32_t address, uint32_t id)
+{
+	uint16_t page = static_cast<uint16_t>(address / STORAGE_PAGE_SIZE);
+
+	if (indexCount && indexAt(indexCount - 1)->page == page) {
+		indexAt(indexCount - 1)->span = static_cast<uint8_t>(id - indexAt(indexCount - 1)->min_id);
+		return;
+	}
+
+	if (indexCount && indexAt(0)->page == page) {
+		// The oldest cluster has been reused
+		indexHead = (indexHead + 1) % __arr_len(index);
+		indexCount--;
+	}
+
+	if (indexCount >= __arr_len(index)) {
+		indexReady = false;
+		return;
+	}
+
+	ClustEntry* entry = indexAt(indexCount++);
+	entry->min_id = id;
+	entry->page   = page;
+	entry->span   = 0;
+}
+
+#if RECORD_DB_RING_LOG
+
+RecordDB::RecordStatus RecordDB::findLogHead(uint32_t *head, uint32_t *seq)
+{
+	// The first valid slot is the anchor: slot 0 may be torn by the re-open after a wrap or broken
+	uint32_t first    = 0;
+	uint32_t firstSeq = 0;
+	StorageStatus status = STORAGE_NOT_FOUND;
+	for (; first < RECORD_LOG_SLOTS; first++) {
+		status = readLogSeq(first, &firstSeq);
+		if (status != STORAGE_NOT_FOUND) {
+			break;
+		}
+	}
+	if (status == STORAGE_NOT_FOUND) {
+		return RECORD_NO_LOG;
+	}
+	if (status != STORAGE_OK) {
+		return RECORD_ERROR;
+	}
+
+	// Slots are written in address order, so seq == firstSeq + (slot - first) up to the head
+	uint32_t left  = first;
+	uint32_t right = RECORD_LOG_SLOTS;
+	while (right - left > 1) {
+		uint32_t middle = left + (right - left) / 2;
+		uint32_t curSeq = 0;
+		status = readLogSeq(middle, &curSeq);
+		if (status != STORAGE_OK && status != STORAGE_NOT_FOUND) {
+			return RECORD_ERROR;
+		}
+		if (status == STORAGE_OK && curSeq == firstSeq + (middle - first)) {
+			left = middle;
+		} else {
+			right = middle;
+		}
+	}
+
+	*head = left;
+	*seq  = firstSeq + (left - first);
+
+#if RECORD_BEDUG
+	printTagLog(RecordDB::TAG, "log head found: slot=%lu seq=%lu", *head, *seq);
+#endif
+
+	return RECORD_OK;
+}
+
+StorageStatus RecordDB::readLogSeq(uint32_t slot, uint32_t *seq)
+{
+	uint8_t header[offsetof(RecordClust, record_magic) + sizeof(uint8_t)] = {};
+	StorageStatus status = storageDriver.read(logAddress(slot), header, sizeof(header));
+	if (status != STORAGE_OK) {
+		return status;
+	}
+
+	memcpy(reinterpret_cast<void*>(seq), header + offsetof(RecordClust, seq), sizeof(*seq));
+	if (header[offsetof(RecordClust, record_magic)] != CLUST_MAGIC ||
+		*seq == 0 ||
+		*seq == 0xFFFFFFFF
+	) {
+		return STORAGE_NOT_FOUND;
+	}
+
+	return STORAGE_OK;
+}
+
+uint32_t RecordDB::logAddress(uint32_t slot)
+{
+	return RECORD_LOG_ADDRESS + slot * RECORD_LOG_SLOT_SIZE;
+}
+
+#endif
@@ -5,6 +5,8 @@
 
 #include <stdint.h>
 
+#include "gutils.h"
+#include "at24cm01.h"
 #include "StorageAT.h"
 
 
@@ -12,6 +14,90 @@
 #   define RECORD_BEDUG (0)
 #endif
 
+/*
+ * Ring log mode: records are appended to the raw EEPROM area at the top of
+ * the memory (excluded from StorageAT) slot by slot in address order.
+ * The staged records are flushed in the background (StorageDriver::writeAsync()),
+ * the main loop waits for the EEPROM only when a slot is full.
+ * The log format differs and the StorageAT clusters are not moved to the log:
+ * the mode is off until the devices in the field are migrated, format the
+ * storage after switching.
+ */
+#ifndef RECORD_DB_RING_LOG
+#   define RECORD_DB_RING_LOG (0)
+#endif
+
+/*
+ * Ring log segments: a slot spans RECORD_LOG_SEGMENT_PAGES (1, 2 or 4)
+ * consecutive EEPROM pages under one header, so the records fill the page
+ * tails and the index build reads fewer slots. The shared and the staged
+ * cluster buffers take the segment size of RAM each.
+ * The log format differs: format the storage after switching.
+ */
+#define RECORD_LOG_SEGMENT_PAGES (1)
+
+/*
+ * Packed clusters: the first record of a cluster is stored as is, the next
+ * ones as zigzag varint deltas from the previous record (time as delta of
+ * delta), so a cluster keeps several times more records.
+ * The cluster format differs from the plain one: format the storage after switching.
+ */
+#ifndef RECORD_DB_PACKED
+#   define RECORD_DB_PACKED (0)
+#endif
+
+/*
+ * Write-back staging: new records are appended to the cluster kept in RAM,
+ * the cluster is written when it is full, after RECORD_STAGE_DELAY_MS,
+ * before an upload and on shutdown (RecordDB::flush())
+ */
+#define RECORD_DB_STAGING     (1)
+#define RECORD_STAGE_DELAY_MS (60 * 60 * 1000)
+
+/*
+ * Fast mount: RecordDB::unmount() saves the index directory and a summary
+ * with the clean shutdown mark, RecordDB::mount() restores the index from
+ * them and rebuilds it only after a dirty shutdown (within RECORD_INDEX_BUILD_MS,
+ * the records are found by the storage scans after the timeout).
+ * The mark is cleared before the first write after the mount.
+ */
+#define RECORD_DB_FAST_MOUNT  (1)
+#define RECORD_INDEX_BUILD_MS (10000)
+
+/*
+ * Rollups: the unsent records of the oldest cluster are compacted into hourly
+ * rollups (RollupDB) before the cluster is reused on the full memory
+ */
+#define RECORD_DB_ROLLUP      (1)
+
+/*
+ * CRC-protected clusters: the cluster header keeps CRC32 of the cluster
+ * (system_crc32(), the STM32 CRC unit), it is set on every write and checked
+ * on every load, a broken cluster is not read. The plain clusters written
+ * before the CRC are read without the check and get the CRC on the next write.
+ * The ring log never rewrites the written bytes: every record (plain clusters)
+ * or every append (packed clusters, a CRC mark after the appended records)
+ * keeps its own CRC32 with the slot sequence number, a slot is read up to the
+ * first broken one, so a torn append loses only its own records.
+ * The cluster format differs: format the storage after switching.
+ */
+#define RECORD_DB_CRC         (1)
+#define RECORD_LOG_CRC        (RECORD_DB_RING_LOG && RECORD_DB_CRC)
+
+#if RECORD_DB_RING_LOG
+#   define RECORD_LOG_SLOT_SIZE (RECORD_LOG_SEGMENT_PAGES * EEPROM_PAGE_SIZE)
+#   define RECORD_LOG_SLOTS     (EEPROM_PAGES_COUNT / 2 / RECORD_LOG_SEGMENT_PAGES)
+#   define RECORD_LOG_SIZE      (RECORD_LOG_SLOTS * RECORD_LOG_SLOT_SIZE)
+#   define RECORD_LOG_ADDRESS   (EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE - RECORD_LOG_SIZE)
+#endif
+
+// One index entry per cluster page or ring log slot
+#if RECORD_DB_RING_LOG
+#   define RECORD_INDEX_SIZE    (RECORD_LOG_SLOTS)
+#else
+#   define RECORD_INDEX_SIZE    (EEPROM_PAGES_COUNT)
+#endif
+
 
 class RecordDB
 {
@@ -40,29 +126,266 @@ public:
     RecordStatus loadNext();
     RecordStatus save();
 
+    static RecordStatus mount();
+    static RecordStatus unmount();
+    static RecordStatus buildIndex();
+    static RecordStatus flush();
+    // Drops all the records: only settings.log_first_id is written, the old clusters become free space
+    static RecordStatus clear();
+    // Drops the ring log slots left by storage.format() and starts the IDs from 1, the settings are saved by the caller
+    static RecordStatus format();
+    static void update();
+    static void showStorage();
+
     Record record = {};
 
 private:
+    // Keeps a cluster and walks it with the cluster iterator
+    friend class RecordCursor;
+    // Compacts the clusters before the reuse
+    friend class RollupDB;
+
     static const char* RECORD_PREFIX;
     static const char* TAG;
 
-    static const uint32_t CLUST_SIZE  = ((STORAGE_PAGE_PAYLOAD_SIZE - sizeof(uint8_t)) / sizeof(struct _Record));
-    static const uint32_t CLUST_MAGIC = (sizeof(struct _Record));
+#if RECORD_DB_RING_LOG
+    // A segment keeps at most 256 records: the index span is 8-bit
+    static_assert(
+        RECORD_LOG_SEGMENT_PAGES == 1 || RECORD_LOG_SEGMENT_PAGES == 2 || RECORD_LOG_SEGMENT_PAGES == 4,
+        "ring log segment must be 1, 2 or 4 pages"
+    );
+    static const uint32_t CLUST_PAYLOAD_SIZE = (RECORD_LOG_SLOT_SIZE - sizeof(uint32_t));
+#else
+    static const uint32_t CLUST_PAYLOAD_SIZE = (STORAGE_PAGE_PAYLOAD_SIZE);
+#endif
+#if RECORD_LOG_CRC
+    // The CRC is kept by the records
+    static const uint32_t CLUST_HEADER_SIZE = (sizeof(uint8_t));
+    static const uint32_t CLUST_CRC_MAGIC   = 0x40;
+#elif RECORD_DB_CRC
+    static const uint32_t CLUST_HEADER_SIZE = (sizeof(uint8_t) + sizeof(uint32_t));
+    static const uint32_t CLUST_CRC_MAGIC   = 0x40;
+#else
+    static const uint32_t CLUST_HEADER_SIZE = (sizeof(uint8_t));
+    static const uint32_t CLUST_CRC_MAGIC   = 0;
+#endif
+#if RECORD_DB_PACKED
+    static const uint32_t CLUST_DATA_SIZE = (CLUST_PAYLOAD_SIZE - CLUST_HEADER_SIZE);
+    static const uint32_t CLUST_MAGIC     = (sizeof(struct _Record) | 0x80 | CLUST_CRC_MAGIC);
+    // Record header + 6 varint fields
+    static const uint32_t PACKED_RECORD_MAX = (7 * 5);
+#   if RECORD_LOG_CRC
+    // CRC mark after the appended records: varint header and CRC32
+    static const uint32_t CLUST_MARK      = 3;
+    static const uint32_t CLUST_MARK_SIZE = (sizeof(uint8_t) + sizeof(uint32_t));
+#   else
+    static const uint32_t CLUST_MARK_SIZE = 0;
+#   endif
+#elif RECORD_LOG_CRC
+    typedef struct __attribute__((packed)) _LogRecord {
+        Record   record;
+        uint32_t crc;          // CRC32 of the slot sequence number and the record
+    } LogRecord;
+
+    static const uint32_t CLUST_SIZE  = ((CLUST_PAYLOAD_SIZE - CLUST_HEADER_SIZE) / sizeof(LogRecord));
+    static const uint32_t CLUST_MAGIC = (sizeof(struct _Record) | CLUST_CRC_MAGIC);
+#else
+    static const uint32_t CLUST_SIZE  = ((CLUST_PAYLOAD_SIZE - CLUST_HEADER_SIZE) / sizeof(struct _Record));
+    static const uint32_t CLUST_MAGIC = (sizeof(struct _Record) | CLUST_CRC_MAGIC);
+#endif
+#if RECORD_DB_CRC && !RECORD_DB_RING_LOG && !RECORD_DB_PACKED
+    // The clusters written before the CRC: the header has no CRC field
+    static const uint32_t CLUST_LEGACY_MAGIC = (sizeof(struct _Record));
+    static const uint32_t CLUST_LEGACY_SIZE  = ((CLUST_PAYLOAD_SIZE - sizeof(uint8_t)) / sizeof(struct _Record));
+    static_assert(CLUST_LEGACY_SIZE <= CLUST_SIZE, "legacy cluster records must fit the CRC cluster");
+#endif
 
     typedef struct __attribute__((packed)) _RecordClust {
-        uint8_t record_magic;
-        Record  records[CLUST_SIZE];
+#if RECORD_DB_RING_LOG
+        uint32_t seq;          // Ring log slot sequence number
+#endif
+        uint8_t  record_magic;
+#if RECORD_DB_CRC && !RECORD_LOG_CRC
+        uint32_t crc;          // CRC32 of the cluster without this field
+#endif
+#if RECORD_DB_PACKED
+        uint8_t  data[CLUST_DATA_SIZE]; // Packed records, 0 after the last one
+#elif RECORD_LOG_CRC
+        LogRecord records[CLUST_SIZE];
+#else
+        Record   records[CLUST_SIZE];
+#endif
     } RecordClust;
 
+    typedef struct _ClustIter {
+        uint32_t pos;          // Next record index (byte offset in packed clusters)
+        uint32_t count;        // Records passed
+        Record   record;       // Current record
+#if RECORD_DB_PACKED
+        uint32_t seconds;      // Current record time
+        uint32_t delta;        // Current record time - previous record time
+        bool     timeValid;    // Current record time is valid for the delta encoding
+#   if RECORD_LOG_CRC
+        uint32_t sealed;       // Byte offset after the last CRC mark
+#   endif
+#endif
+    } ClustIter;
+
 
-    uint32_t m_recordId;
+    typedef struct __attribute__((packed)) _ClustEntry {
+        uint32_t min_id; // First record ID in the cluster
+        uint16_t page;   // Cluster page: address / STORAGE_PAGE_SIZE
+        uint8_t  span;   // Last record ID - first record ID
+    } ClustEntry;
+
+    static ClustEntry index[RECORD_INDEX_SIZE];
+    static uint32_t   indexHead;
+    static uint32_t   indexCount;
+    static bool       indexReady;
+    static bool       storageFull;
+
+    static bool       mountFast;
+    static uint32_t   mountMs;
+    static uint32_t   clearMs;
+#if !RECORD_DB_RING_LOG
+    // Pages of the cleared log generations may be left: they are reused before the rollups
+    static bool       staleClusters;
+#endif
 
-    uint32_t m_clustId;
-    RecordClust m_clust;
+#if RECORD_DB_FAST_MOUNT
+    static const char* MOUNT_PREFIX;
+    static const char* DIR_PREFIX;
+    static const uint32_t MOUNT_CLEAN = 0xC1EA4D0B;
+    // Index entries per directory page
+    static const uint32_t DIR_ENTRIES = STORAGE_PAGE_PAYLOAD_SIZE / sizeof(ClustEntry);
+    static const uint32_t DIR_PAGES   = (RECORD_INDEX_SIZE + DIR_ENTRIES - 1) / DIR_ENTRIES;
+    static const uint16_t DIR_NO_PAGE = 0xFFFF;
+    static_assert(DIR_PAGES <= 32, "directory pages must fit the used pages mask");
+
+    typedef struct __attribute__((packed)) _MountSummary {
+        uint32_t clean;                // MOUNT_CLEAN after RecordDB::unmount()
+        uint32_t indexHead;
+        uint32_t indexCount;
+        uint32_t maxId;
+        uint8_t  storageFull;
+#if RECORD_DB_RING_LOG
+        uint32_t logHead;
+        uint32_t logSeq;
+#endif
+        uint16_t dirPages[DIR_PAGES];  // Directory pages: index[k * DIR_ENTRIES] page
+        uint32_t dirCrc;               // CRC32 of the used directory pages
+        uint32_t crc;                  // CRC32 of the summary
+    } MountSummary;
+
+    static MountSummary mountSummary;
+    static uint32_t     mountAddress;
+    static bool         mountFound;
+    static bool         mountClean;
+#endif
+
+#if RECORD_DB_RING_LOG
+    static uint32_t   logHead;
+    static uint32_t   logSeq;
+    static ClustIter  logTail;
+#endif
+
+#if RECORD_DB_STAGING
+    static RecordClust stageClust;
+    static ClustIter   stageTail;
+    static uint32_t    stageAddress;
+    static uint32_t    stageOffset;
+    static bool        stageValid;
+    static bool        stageDirty;
+    static util_old_timer_t stageTimer;
+#endif
+
+#if RECORD_DB_STAGING && RECORD_DB_RING_LOG
+    // Deadline flush written in the background by StorageDriver::writeAsync()
+    static bool        stageFlushing;
+    static ClustIter   flushTail;
+    static uint32_t    flushEnd;
+#endif
+
+    // Shared cluster buffer: the clusters are read and validated in place
+    static RecordClust clust;
+    // Changed when clust or stageClust takes another cluster: the views must be loaded again
+    static uint32_t    clustGen;
+
+    static uint32_t   savedCount;
+    static uint32_t   saveReadBytes;
+    static uint32_t   saveWriteBytes;
+    static uint32_t   clustWrites;
+    static uint32_t   clustBroken;
+
+
+    uint32_t m_recordId;
 
 
     RecordDB() {}
 
-    RecordStatus loadClust(uint32_t address);
+    static RecordStatus loadClust(uint32_t address, const RecordClust** view);
     RecordStatus getNewId(uint32_t *newId);
+    RecordStatus findSaveClust(uint32_t *address, uint32_t *offset, uint32_t *size, ClustIter *tail);
+#if !RECORD_DB_RING_LOG
+    static RecordStatus findStaleClust(uint32_t *address);
+#endif
+    // First ID of the current log generation: the records before it are cleared
+    static uint32_t logFirstId();
+#if RECORD_DB_ROLLUP
+    static RecordStatus rollupClust(uint32_t address, bool useSpare, bool *spareUsed);
+#endif
+#if RECORD_DB_STAGING
+    RecordStatus stageNewClust(uint32_t address, uint32_t offset, uint32_t size, const ClustIter *tail);
+#endif
+
+    static RecordStatus flushStage();
+#if RECORD_DB_STAGING && RECORD_DB_RING_LOG
+    static void flushAsync();
+    static void flushDone(StorageStatus status);
+#endif
+    // Writes the cluster or its bytes from offset to the tail (the ring log)
+    static RecordStatus commitClust(RecordClust *clust, ClustIter *tail, uint32_t address, uint32_t offset);
+    static void clustCommitted(const RecordClust *clust, const ClustIter *tail, uint32_t address, uint32_t offset);
+
+    static bool clustNext(const RecordClust* clust, ClustIter* it);
+    static bool clustAppend(RecordClust* clust, ClustIter* it, const Record* record);
+    static uint32_t clustOffset(const ClustIter* it);
+    // The cluster magic and CRC are valid, a ring log slot is cut after the last valid record
+    static bool clustValid(RecordClust* clust);
+#if RECORD_LOG_CRC
+    static uint32_t logCrc(const RecordClust* clust, const uint8_t* data, uint32_t size);
+#   if RECORD_DB_PACKED
+    static void clustSeal(RecordClust* clust, ClustIter* it);
+#   endif
+#elif RECORD_DB_CRC
+    static uint32_t clustCrc(const RecordClust* clust);
+#endif
+
+#if RECORD_DB_PACKED
+    static bool timeToSeconds(const uint8_t* time, uint32_t* seconds);
+    static void secondsToTime(uint32_t seconds, uint8_t* time);
+    static uint32_t pumpDowntime(uint32_t delta, uint32_t workTime);
+    static uint32_t packVarint(uint8_t* dst, uint32_t value);
+    static bool unpackVarint(const uint8_t* src, uint32_t size, uint32_t* pos, uint32_t* value);
+#endif
+
+#if RECORD_DB_FAST_MOUNT
+    static RecordStatus loadDirectory();
+    static RecordStatus saveDirectory();
+    static RecordStatus mountDirty();
+    static void mountReset();
+    static uint32_t directoryUsed();
+    static uint32_t directoryCrc(uint32_t used);
+    static uint32_t summaryCrc();
+#endif
+
+    static ClustEntry* indexAt(uint32_t position);
+    static bool indexFind(uint32_t id, uint32_t *address, uint32_t *lastId = nullptr);
+    static void indexUpdate(uint32_t address, uint32_t id);
+
+#if RECORD_DB_RING_LOG
+    static RecordStatus findLogHead(uint32_t *head, uint32_t *seq);
+    static StorageStatus readLogSeq(uint32_t slot, uint32_t *seq);
+    static uint32_t logAddress(uint32_t slot);
+#endif
 };
@@ -0,0 +1,375 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "RollupDB.h"
+
+#if RECORD_DB_ROLLUP
+
+#include <stddef.h>
+#include <string.h>
+
+#include "glog.h"
+#include "system.h"
+#include "settings.h"
+#include "StorageAT.h"
+#include "liquid_sensor.h"
+
+
+extern StorageAT storage;
+
+extern settings_t settings;
+
+
+const char* RollupDB::PREFIX = "RLP";
+const char* RollupDB::TAG    = "RLP";
+
+RollupDB::RollupClust RollupDB::clust  = {};
+RollupDB::RollupClust RollupDB::loaded = {};
+uint32_t RollupDB::clustCount   = 0;
+uint32_t RollupDB::clustAddress = 0;
+bool     RollupDB::clustStored  = false;
+bool     RollupDB::clustCleared = false;
+bool     RollupDB::mounted      = false;
+
+uint32_t RollupDB::rollups       = 0;
+uint32_t RollupDB::rolledRecords = 0;
+uint32_t RollupDB::dropped       = 0;
+
+
+RecordDB::RecordStatus RollupDB::add(const RecordDB::RecordClust* records, uint32_t spare, bool useSpare, bool* spareUsed)
+{
+	*spareUsed = false;
+
+	if (mount() != RecordDB::RECORD_OK) {
+		return RecordDB::RECORD_ERROR;
+	}
+
+	bool changed = false;
+	RecordDB::ClustIter it = {};
+	while (RecordDB::clustNext(records, &it)) {
+		const RecordDB::Record* record = &it.record;
+		if (record->id <= doneId()) {
+			continue;
+		}
+
+		Rollup* last = clustCount ? &clust.rollups[clustCount - 1] : nullptr;
+		if (last && record->id <= last->id) {
+			// Rolled up before an interrupted reuse
+			continue;
+		}
+
+		// The sent rollups are not changed: the server has them already
+		if (last &&
+			last->id > doneId() &&
+			last->id + 1 == record->id &&
+			sameHour(last, record)
+		) {
+			merge(last, record);
+		} else {
+			if (clustCount >= CLUST_SIZE) {
+				if (write(spare, useSpare, spareUsed) != RecordDB::RECORD_OK) {
+					return RecordDB::RECORD_ERROR;
+				}
+				memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+				clustCount  = 0;
+				clustStored = false;
+			}
+			start(&clust.rollups[clustCount++], record);
+			rollups++;
+		}
+		rolledRecords++;
+		changed = true;
+	}
+
+	if (!changed) {
+		return RecordDB::RECORD_OK;
+	}
+
+#if RECORD_BEDUG
+	printTagLog(RollupDB::TAG, "records rolled up to id=%lu", clust.rollups[clustCount - 1].id);
+#endif
+
+	return write(spare, useSpare, spareUsed);
+}
+
+RecordDB::RecordStatus RollupDB::reclaim(uint32_t* address)
+{
+	if (mount() != RecordDB::RECORD_OK) {
+		return RecordDB::RECORD_ERROR;
+	}
+	if (!clustCount && !clustCleared) {
+		return RecordDB::RECORD_NO_LOG;
+	}
+
+	uint32_t oldest = 0;
+	StorageStatus status = storage.find(FIND_MODE_MIN, &oldest, PREFIX);
+	if (status == STORAGE_NOT_FOUND) {
+		clustCleared = false;
+		return RecordDB::RECORD_NO_LOG;
+	}
+	if (status != STORAGE_OK) {
+		return RecordDB::RECORD_ERROR;
+	}
+
+	bool newest = clustStored && oldest == clustAddress;
+	uint32_t count = 0;
+	if (newest) {
+		count = clustCount;
+	} else if (loadClust(oldest, &loaded, &count) != RecordDB::RECORD_OK) {
+		// A broken page has nothing to send
+		count = 0;
+	}
+	const RollupClust* src = newest ? &clust : &loaded;
+	if (count && src->rollups[count - 1].id > doneId()) {
+		// The cleared pages are older
+		clustCleared = false;
+		return RecordDB::RECORD_NO_LOG;
+	}
+
+	if (newest) {
+		memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+		clustCount  = 0;
+		clustStored = false;
+	}
+
+#if RECORD_BEDUG
+	printTagLog(RollupDB::TAG, "page address=%08X reclaimed", (unsigned int)oldest);
+#endif
+
+	*address = oldest;
+	return RecordDB::RECORD_OK;
+}
+
+RecordDB::RecordStatus RollupDB::find(uint32_t id, Rollup* rollup)
+{
+	if (mount() != RecordDB::RECORD_OK) {
+		return RecordDB::RECORD_ERROR;
+	}
+	// The cleared rollups are skipped
+	id = __max(id, RecordDB::logFirstId());
+	if (!clustCount || clust.rollups[clustCount - 1].id < id) {
+		return RecordDB::RECORD_NO_LOG;
+	}
+
+	const RollupClust* src = &clust;
+	uint32_t count = clustCount;
+	if (clust.rollups[0].id >= id) {
+		// Page ID is the last rollup ID
+		uint32_t address = 0;
+		StorageStatus status = storage.find(FIND_MODE_NEXT, &address, PREFIX, id ? id - 1 : 0);
+		if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RollupDB::TAG, "error find: find page after id=%lu", id);
+#endif
+			return (status == STORAGE_NOT_FOUND) ? RecordDB::RECORD_NO_LOG : RecordDB::RECORD_ERROR;
+		}
+		if (!clustStored || address != clustAddress) {
+			if (loadClust(address, &loaded, &count) != RecordDB::RECORD_OK) {
+				return RecordDB::RECORD_ERROR;
+			}
+			src = &loaded;
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (src->rollups[i].id >= id) {
+			memcpy(reinterpret_cast<void*>(rollup), reinterpret_cast<const void*>(&src->rollups[i]), sizeof(*rollup));
+			return RecordDB::RECORD_OK;
+		}
+	}
+	return RecordDB::RECORD_NO_LOG;
+}
+
+void RollupDB::toRecord(const Rollup* rollup, RecordDB::Record* record)
+{
+	memset(reinterpret_cast<void*>(record), 0, sizeof(*record));
+	record->id = rollup->id;
+	memcpy(record->time, rollup->time, sizeof(record->time));
+	record->level         = rollup->level_count ? rollup->level_sum / static_cast<int32_t>(rollup->level_count) : LEVEL_ERROR;
+	record->press_1       = static_cast<uint16_t>(rollup->count ? rollup->press_sum / rollup->count : 0);
+	record->pump_wok_time = rollup->pump_wok_time;
+	record->pump_downtime = rollup->pump_downtime;
+}
+
+void RollupDB::invalidate()
+{
+	mounted = false;
+}
+
+RecordDB::RecordStatus RollupDB::mount()
+{
+	if (mounted) {
+		return RecordDB::RECORD_OK;
+	}
+
+	memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+	clustCount   = 0;
+	clustStored  = false;
+	clustCleared = (RecordDB::logFirstId() > 1);
+
+	uint32_t address = 0;
+	StorageStatus status = storage.find(FIND_MODE_MAX, &address, PREFIX);
+	if (status == STORAGE_NOT_FOUND) {
+		mounted = true;
+		return RecordDB::RECORD_OK;
+	}
+	if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RollupDB::TAG, "error mount: find newest page (error=%02X)", status);
+#endif
+		return RecordDB::RECORD_ERROR;
+	}
+
+	if (loadClust(address, &clust, &clustCount) == RecordDB::RECORD_OK &&
+		clustCount &&
+		clust.rollups[clustCount - 1].id >= RecordDB::logFirstId()
+	) {
+		clustAddress = address;
+		clustStored  = true;
+	} else {
+		// A broken or cleared page is left to the next rollups page
+		memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+		clustCount = 0;
+	}
+
+	mounted = true;
+	return RecordDB::RECORD_OK;
+}
+
+RecordDB::RecordStatus RollupDB::write(uint32_t spare, bool useSpare, bool* spareUsed)
+{
+	bool fresh = !clustStored;
+	if (fresh) {
+		StorageStatus status = storage.find(FIND_MODE_EMPTY, &clustAddress, PREFIX);
+		if ((status == STORAGE_NOT_FOUND || status == STORAGE_OOM) &&
+			reclaim(&clustAddress) == RecordDB::RECORD_OK
+		) {
+			// The oldest page has been sent
+			status = STORAGE_OK;
+		}
+		if (status == STORAGE_NOT_FOUND || status == STORAGE_OOM) {
+			if (useSpare && !*spareUsed) {
+				clustAddress = spare;
+				*spareUsed   = true;
+				status       = STORAGE_OK;
+			} else {
+				// The last resort: the oldest rollups are lost
+				status = storage.find(FIND_MODE_MIN, &clustAddress, PREFIX);
+				dropped += (status == STORAGE_OK) ? 1 : 0;
+			}
+		}
+		if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+			printTagLog(RollupDB::TAG, "error write: no page for rollups (error=%02X)", status);
+#endif
+			return RecordDB::RECORD_ERROR;
+		}
+	}
+
+	clust.rollup_magic = CLUST_MAGIC;
+#if RECORD_DB_CRC
+	clust.crc = clustCrc(&clust);
+#endif
+	StorageStatus status = storage.rewrite(
+		clustAddress,
+		PREFIX,
+		clust.rollups[clustCount - 1].id,
+		reinterpret_cast<uint8_t*>(&clust),
+		sizeof(clust)
+	);
+	if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+		printTagLog(RollupDB::TAG, "error write: page address=%08X (error=%02X)", (unsigned int)clustAddress, status);
+#endif
+		if (fresh && *spareUsed && clustAddress == spare) {
+			// The spare page still keeps the records
+			*spareUsed = false;
+		}
+		return RecordDB::RECORD_ERROR;
+	}
+
+	clustStored = true;
+	return RecordDB::RECORD_OK;
+}
+
+RecordDB::RecordStatus RollupDB::loadClust(uint32_t address, RollupClust* dst, uint32_t* count)
+{
+	StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(dst), sizeof(*dst));
+	bool valid = (status == STORAGE_OK && dst->rollup_magic == CLUST_MAGIC);
+#if RECORD_DB_CRC
+	if (valid && dst->crc != clustCrc(dst)) {
+		RecordDB::clustBroken++;
+		valid = false;
+	}
+#endif
+	if (!valid) {
+#if RECORD_BEDUG
+		printTagLog(RollupDB::TAG, "error load page address=%08X", (unsigned int)address);
+#endif
+		return RecordDB::RECORD_ERROR;
+	}
+
+	*count = 0;
+	while (*count < CLUST_SIZE && dst->rollups[*count].id) {
+		(*count)++;
+	}
+	return RecordDB::RECORD_OK;
+}
+
+#if RECORD_DB_CRC
+uint32_t RollupDB::clustCrc(const RollupClust* clust)
+{
+	const uint8_t* data  = reinterpret_cast<const uint8_t*>(clust);
+	const uint32_t field = offsetof(RollupClust, crc);
+	uint32_t crc = system_crc32(0, data, field);
+	return system_crc32(crc, data + field + sizeof(clust->crc), sizeof(*clust) - field - sizeof(clust->crc));
+}
+#endif
+
+uint32_t RollupDB::doneId()
+{
+	// The cleared records are not kept as well as the sent ones
+	uint32_t firstId = RecordDB::logFirstId();
+	return __max(settings.server_log_id, firstId ? firstId - 1 : 0);
+}
+
+bool RollupDB::sameHour(const Rollup* rollup, const RecordDB::Record* record)
+{
+	// Year, month, day and hour
+	return !memcmp(rollup->time, record->time, 4);
+}
+
+void RollupDB::start(Rollup* rollup, const RecordDB::Record* record)
+{
+	memset(reinterpret_cast<void*>(rollup), 0, sizeof(*rollup));
+	memcpy(rollup->time, record->time, sizeof(rollup->time));
+	rollup->time[4]   = 0;
+	rollup->time[5]   = 0;
+	rollup->level_min = LEVEL_ERROR;
+	rollup->level_max = LEVEL_ERROR;
+	rollup->press_min = record->press_1;
+	rollup->press_max = record->press_1;
+	merge(rollup, record);
+}
+
+void RollupDB::merge(Rollup* rollup, const RecordDB::Record* record)
+{
+	if (record->level != LEVEL_ERROR) {
+		if (!rollup->level_count) {
+			rollup->level_min = record->level;
+			rollup->level_max = record->level;
+		}
+		rollup->level_min = __min(rollup->level_min, record->level);
+		rollup->level_max = __max(rollup->level_max, record->level);
+		rollup->level_sum += record->level;
+		rollup->level_count++;
+	}
+	rollup->press_min      = __min(rollup->press_min, record->press_1);
+	rollup->press_max      = __max(rollup->press_max, record->press_1);
+	rollup->press_sum     += record->press_1;
+	rollup->pump_wok_time += record->pump_wok_time;
+	rollup->pump_downtime += record->pump_downtime;
+	rollup->id             = record->id;
+	rollup->count++;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "RecordDB.h"
+#include "StorageAT.h"
+
+
+#if RECORD_DB_ROLLUP
+
+/*
+ * Hourly rollups of the unsent records. Before the oldest cluster is reused
+ * its records with ID > settings.server_log_id are compacted into one rollup
+ * per hour ("RLP" pages, the newest page is kept in RAM).
+ * A rollup has the ID of its last record and the previous rollups and records
+ * have smaller IDs, so the rollups are uploaded before the records and the
+ * server acknowledges them through the same last ID.
+ * The sent rollups pages are reused by the records first.
+ */
+class RollupDB
+{
+public:
+    typedef struct __attribute__((packed)) _Rollup {
+        uint32_t id;                                     // Last record ID, 0 - empty
+        uint8_t  time[RecordDB::RECORD_TIME_ARRAY_SIZE]; // Hour start
+        uint16_t count;                                  // Records: IDs from id - count + 1 to id
+        uint16_t level_count;                            // Records with a valid level
+        int32_t  level_min;
+        int32_t  level_max;
+        int32_t  level_sum;
+        uint16_t press_min;
+        uint16_t press_max;
+        uint32_t press_sum;
+        uint32_t pump_wok_time;                          // Summed pump work sec
+        uint32_t pump_downtime;                          // Summed pump downtime sec
+    } Rollup;
+
+    // Rolls up the unsent records of the cluster before its page is reused,
+    // the page is taken for the rollups (spareUsed) if spare and no empty page is left
+    static RecordDB::RecordStatus add(const RecordDB::RecordClust* records, uint32_t spare, bool useSpare, bool* spareUsed);
+    // Gives the oldest rollups page back to the records if all its rollups have been sent
+    static RecordDB::RecordStatus reclaim(uint32_t* address);
+    // Loads the first rollup with ID >= id
+    static RecordDB::RecordStatus find(uint32_t id, Rollup* rollup);
+    // Average values of the rollup as a record
+    static void toRecord(const Rollup* rollup, RecordDB::Record* record);
+
+    // Forget the cached rollups page (after the storage format or the log clear)
+    static void invalidate();
+
+    static uint32_t rollups;       // Rollups created
+    static uint32_t rolledRecords; // Records compacted into the rollups
+    static uint32_t dropped;       // Rollup pages reused without the upload
+
+private:
+    static const char* PREFIX;
+    static const char* TAG;
+
+#if RECORD_DB_CRC
+    static const uint32_t CLUST_HEADER_SIZE = (sizeof(uint8_t) + sizeof(uint32_t));
+#else
+    static const uint32_t CLUST_HEADER_SIZE = (sizeof(uint8_t));
+#endif
+    static const uint32_t CLUST_SIZE  = ((STORAGE_PAGE_PAYLOAD_SIZE - CLUST_HEADER_SIZE) / sizeof(struct _Rollup));
+    static const uint32_t CLUST_MAGIC = (sizeof(struct _Rollup) | RecordDB::CLUST_CRC_MAGIC);
+
+    typedef struct __attribute__((packed)) _RollupClust {
+        uint8_t  rollup_magic;
+#if RECORD_DB_CRC
+        uint32_t crc;            // CRC32 of the page without this field
+#endif
+        Rollup   rollups[CLUST_SIZE];
+    } RollupClust;
+
+    static RollupClust clust;        // Newest rollups page
+    static RollupClust loaded;       // Older page for find() and reclaim()
+    static uint32_t    clustCount;
+    static uint32_t    clustAddress;
+    static bool        clustStored;  // clustAddress is valid
+    static bool        clustCleared; // Pages of the cleared log generations may be left
+    static bool        mounted;
+
+    static RecordDB::RecordStatus mount();
+    static RecordDB::RecordStatus write(uint32_t spare, bool useSpare, bool* spareUsed);
+    static RecordDB::RecordStatus loadClust(uint32_t address, RollupClust* dst, uint32_t* count);
+#if RECORD_DB_CRC
+    static uint32_t clustCrc(const RollupClust* clust);
+#endif
+
+    // Last record ID that is not rolled up: sent or cleared
+    static uint32_t doneId();
+    static bool sameHour(const Rollup* rollup, const RecordDB::Record* record);
+    static void start(Rollup* rollup, const RecordDB::Record* record);
+    static void merge(Rollup* rollup, const RecordDB::Record* record);
+};
+
+#endif
@@ -0,0 +1,327 @@
+#include "CounterDB.h"
+
+#include <cstring>
+
+#include "glog.h"
+#include "rtc.h"
+#include "system.h"
+#include "settings.h"
+
+#include "StorageAT.h"
+
+
+extern StorageAT storage;
+
+
+CounterDB::Journal CounterDB::journal = {};
+uint32_t CounterDB::values[COUNTERS_COUNT] = {};
+unsigned CounterDB::entriesCount = 0;
+uint32_t CounterDB::address = 0;
+bool CounterDB::mounted = false;
+
+#if COUNTER_DB_BKP
+bool CounterDB::dirty = false;
+util_old_timer_t CounterDB::flushTimer = {};
+#endif
+
+uint32_t CounterDB::appends = 0;
+uint32_t CounterDB::compactions = 0;
+
+
+SettingsStatus CounterDB::load()
+{
+	if (!mounted && mount() != SETTINGS_OK) {
+		return SETTINGS_ERROR;
+	}
+
+	for (unsigned i = 0; i < COUNTERS_COUNT; i++) {
+		setCounter(i, values[i]);
+	}
+
+#if COUNTER_DB_BKP
+	// The backup registers are newer than the journal after a reset
+	if (bkpLoad()) {
+		for (unsigned i = 0; i < COUNTERS_COUNT; i++) {
+			if (getCounter(i) != values[i]) {
+				dirty = true;
+			}
+		}
+		if (dirty) {
+			util_old_timer_start(&flushTimer, COUNTER_FLUSH_DELAY_MS);
+		}
+#if COUNTER_DB_BEDUG
+		printTagLog(CounterDB::TAG, "counters restored from the backup registers");
+#endif
+	}
+#endif
+
+	return SETTINGS_OK;
+}
+
+SettingsStatus CounterDB::save()
+{
+#if COUNTER_DB_BKP
+	bkpSave();
+
+	if (!dirty) {
+		util_old_timer_start(&flushTimer, COUNTER_FLUSH_DELAY_MS);
+	}
+	dirty = true;
+
+	return SETTINGS_OK;
+#else
+	return flush();
+#endif
+}
+
+void CounterDB::update()
+{
+#if COUNTER_DB_BKP
+	if (dirty && !util_old_timer_wait(&flushTimer)) {
+		if (flush() != SETTINGS_OK) {
+			util_old_timer_start(&flushTimer, COUNTER_FLUSH_DELAY_MS);
+		}
+	}
+#endif
+}
+
+SettingsStatus CounterDB::flush()
+{
+#if COUNTER_DB_BKP
+	bkpSave();
+#endif
+
+	if (!mounted && mount() != SETTINGS_OK) {
+		return SETTINGS_ERROR;
+	}
+
+	bool changed = false;
+	for (unsigned i = 0; i < COUNTERS_COUNT; i++) {
+		uint32_t value = getCounter(i);
+		if (value == values[i]) {
+			continue;
+		}
+		if (entriesCount >= ENTRIES_COUNT) {
+			return compact();
+		}
+
+		Entry* entry   = &journal.entries[entriesCount];
+		entry->counter = static_cast<uint8_t>(i);
+		entry->value   = value;
+		entry->check   = entryCheck(entriesCount, entry);
+		entriesCount++;
+		// Terminate the journal after the entry: the next ones are stale
+		if (entriesCount < ENTRIES_COUNT) {
+			journal.entries[entriesCount].counter = COUNTERS_COUNT;
+		}
+
+		values[i] = value;
+		changed   = true;
+	}
+
+	if (!changed) {
+#if COUNTER_DB_BKP
+		dirty = false;
+#endif
+		return SETTINGS_OK;
+	}
+
+	appends++;
+	return write();
+}
+
+void CounterDB::invalidate()
+{
+	mounted = false;
+}
+
+SettingsStatus CounterDB::mount()
+{
+	StorageStatus status = storage.find(FIND_MODE_EQUAL, &address, PREFIX, 1);
+	if (status == STORAGE_NOT_FOUND) {
+		// No journal yet: the counters saved in the settings record are the base
+#if COUNTER_DB_BEDUG
+		printTagLog(CounterDB::TAG, "journal not found, create it");
+#endif
+		status = storage.find(FIND_MODE_EMPTY, &address);
+		if (status != STORAGE_OK) {
+#if COUNTER_DB_BEDUG
+			printTagLog(CounterDB::TAG, "error mount counters: storage find empty error=%02X", status);
+#endif
+			return SETTINGS_ERROR;
+		}
+		return compact();
+	}
+
+	if (status == STORAGE_OK) {
+		status = storage.load(address, reinterpret_cast<uint8_t*>(&journal), sizeof(journal));
+	}
+	if (status != STORAGE_OK) {
+#if COUNTER_DB_BEDUG
+		printTagLog(CounterDB::TAG, "error mount counters: storage error=%02X", status);
+#endif
+		return SETTINGS_ERROR;
+	}
+
+	if (journal.crc != system_crc32(0, journal.base, sizeof(journal.base))) {
+#if COUNTER_DB_BEDUG
+		printTagLog(CounterDB::TAG, "journal base is broken, rebuild it (address=%lu)", address);
+#endif
+		return compact();
+	}
+
+	memcpy(values, journal.base, sizeof(values));
+	for (entriesCount = 0; entriesCount < ENTRIES_COUNT; entriesCount++) {
+		const Entry* entry = &journal.entries[entriesCount];
+		if (entry->counter >= COUNTERS_COUNT || entry->check != entryCheck(entriesCount, entry)) {
+			break;
+		}
+		values[entry->counter] = entry->value;
+	}
+
+#if COUNTER_DB_BEDUG
+	printTagLog(CounterDB::TAG, "journal mounted (address=%lu, entries=%u)", address, entriesCount);
+#endif
+
+	mounted = true;
+
+	return SETTINGS_OK;
+}
+
+SettingsStatus CounterDB::compact()
+{
+	for (unsigned i = 0; i < COUNTERS_COUNT; i++) {
+		values[i] = getCounter(i);
+	}
+	memcpy(journal.base, values, sizeof(journal.base));
+	journal.crc = system_crc32(0, journal.base, sizeof(journal.base));
+	journal.entries[0].counter = COUNTERS_COUNT;
+	entriesCount = 0;
+
+	mounted = true;
+	compactions++;
+
+	return write();
+}
+
+SettingsStatus CounterDB::write()
+{
+	StorageStatus status = storage.rewrite(address, PREFIX, 1, reinterpret_cast<uint8_t*>(&journal), sizeof(journal));
+	if (status != STORAGE_OK) {
+#if COUNTER_DB_BEDUG
+		printTagLog(CounterDB::TAG, "error save counters: storage save error=%02X address=%lu", status, address);
+#endif
+		// The journal in the memory may differ from the storage one now
+		mounted = false;
+		return SETTINGS_ERROR;
+	}
+
+#if COUNTER_DB_BKP
+	dirty = false;
+#endif
+
+	return SETTINGS_OK;
+}
+
+#if COUNTER_DB_BKP
+bool CounterDB::bkpLoad()
+{
+	uint32_t words[BKP_WORDS_COUNT] = {};
+	for (unsigned i = 0; i < BKP_WORDS_COUNT * 2; i++) {
+		uint32_t half = HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_DR2 + i) & 0xFFFF;
+		words[i / 2] |= half << ((i % 2) * 16);
+	}
+	uint16_t check = static_cast<uint16_t>(HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_DR2 + BKP_WORDS_COUNT * 2));
+	if (check != bkpCheck(words)) {
+		return false;
+	}
+
+	setCounter(COUNTER_WORK_SEC, words[0]);
+	setCounter(COUNTER_DOWNTIME_SEC, words[1]);
+	setCounter(COUNTER_WORK_DAY_SEC, words[2] & BKP_DAY_SEC_MAX);
+	setCounter(COUNTER_LOG_DATE, words[2] >> 24);
+	setCounter(COUNTER_SERVER_LOG_ID, words[3]);
+
+	return true;
+}
+
+void CounterDB::bkpSave()
+{
+	uint32_t words[BKP_WORDS_COUNT] = {
+		getCounter(COUNTER_WORK_SEC),
+		getCounter(COUNTER_DOWNTIME_SEC),
+		(getCounter(COUNTER_WORK_DAY_SEC) & BKP_DAY_SEC_MAX) | (getCounter(COUNTER_LOG_DATE) << 24),
+		getCounter(COUNTER_SERVER_LOG_ID)
+	};
+	uint16_t check = bkpCheck(words);
+	if (getCounter(COUNTER_WORK_DAY_SEC) > BKP_DAY_SEC_MAX) {
+		// The value does not fit: the registers are invalidated, the journal keeps the counters
+		check = static_cast<uint16_t>(~check);
+	}
+
+	HAL_PWR_EnableBkUpAccess();
+	for (unsigned i = 0; i < BKP_WORDS_COUNT * 2; i++) {
+		HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_DR2 + i, (words[i / 2] >> ((i % 2) * 16)) & 0xFFFF);
+	}
+	HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_DR2 + BKP_WORDS_COUNT * 2, check);
+	HAL_PWR_DisableBkUpAccess();
+}
+
+uint16_t CounterDB::bkpCheck(const uint32_t* words)
+{
+	uint32_t crc = system_crc32(0, words, BKP_WORDS_COUNT * sizeof(*words));
+	// Zeroed registers (the backup domain reset) are not valid
+	return static_cast<uint16_t>((crc ^ (crc >> 16)) ^ 0xC0DE);
+}
+#endif
+
+uint32_t CounterDB::getCounter(unsigned index)
+{
+	switch (index) {
+	case COUNTER_WORK_SEC:
+		return settings.pump_work_sec;
+	case COUNTER_DOWNTIME_SEC:
+		return settings.pump_downtime_sec;
+	case COUNTER_WORK_DAY_SEC:
+		return settings.pump_work_day_sec;
+	case COUNTER_LOG_DATE:
+		return settings.pump_log_date;
+	case COUNTER_SERVER_LOG_ID:
+		return settings.server_log_id;
+	default:
+		return 0;
+	}
+}
+
+void CounterDB::setCounter(unsigned index, uint32_t value)
+{
+	switch (index) {
+	case COUNTER_WORK_SEC:
+		settings.pump_work_sec = value;
+		break;
+	case COUNTER_DOWNTIME_SEC:
+		settings.pump_downtime_sec = value;
+		break;
+	case COUNTER_WORK_DAY_SEC:
+		settings.pump_work_day_sec = value;
+		break;
+	case COUNTER_LOG_DATE:
+		settings.pump_log_date = static_cast<uint8_t>(value);
+		break;
+	case COUNTER_SERVER_LOG_ID:
+		settings.server_log_id = value;
+		break;
+	default:
+		break;
+	}
+}
+
+uint8_t CounterDB::entryCheck(unsigned index, const Entry* entry)
+{
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(&entry->value);
+	uint8_t check = static_cast<uint8_t>(0x5A ^ index ^ entry->counter);
+	for (unsigned i = 0; i < sizeof(entry->value); i++) {
+		check = static_cast<uint8_t>(((check << 1) | (check >> 7)) ^ data[i]);
+	}
+	return check;
+}
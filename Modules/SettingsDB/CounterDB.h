@@ -0,0 +1,116 @@
+#ifndef COUNTER_DB_H
+#define COUNTER_DB_H
+
+
+#include <cstdint>
+
+#include "main.h"
+#include "gutils.h"
+#include "settings.h"
+#include "StorageAT.h"
+
+
+#ifdef DEBUG
+#   define COUNTER_DB_BEDUG (0)
+#endif
+
+/*
+ * Backup registers tier: the changed counters are stored in RTC_BKP_DR2..DR10
+ * at once (they survive the resets without the I2C traffic), the journal is
+ * appended after COUNTER_FLUSH_DELAY_MS, on the power loss and with the settings save
+ */
+#define COUNTER_DB_BKP         (1)
+#define COUNTER_FLUSH_DELAY_MS (60 * 60 * 1000)
+
+
+/*
+ * Journal of the fast changing counters: the pump counters and the last
+ * server log ID. The counters stay in settings_t, but they are persisted
+ * apart from the settings record: a change appends one small entry per
+ * changed counter (its new value) to the journal page and marks the next
+ * entry as the journal end, the full journal is compacted into the base values.
+ * NEED_SAVE_COUNTERS requests the save, the settings record is saved
+ * only on the configuration changes.
+ */
+class CounterDB
+{
+private:
+	typedef enum _Counter {
+		COUNTER_WORK_SEC = 0,
+		COUNTER_DOWNTIME_SEC,
+		COUNTER_WORK_DAY_SEC,
+		COUNTER_LOG_DATE,
+		COUNTER_SERVER_LOG_ID,
+		COUNTERS_COUNT
+	} Counter;
+
+	typedef struct __attribute__((packed)) _Entry {
+		uint8_t  counter; // COUNTERS_COUNT and above - the journal end
+		uint8_t  check;   // entryCheck(), a torn entry ends the journal
+		uint32_t value;
+	} Entry;
+
+	static constexpr unsigned ENTRIES_COUNT = 24;
+
+	typedef struct __attribute__((packed)) _Journal {
+		uint32_t base[COUNTERS_COUNT];
+		uint32_t crc;                  // CRC32 of the base values
+		Entry    entries[ENTRIES_COUNT];
+	} Journal;
+
+	static_assert(sizeof(Journal) <= STORAGE_PAGE_PAYLOAD_SIZE, "counters journal must fit the storage page");
+
+#if COUNTER_DB_BKP
+	// Day work seconds and log date share a word: 16-bit registers DR2..DR10 hold 4 words and a check
+	static constexpr unsigned BKP_WORDS_COUNT = COUNTERS_COUNT - 1;
+	static constexpr unsigned BKP_REGS_COUNT  = BKP_WORDS_COUNT * 2 + 1;
+	static constexpr uint32_t BKP_DAY_SEC_MAX = 0xFFFFFF;
+
+	static_assert(RTC_BKP_DR1 + BKP_REGS_COUNT <= RTC_BKP_NUMBER, "counters must fit the backup registers after DR1");
+
+	static bool dirty;
+	static util_old_timer_t flushTimer;
+#endif
+
+	static Journal journal;
+	static uint32_t values[COUNTERS_COUNT];
+	static unsigned entriesCount;
+	static uint32_t address;
+	static bool mounted;
+
+	static constexpr char PREFIX[] = "CNT";
+	static constexpr char TAG[] = "CNT";
+
+	static SettingsStatus mount();
+	static SettingsStatus compact();
+	static SettingsStatus write();
+
+#if COUNTER_DB_BKP
+	static bool bkpLoad();
+	static void bkpSave();
+	static uint16_t bkpCheck(const uint32_t* words);
+#endif
+
+	static uint32_t getCounter(unsigned index);
+	static void setCounter(unsigned index, uint32_t value);
+	static uint8_t entryCheck(unsigned index, const Entry* entry);
+
+public:
+	static uint32_t appends;
+	static uint32_t compactions;
+
+	// Mounts the journal (once) and applies the counters to the settings
+	static SettingsStatus load();
+	// Stores the changed counters (in the backup registers if enabled)
+	static SettingsStatus save();
+	// Appends the changed counters to the journal
+	static SettingsStatus flush();
+	// Flushes the counters after COUNTER_FLUSH_DELAY_MS
+	static void update();
+
+	// Forget the cached journal (after the storage format)
+	static void invalidate();
+};
+
+
+#endif
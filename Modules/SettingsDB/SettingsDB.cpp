@@ -7,6 +7,7 @@
 #include "soul.h"
 #include "gutils.h"
 #include "clock.h"
+#include "system.h"
 #include "settings.h"
 
 #include "StorageAT.h"
@@ -14,58 +15,60 @@
 #include "CodeStopwatch.h"
 
 
-extern StorageAT* storage;
+extern StorageAT storage;
 
 
-SettingsDB::SettingsDB(uint8_t* settings, uint32_t size): size(size), settings(settings) { }
+uint32_t SettingsDB::slotAddress[SLOTS_COUNT] = {};
+uint32_t SettingsDB::slotSeq[SLOTS_COUNT] = {};
+uint32_t SettingsDB::slotSize[SLOTS_COUNT] = {};
+bool SettingsDB::slotFound[SLOTS_COUNT] = {};
+bool SettingsDB::mounted = false;
 
-SettingsStatus SettingsDB::load()
-{
-	uint32_t address1 = 0, address2 = 0;
-	StorageStatus status = STORAGE_OK;
 
-	bool needResaveFirst = false, needResaveSecond = false;
-    status = storage->find(FIND_MODE_EQUAL, &address1, PREFIX, 1);
-    if (status != STORAGE_OK) {
-#if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error load settings: try to find duplicate (error=%02X)", status);
-#endif
-        needResaveFirst = true;
-    }
+SettingsDB::SettingsDB(uint8_t* settings, uint32_t size, uint32_t prevSize):
+	size(size), prevSize(prevSize), settings(settings) { }
 
-    status = storage->find(FIND_MODE_EQUAL, &address2, PREFIX, 2);
-    if (status != STORAGE_OK) {
-#if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error load settings: storage find error=%02X", status);
-#endif
-        needResaveSecond = true;
-    }
-
-    settings_t tmpSettings = {};
-    if (!needResaveFirst) {
-        status = storage->load(address1, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
-    } else if (!needResaveSecond) {
-        status = storage->load(address2, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
-    } else {
-    	status = STORAGE_NOT_FOUND;
-    }
-    if (status != STORAGE_OK) {
+SettingsStatus SettingsDB::load()
+{
+	SettingsStatus status = this->mount();
+	if (status != SETTINGS_OK) {
+		return status;
+	}
+
+	uint8_t buffer[sizeof(settings_t) + sizeof(SlotTrailer)] = {};
+	uint32_t seq = 0;
+	uint32_t loaded = this->size;
+	StorageStatus storageStatus = STORAGE_NOT_FOUND;
+	int slot = this->newestSlot();
+	if (slot >= 0) {
+		storageStatus = this->loadSlot(slot, buffer, &seq, &loaded);
+	} else {
+		// Settings saved before the journal: no trailer. The first journal save
+		// writes slot 0 and may be torn, the copy in the last slot is taken first
+		loaded = this->prevSize ? this->prevSize : this->size;
+		for (unsigned i = SLOTS_COUNT; i-- > 0;) {
+			if (slotFound[i]) {
+				storageStatus = storage.load(slotAddress[i], buffer, loaded);
+				slot = i;
+				break;
+			}
+		}
+	}
+    if (storageStatus != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error load settings: storage load error=%02X address1=%lu, adderss2=%lu", status, address1, address2);
+        printTagLog(SettingsDB::TAG, "error load settings: storage load error=%02X slot=%d", storageStatus, slot);
 #endif
         return SETTINGS_ERROR;
     }
 
-    memcpy(this->settings, &tmpSettings, this->size);
+    // The fields added after the previous layout are zeroed
+    memset(buffer + loaded, 0, this->size - loaded);
+    memcpy(this->settings, buffer, this->size);
 
 #if SETTINGS_DB_BEDUG
-    printTagLog(SettingsDB::TAG, "settings loaded");
+    printTagLog(SettingsDB::TAG, "settings loaded (slot=%d, seq=%lu, size=%lu)", slot, seq, loaded);
 #endif
 
-    if (needResaveFirst || needResaveSecond) {
-    	set_status(NEED_SAVE_SETTINGS);
-    }
-
     return SETTINGS_OK;
 }
 
@@ -73,33 +76,43 @@ SettingsStatus SettingsDB::save()
 {
 	utl::CodeStopwatch stopwatch(TAG, GENERAL_TIMEOUT_MS);
 
-	uint32_t address = 0;
-	StorageStatus status = STORAGE_OK;
-
-    status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 1);
+	if (!mounted && this->mount() != SETTINGS_OK) {
+		return SETTINGS_ERROR;
+	}
+
+	// Overwrite the broken slot or the older one
+	unsigned slot = 0;
+	uint32_t seq = 0;
+	for (unsigned i = 0; i < SLOTS_COUNT; i++) {
+		if (!slotSeq[i]) {
+			slot = i;
+			break;
+		}
+		if (static_cast<int32_t>(slotSeq[i] - slotSeq[slot]) < 0) {
+			slot = i;
+		}
+	}
+	int newest = this->newestSlot();
+	if (newest >= 0) {
+		seq = slotSeq[newest];
+	}
+	seq++;
 
-    if (status != STORAGE_OK) {
-#if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find error, try to find duplicate (error=%02X)", status);
-#endif
-    	status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 2);
-    }
-
-    if (status == STORAGE_NOT_FOUND) {
-#if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find duplicate error, try to find empty (error=%02X)", status);
-#endif
-        status = storage->find(FIND_MODE_EMPTY, &address);
-    }
-
-    if (status == STORAGE_NOT_FOUND) {
-        // Search for any address
+	StorageStatus status = STORAGE_OK;
+	uint32_t address = slotAddress[slot];
+	if (!slotFound[slot]) {
+		status = storage.find(FIND_MODE_EMPTY, &address);
+		if (status == STORAGE_NOT_FOUND) {
+			// Search for any address
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find empty error, try to find any address (error=%02X)", status);
+			printTagLog(SettingsDB::TAG, "error save settings: storage find empty error, try to find any address (error=%02X)", status);
 #endif
-    	status = storage->find(FIND_MODE_NEXT, &address, "", 0);
-    }
-
+			status = storage.find(FIND_MODE_NEXT, &address, "", 0);
+		}
+		if (status == STORAGE_OK && slotFound[(slot + 1) % SLOTS_COUNT] && slotAddress[(slot + 1) % SLOTS_COUNT] == address) {
+			status = STORAGE_OOM;
+		}
+	}
     if (status != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
         printTagLog(SettingsDB::TAG, "error save settings: storage find error=%02X", status);
@@ -107,8 +120,14 @@ SettingsStatus SettingsDB::save()
         return SETTINGS_ERROR;
     }
 
-    // Save original settings
-	status = storage->rewrite(address, PREFIX, 1, this->settings, this->size);
+	uint8_t buffer[sizeof(settings_t) + sizeof(SlotTrailer)] = {};
+	memcpy(buffer, this->settings, this->size);
+	SlotTrailer* trailer = reinterpret_cast<SlotTrailer*>(buffer + this->size);
+	trailer->seq = seq;
+	trailer->crc = system_crc32(0, buffer, this->size + sizeof(trailer->seq));
+
+	slotSeq[slot] = 0;
+	status = storage.rewrite(address, PREFIX, slot + 1, buffer, this->size + sizeof(SlotTrailer));
     if (status != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
         printTagLog(SettingsDB::TAG, "error save settings: storage save error=%02X address=%lu", status, address);
@@ -116,31 +135,93 @@ SettingsStatus SettingsDB::save()
         return SETTINGS_ERROR;
     }
 
-    // Save duplicate settings
-	status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 2);
+	slotAddress[slot] = address;
+	slotFound[slot]   = true;
+	slotSeq[slot]     = seq;
+	slotSize[slot]    = this->size;
 
-    if (status == STORAGE_NOT_FOUND) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings duplicate: storage find error, try to find empty (error=%02X)", status);
+	printTagLog(SettingsDB::TAG, "settings saved successfully (slot=%u, seq=%lu, address=%lu)", slot, seq, address);
 #endif
-        status = storage->find(FIND_MODE_EMPTY, &address);
-    }
 
-	status = storage->rewrite(address, PREFIX, 2, this->settings, this->size);
-    if (status != STORAGE_OK) {
+	return SETTINGS_OK;
+}
+
+void SettingsDB::invalidate()
+{
+	mounted = false;
+}
+
+SettingsStatus SettingsDB::mount()
+{
+	if (this->size > sizeof(settings_t) || this->prevSize > this->size) {
+		return SETTINGS_ERROR;
+	}
+
+	uint8_t buffer[sizeof(settings_t) + sizeof(SlotTrailer)] = {};
+	for (unsigned i = 0; i < SLOTS_COUNT; i++) {
+		slotSeq[i] = 0;
+		StorageStatus status = storage.find(FIND_MODE_EQUAL, &slotAddress[i], PREFIX, i + 1);
+		slotFound[i] = status == STORAGE_OK;
+		if (status == STORAGE_NOT_FOUND) {
+			continue;
+		}
+		if (status == STORAGE_OK) {
+			status = this->loadSlot(i, buffer, &slotSeq[i], &slotSize[i]);
+		}
+		if (status != STORAGE_OK && status != STORAGE_NOT_FOUND) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings duplicate: storage save error=%02X address=%lu", status, address);
+			printTagLog(SettingsDB::TAG, "error mount settings: slot=%u storage error=%02X", i, status);
 #endif
-        return SETTINGS_ERROR;
-    }
+			return SETTINGS_ERROR;
+		}
+	}
+
+	mounted = true;
+
+	return SETTINGS_OK;
+}
+
+StorageStatus SettingsDB::loadSlot(unsigned slot, uint8_t* buffer, uint32_t* seq, uint32_t* size)
+{
+	*seq  = 0;
+	*size = this->size;
+	StorageStatus status = storage.load(slotAddress[slot], buffer, this->size + sizeof(SlotTrailer));
+	if (status != STORAGE_OK) {
+		return status;
+	}
+
+	// The current layout first, then the previous one
+	const uint32_t sizes[] = { this->size, this->prevSize };
+	for (unsigned i = 0; i < __arr_len(sizes); i++) {
+		if (!sizes[i] || (i && sizes[i] == this->size)) {
+			continue;
+		}
+		SlotTrailer* trailer = reinterpret_cast<SlotTrailer*>(buffer + sizes[i]);
+		if (trailer->crc == system_crc32(0, buffer, sizes[i] + sizeof(trailer->seq))) {
+			*seq  = trailer->seq;
+			*size = sizes[i];
+			return STORAGE_OK;
+		}
+	}
 
-    if (this->load() == SETTINGS_OK) {
 #if SETTINGS_DB_BEDUG
-    	printTagLog(SettingsDB::TAG, "settings saved successfully (address=%lu)", address);
+	printTagLog(SettingsDB::TAG, "slot=%u address=%lu: no valid trailer", slot, slotAddress[slot]);
 #endif
 
-    	return SETTINGS_OK;
-    }
+	return STORAGE_OK;
+}
 
-    return SETTINGS_ERROR;
+int SettingsDB::newestSlot()
+{
+	int slot = -1;
+	for (unsigned i = 0; i < SLOTS_COUNT; i++) {
+		if (!slotSeq[i]) {
+			continue;
+		}
+		if (slot < 0 || static_cast<int32_t>(slotSeq[i] - slotSeq[slot]) > 0) {
+			slot = i;
+		}
+	}
+	return slot;
 }
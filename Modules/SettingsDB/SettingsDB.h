@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "settings.h"
+#include "StorageAT.h"
 
 
 #ifdef DEBUG
@@ -13,20 +14,50 @@
 #endif
 
 
+/*
+ * A/B journal: settings are kept in two slots ("STG" 1 and 2), each one
+ * followed by a trailer with a sequence number and CRC. A save writes only
+ * the older (or broken) slot, a load takes the newest valid one, so a torn
+ * write leaves the previous settings intact.
+ * Slot addresses are found once and cached until SettingsDB::invalidate().
+ * A slot written by the previous settings layout (prevSize bytes) is loaded
+ * with the new fields zeroed.
+ */
 class SettingsDB
 {
 private:
+	typedef struct __attribute__((packed)) _SlotTrailer {
+		uint32_t seq; // Commit number, 0 - empty or broken slot
+		uint32_t crc; // CRC32 of the settings and seq
+	} SlotTrailer;
+
+	static constexpr unsigned SLOTS_COUNT = 2;
+
 	const uint32_t size;
+	const uint32_t prevSize;
     uint8_t* settings;
 
+    static uint32_t slotAddress[SLOTS_COUNT];
+    static uint32_t slotSeq[SLOTS_COUNT];
+    static uint32_t slotSize[SLOTS_COUNT];
+    static bool slotFound[SLOTS_COUNT];
+    static bool mounted;
+
     static constexpr char PREFIX[] = "STG";
     static constexpr char TAG[] = "STG";
 
+    SettingsStatus mount();
+    StorageStatus loadSlot(unsigned slot, uint8_t* buffer, uint32_t* seq, uint32_t* size);
+    int newestSlot();
+
 public:
-    SettingsDB(uint8_t* settings, uint32_t size);
+    SettingsDB(uint8_t* settings, uint32_t size, uint32_t prevSize = 0);
 
     SettingsStatus load();
     SettingsStatus save();
+
+    // Forget the cached slot addresses (after the storage format)
+    static void invalidate();
 };
 
 
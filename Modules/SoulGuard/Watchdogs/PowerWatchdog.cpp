@@ -5,6 +5,9 @@
 #include "system.h"
 #include "hal_defs.h"
 
+#include "RecordDB.h"
+#include "CounterDB.h"
+
 #include "CodeStopwatch.h"
 
 
@@ -22,7 +25,10 @@ void PowerWatchdog::check()
 
 	if (STM_MIN_VOLTAGEx10 <= voltage && voltage <= STM_MAX_VOLTAGEx10) {
 		reset_error(POWER_ERROR);
-	} else {
+	} else if (!is_error(POWER_ERROR)) {
 		set_error(POWER_ERROR);
+		// Save the staged records, the index and the counters before the power is lost
+		RecordDB::unmount();
+		CounterDB::flush();
 	}
 }
@@ -11,6 +11,7 @@
 #include "settings.h"
 
 #include "Timer.h"
+#include "CounterDB.h"
 #include "SettingsDB.h"
 #include "CodeStopwatch.h"
 
@@ -87,7 +88,7 @@ void _stng_check(void)
 
 void _stng_init_s(void)
 {
-	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size());
+	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
 	SettingsStatus status = settingsDB.load();
 	if (status == SETTINGS_OK) {
 #if WATCHDOG_BEDUG
@@ -109,6 +110,8 @@ void _stng_init_s(void)
 	}
 
 	if (status == SETTINGS_OK) {
+		CounterDB::load();
+
 		reset_error(SETTINGS_LOAD_ERROR);
 		settings_show();
 
@@ -124,6 +127,13 @@ void _stng_init_s(void)
 
 void _stng_idle_s(void)
 {
+	if (is_status(NEED_SAVE_COUNTERS) && !is_status(NEED_SAVE_SETTINGS)) {
+		if (CounterDB::save() == SETTINGS_OK) {
+			reset_status(NEED_SAVE_COUNTERS);
+		}
+	}
+	CounterDB::update();
+
 	if (is_status(NEED_SAVE_SETTINGS)) {
 #if WATCHDOG_BEDUG
 		printTagLog(STNGw_TAG, "state_idle: event_updated");
@@ -143,8 +153,12 @@ void _stng_idle_s(void)
 
 void _stng_save_s(void)
 {
-	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size());
+	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
 	SettingsStatus status = settingsDB.save();
+	if (status == SETTINGS_OK) {
+		// The counters are changed by the configuration commands too
+		status = CounterDB::flush();
+	}
 	if (status == SETTINGS_OK) {
 #if WATCHDOG_BEDUG
 		printTagLog(STNGw_TAG, "state_save: event_saved");
@@ -157,15 +171,17 @@ void _stng_save_s(void)
 		reset_error(SETTINGS_LOAD_ERROR);
 
 		reset_status(NEED_SAVE_SETTINGS);
+		reset_status(NEED_SAVE_COUNTERS);
 		reset_status(LOADING);
 	}
 }
 
 void _stng_load_s(void)
 {
-	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size());
+	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
 	SettingsStatus status = settingsDB.load();
 	if (status == SETTINGS_OK) {
+		CounterDB::load();
 #if WATCHDOG_BEDUG
 		printTagLog(STNGw_TAG, "state_load: event_loaded");
 #endif
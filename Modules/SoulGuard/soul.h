@@ -41,6 +41,7 @@ typedef enum _SOUK_STATUS {
 	NO_BIGSKI,
 
 	HAS_NEW_RECORD,
+	NEED_SAVE_COUNTERS,
 
 	/* Device statuses end */
 	STATUSES_END,
@@ -2,9 +2,12 @@
 
 #include "StorageDriver.h"
 
+#include <string.h>
+
 #include "glog.h"
 #include "soul.h"
 #include "bmacro.h"
+#include "gutils.h"
 #include "at24cm01.h"
 
 #include "StorageType.h"
@@ -16,11 +19,27 @@
 bool StorageDriver::hasError = false;
 utl::Timer StorageDriver::timer(ERROR_TIMEOUT_MS);
 
+uint32_t StorageDriver::readBytes  = 0;
+uint32_t StorageDriver::writeBytes = 0;
+uint32_t StorageDriver::writeRequestBytes = 0;
+uint32_t StorageDriver::writeSkipped      = 0;
+
+uint32_t StorageDriver::cacheHits      = 0;
+uint32_t StorageDriver::cacheMisses    = 0;
+uint32_t StorageDriver::cacheEvictions = 0;
+
+StorageDriver::AsyncRequest StorageDriver::asyncRequests[EEPROM_ASYNC_QUEUE_SIZE] = {};
+
 #if STORAGE_DRIVER_USE_BUFFER
 
-bool StorageDriver::hasBuffer = false;
-uint8_t StorageDriver::bufferPage[STORAGE_PAGE_SIZE] = {};
-uint32_t StorageDriver::lastAddress = 0;
+StorageDriver::CachePage StorageDriver::cache[STORAGE_DRIVER_CACHE_SIZE] = {};
+uint32_t StorageDriver::cacheUse = 0;
+
+#endif
+
+#if STORAGE_DRIVER_DIFF_WRITE
+
+uint8_t StorageDriver::diffPage[EEPROM_PAGE_SIZE] = {};
 
 #endif
 
@@ -38,18 +57,26 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (hasBuffer && lastAddress == address && len == STORAGE_PAGE_SIZE) {
-		memcpy(data, bufferPage, len);
+	CachePage* page = cacheFind(address, len);
+	if (page) {
+		memcpy(data, page->data + (address - page->address), len);
+		// The header reads of the storage scans touch every page: only the full page reads keep it
+		if (len == STORAGE_PAGE_SIZE) {
+			page->lastUse = ++cacheUse;
+		}
+		cacheHits++;
 
 #	if STORAGE_DRIVER_BEDUG
 		printTagLog(TAG, "Copy %lu address start", address);
 #	endif
 
 	} else {
+		cacheMisses++;
 
 #endif
 
 		status = eeprom_read(address, data, len);
+		readBytes += len;
 #if STORAGE_DRIVER_BEDUG
 		printTagLog(TAG, "Read %lu address start", address);
 #endif
@@ -83,10 +110,8 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-    if (lastAddress != address && len == STORAGE_PAGE_SIZE) {
-    	memcpy(bufferPage, data, STORAGE_PAGE_SIZE);
-    	lastAddress = address;
-    	hasBuffer = true;
+    if (!page && len == STORAGE_PAGE_SIZE && !(address % STORAGE_PAGE_SIZE)) {
+    	cachePut(address, data);
     }
 
 #endif
@@ -99,7 +124,6 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 	reset_status(MEMORY_READ_FAULT);
     return STORAGE_OK;
 }
-;
 
 StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data, const uint32_t len) {
 	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
@@ -115,12 +139,27 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
 	printTagLog(TAG, "Write %lu address start", address);
 #endif
 
-	eeprom_status_t status = eeprom_write(address, data, len);
+	writeRequestBytes += len;
+
+	eeprom_status_t status = EEPROM_OK;
+#if STORAGE_DRIVER_DIFF_WRITE
+	uint32_t offset = 0;
+	while (status == EEPROM_OK && offset < len) {
+		uint32_t pageLen = __min(len - offset, EEPROM_PAGE_SIZE - (address + offset) % EEPROM_PAGE_SIZE);
+		status = writeDiff(address + offset, data + offset, pageLen);
+		offset += pageLen;
+	}
+#else
+	status = eeprom_write(address, data, len);
+	writeBytes += len;
+#endif
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (lastAddress == address) {
-		hasBuffer = false;
+	if (status == EEPROM_OK) {
+		cacheUpdate(address, data, len);
+	} else {
+		cacheInvalidate(address, len);
 	}
 
 #endif
@@ -156,7 +195,327 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
     return STORAGE_OK;
 }
 
+StorageStatus StorageDriver::readAsync(const uint32_t address, uint8_t *data, const uint32_t len, StorageCallback callback)
+{
+	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
+		return STORAGE_ERROR;
+	}
+
+#if STORAGE_DRIVER_USE_BUFFER
+	CachePage* page = cacheFind(address, len);
+	if (page) {
+		memcpy(data, page->data + (address - page->address), len);
+		if (len == STORAGE_PAGE_SIZE) {
+			page->lastUse = ++cacheUse;
+		}
+		cacheHits++;
+		if (callback) {
+			callback(STORAGE_OK);
+		}
+		return STORAGE_OK;
+	}
+	cacheMisses++;
+#endif
+
+	AsyncRequest* request = asyncRequest();
+	if (!request) {
+		return STORAGE_BUSY;
+	}
+
+	eeprom_status_t status = eeprom_read_async(address, data, len, asyncDone, request);
+	if (status != EEPROM_OK) {
+		return checkStatus(status, MEMORY_READ_FAULT);
+	}
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Read %lu address queued", address);
+#endif
+
+	*request  = { true, false, address, data, len, callback };
+	readBytes += len;
+	return STORAGE_OK;
+}
+
+StorageStatus StorageDriver::writeAsync(const uint32_t address, const uint8_t *data, const uint32_t len, StorageCallback callback)
+{
+	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
+		return STORAGE_ERROR;
+	}
+
+	AsyncRequest* request = asyncRequest();
+	if (!request) {
+		return STORAGE_BUSY;
+	}
+
+	writeRequestBytes += len;
+
+	uint32_t first = 0;
+	uint32_t last  = len;
+#if STORAGE_DRIVER_DIFF_WRITE && STORAGE_DRIVER_USE_BUFFER
+	// Only the cached page is compared: a read back would block
+	CachePage* page = cacheFind(address, len);
+	if (page) {
+		const uint8_t* current = page->data + (address - page->address);
+		while (first < len && current[first] == data[first]) {
+			first++;
+		}
+		while (last > first && current[last - 1] == data[last - 1]) {
+			last--;
+		}
+	}
+	if (first == last) {
+		writeSkipped++;
+		if (callback) {
+			callback(STORAGE_OK);
+		}
+		return STORAGE_OK;
+	}
+#endif
+
+	eeprom_status_t status = eeprom_write_async(address + first, data + first, last - first, asyncDone, request);
+	if (status != EEPROM_OK) {
+		return checkStatus(status, MEMORY_WRITE_FAULT);
+	}
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Write %lu address queued (%lu bytes)", address + first, last - first);
+#endif
+
+	*request    = { true, true, address, const_cast<uint8_t*>(data), len, callback };
+	writeBytes += last - first;
+#if STORAGE_DRIVER_USE_BUFFER
+	// The queued requests are executed in order: the next reads get the new data
+	cacheUpdate(address, data, len);
+#endif
+	return STORAGE_OK;
+}
+
+void StorageDriver::tick()
+{
+	eeprom_async_tick();
+}
+
+bool StorageDriver::isBusy()
+{
+	return eeprom_async_busy();
+}
+
+void StorageDriver::wait()
+{
+	eeprom_async_wait();
+}
+
+StorageDriver::AsyncRequest* StorageDriver::asyncRequest()
+{
+	for (unsigned i = 0; i < __arr_len(asyncRequests); i++) {
+		if (!asyncRequests[i].used) {
+			return &asyncRequests[i];
+		}
+	}
+	return nullptr;
+}
+
+void StorageDriver::asyncDone(eeprom_status_t status, void* ctx)
+{
+	AsyncRequest request = *reinterpret_cast<AsyncRequest*>(ctx);
+	reinterpret_cast<AsyncRequest*>(ctx)->used = false;
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "%s %lu address finished: error=%u", request.write ? "Write" : "Read", request.address, status);
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER
+	if (request.write && status != EEPROM_OK) {
+		cacheInvalidate(request.address, request.len);
+	}
+	if (!request.write && status == EEPROM_OK && request.len == STORAGE_PAGE_SIZE && !(request.address % STORAGE_PAGE_SIZE)) {
+		cachePut(request.address, request.data);
+	}
+#endif
+
+	StorageStatus result = checkStatus(status, request.write ? MEMORY_WRITE_FAULT : MEMORY_READ_FAULT);
+	if (request.callback) {
+		request.callback(result);
+	}
+}
+
+StorageStatus StorageDriver::checkStatus(const eeprom_status_t status, const SOUL_STATUS fault)
+{
+	if (hasError && !timer.wait()) {
+		set_status(fault);
+	}
+	if (!hasError && status != EEPROM_OK) {
+		hasError = true;
+		timer.start();
+	}
+	if (status == EEPROM_ERROR_BUSY) {
+		return STORAGE_BUSY;
+	}
+	if (status == EEPROM_ERROR_OOM) {
+		return STORAGE_OOM;
+	}
+	if (status != EEPROM_OK) {
+		return STORAGE_ERROR;
+	}
+
+	hasError = false;
+	reset_status(fault);
+	return STORAGE_OK;
+}
+
 StorageStatus StorageDriver::erase(const uint32_t*, const uint32_t)
 {
 	return STORAGE_OK;
 }
+
+void StorageDriver::showCache()
+{
+	uint32_t requests = cacheHits + cacheMisses;
+	const eeprom_stats_t* stats = eeprom_get_stats();
+	gprint(
+		"\n###################PAGE CACHE#####################\n"
+		"Pages:            %u (%u bytes)\n"
+		"Hits:             %lu (%lu%%)\n"
+		"Misses:           %lu\n"
+		"Evictions:        %lu\n"
+		"I2C read/write:   %lu / %lu bytes\n"
+		"Write requested:  %lu bytes (%lu page writes skipped)\n"
+		"I2C transfers:    %lu (%lu ready polls, %lu skipped, %lu aborted)\n"
+		"###################PAGE CACHE#####################\n",
+#if STORAGE_DRIVER_USE_BUFFER
+		STORAGE_DRIVER_CACHE_SIZE,
+		STORAGE_DRIVER_CACHE_SIZE * STORAGE_PAGE_SIZE,
+#else
+		0,
+		0,
+#endif
+		cacheHits,
+		requests ? (cacheHits * 100) / requests : 0,
+		cacheMisses,
+		cacheEvictions,
+		readBytes,
+		writeBytes,
+		writeRequestBytes,
+		writeSkipped,
+		stats->transfers,
+		stats->polls,
+		stats->polls_skipped,
+		stats->aborts
+	);
+}
+
+#if STORAGE_DRIVER_USE_BUFFER
+
+StorageDriver::CachePage* StorageDriver::cacheFind(const uint32_t address, const uint32_t len)
+{
+	uint32_t pageAddress = address - address % STORAGE_PAGE_SIZE;
+	if (!len || address + len > pageAddress + STORAGE_PAGE_SIZE) {
+		return nullptr;
+	}
+	for (unsigned i = 0; i < __arr_len(cache); i++) {
+		if (cache[i].valid && cache[i].address == pageAddress) {
+			return &cache[i];
+		}
+	}
+	return nullptr;
+}
+
+void StorageDriver::cachePut(const uint32_t address, const uint8_t *data)
+{
+	// Free or least recently used page
+	CachePage* page = &cache[0];
+	for (unsigned i = 0; i < __arr_len(cache); i++) {
+		if (!cache[i].valid) {
+			page = &cache[i];
+			break;
+		}
+		if (cache[i].lastUse < page->lastUse) {
+			page = &cache[i];
+		}
+	}
+	if (page->valid) {
+		cacheEvictions++;
+	}
+
+	memcpy(page->data, data, STORAGE_PAGE_SIZE);
+	page->address = address;
+	page->lastUse = ++cacheUse;
+	page->valid   = true;
+}
+
+void StorageDriver::cacheUpdate(const uint32_t address, const uint8_t *data, const uint32_t len)
+{
+	for (unsigned i = 0; i < __arr_len(cache); i++) {
+		if (!cache[i].valid ||
+			address >= cache[i].address + STORAGE_PAGE_SIZE ||
+			cache[i].address >= address + len
+		) {
+			continue;
+		}
+		uint32_t start = __max(address, cache[i].address);
+		uint32_t end   = __min(address + len, cache[i].address + STORAGE_PAGE_SIZE);
+		memcpy(cache[i].data + (start - cache[i].address), data + (start - address), end - start);
+	}
+}
+
+void StorageDriver::cacheInvalidate(const uint32_t address, const uint32_t len)
+{
+	for (unsigned i = 0; i < __arr_len(cache); i++) {
+		if (cache[i].valid &&
+			address < cache[i].address + STORAGE_PAGE_SIZE &&
+			cache[i].address < address + len
+		) {
+			cache[i].valid = false;
+		}
+	}
+}
+
+#endif
+
+
+#if STORAGE_DRIVER_DIFF_WRITE
+
+eeprom_status_t StorageDriver::writeDiff(const uint32_t address, const uint8_t *data, const uint32_t len)
+{
+	// The range is inside one EEPROM page
+	const uint8_t* current = nullptr;
+#if STORAGE_DRIVER_USE_BUFFER
+	CachePage* page = cacheFind(address, len);
+	if (page) {
+		current = page->data + (address - page->address);
+	}
+#endif
+	if (!current && len >= STORAGE_DRIVER_DIFF_MIN && eeprom_read(address, diffPage, len) == EEPROM_OK) {
+		readBytes += len;
+		current = diffPage;
+#if STORAGE_DRIVER_USE_BUFFER
+		if (len == STORAGE_PAGE_SIZE && !(address % STORAGE_PAGE_SIZE)) {
+			cachePut(address, diffPage);
+		}
+#endif
+	}
+
+	uint32_t first = 0;
+	uint32_t last  = len;
+	if (current) {
+		while (first < len && current[first] == data[first]) {
+			first++;
+		}
+		while (last > first && current[last - 1] == data[last - 1]) {
+			last--;
+		}
+	}
+	if (first == last) {
+		writeSkipped++;
+		return EEPROM_OK;
+	}
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Write %lu address diff %lu bytes", address + first, last - first);
+#endif
+
+	writeBytes += last - first;
+	return eeprom_write(address + first, data + first, last - first);
+}
+
+#endif
\ No newline at end of file
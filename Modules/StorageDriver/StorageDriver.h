@@ -5,7 +5,9 @@
 
 #include <stdint.h>
 
+#include "soul.h"
 #include "Timer.h"
+#include "at24cm01.h"
 #include "StorageAT.h"
 
 
@@ -14,23 +16,91 @@
 #endif
 
 #define STORAGE_DRIVER_USE_BUFFER (1)
+// LRU page cache size (pages): each page takes STORAGE_PAGE_SIZE bytes of RAM
+#ifndef STORAGE_DRIVER_CACHE_SIZE
+#   define STORAGE_DRIVER_CACHE_SIZE (4)
+#endif
+// Writes only the changed bytes of every EEPROM page (compared with the cached or read page)
+#define STORAGE_DRIVER_DIFF_WRITE (1)
+// Shorter uncached writes are not read back for the comparison: the read costs as much as the write
+#define STORAGE_DRIVER_DIFF_MIN   (EEPROM_PAGE_SIZE / 4)
 
 
 struct StorageDriver: public IStorageDriver
 {
+	// Asynchronous request completion callback, called from tick() or from the request call
+	typedef void (*StorageCallback)(StorageStatus status);
+
 private:
 	static constexpr char TAG[] = "DRVR";
 
 	static bool hasError;
 	static utl::Timer timer;
 
+	typedef struct _AsyncRequest {
+		bool            used;
+		bool            write;
+		uint32_t        address;
+		uint8_t*        data;
+		uint32_t        len;
+		StorageCallback callback;
+	} AsyncRequest;
+
+	static AsyncRequest asyncRequests[EEPROM_ASYNC_QUEUE_SIZE];
+
+	static AsyncRequest* asyncRequest();
+	static void asyncDone(eeprom_status_t status, void* ctx);
+	static StorageStatus checkStatus(const eeprom_status_t status, const SOUL_STATUS fault);
+
 #if STORAGE_DRIVER_USE_BUFFER
-    static bool     hasBuffer;
-    static uint8_t  bufferPage[STORAGE_PAGE_SIZE];
-    static uint32_t lastAddress;
+    typedef struct _CachePage {
+        uint32_t address;
+        uint32_t lastUse;
+        bool     valid;
+        uint8_t  data[STORAGE_PAGE_SIZE];
+    } CachePage;
+
+    static CachePage cache[STORAGE_DRIVER_CACHE_SIZE];
+    static uint32_t  cacheUse;
+
+    static CachePage* cacheFind(const uint32_t address, const uint32_t len);
+    static void cachePut(const uint32_t address, const uint8_t *data);
+    static void cacheUpdate(const uint32_t address, const uint8_t *data, const uint32_t len);
+    static void cacheInvalidate(const uint32_t address, const uint32_t len);
+#endif
+
+#if STORAGE_DRIVER_DIFF_WRITE
+    static uint8_t diffPage[EEPROM_PAGE_SIZE];
+
+    static eeprom_status_t writeDiff(const uint32_t address, const uint8_t *data, const uint32_t len);
 #endif
 
 public:
+    // Bytes physically transferred over I2C
+    static uint32_t readBytes;
+    static uint32_t writeBytes;
+    // Bytes passed to write() and page writes skipped as unchanged
+    static uint32_t writeRequestBytes;
+    static uint32_t writeSkipped;
+
+    static uint32_t cacheHits;
+    static uint32_t cacheMisses;
+    static uint32_t cacheEvictions;
+
+    static void showCache();
+
+    /*
+     * Non-blocking variants for the state machines: the data must stay valid until the callback.
+     * The page cache is used and updated as by read() and write().
+     */
+    static StorageStatus readAsync(const uint32_t address, uint8_t *data, const uint32_t len, StorageCallback callback);
+    static StorageStatus writeAsync(const uint32_t address, const uint8_t *data, const uint32_t len, StorageCallback callback);
+    // Runs the asynchronous requests: call from the main loop
+    static void tick();
+    static bool isBusy();
+    // Blocks until the asynchronous requests are finished
+    static void wait();
+
     StorageStatus read(const uint32_t address, uint8_t *data, const uint32_t len) override;
     StorageStatus write(const uint32_t address, const uint8_t *data, const uint32_t len) override;
     StorageStatus erase(const uint32_t*, const uint32_t) override;
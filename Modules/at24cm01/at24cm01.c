@@ -10,16 +10,75 @@
 #include "glog.h"
 #include "main.h"
 #include "gutils.h"
+#include "system.h"
 
 
 #define EEPROM_TIMER_DELAY_MS ((uint16_t)1000)
 #define EEPROM_DELAY_MS       ((uint16_t)100)
 #define EEPROM_MAX_ERRORS     (5)
+// Internal write cycle time (tWR): the device NACKs its address until the cycle is finished
+#define EEPROM_WRITE_CYCLE_MS ((uint32_t)5)
+// 400 kHz bus: 9 clocks per byte (44 bytes per ms) with a margin for the transfer timeout
+#define EEPROM_BYTES_PER_MS   ((uint32_t)40)
+// Sequential reads roll over inside the 64 KB block selected by the device address bit
+#define EEPROM_BLOCK_SIZE     ((uint32_t)0x10000)
 
 
 const char EEPROM_TAG[] = "EEPR";
 
 
+typedef enum _eeprom_async_state_t {
+    EEPROM_ASYNC_IDLE = 0,
+    EEPROM_ASYNC_POLL,
+    EEPROM_ASYNC_TRANSFER
+} eeprom_async_state_t;
+
+typedef struct _eeprom_request_t {
+    bool              write;
+    uint32_t          addr;
+    uint8_t*          buf;
+    uint32_t          len;
+    uint32_t          done;     // Transferred bytes
+    eeprom_callback_t callback;
+    void*             ctx;
+} eeprom_request_t;
+
+static struct {
+    eeprom_request_t     queue[EEPROM_ASYNC_QUEUE_SIZE];
+    uint8_t              head;
+    uint8_t              count;
+    eeprom_async_state_t state;
+    uint32_t             chunk;       // Current transfer length
+    volatile bool        irq_done;
+    volatile bool        irq_error;
+    util_old_timer_t     poll_timer;  // Next ready poll
+    util_old_timer_t     wait_timer;  // Transfer timeout
+} eeprom_async = { 0 };
+
+
+// The last write cycle may be still in progress
+static bool     eeprom_write_pending = false;
+static uint32_t eeprom_write_tick    = 0;
+
+static eeprom_stats_t eeprom_stats = { 0 };
+
+
+static eeprom_status_t _eeprom_wait_ready(const uint8_t dev_addr);
+static bool _eeprom_write_cycle_expired();
+static void _eeprom_write_cycle_start();
+static eeprom_status_t _eeprom_async_push(
+    const bool write,
+    const uint32_t addr,
+    uint8_t* buf,
+    const uint32_t len,
+    eeprom_callback_t callback,
+    void* ctx
+);
+static void _eeprom_async_start(eeprom_request_t* request);
+static void _eeprom_async_finish(const eeprom_status_t status);
+static void _eeprom_async_abort();
+
+
 eeprom_status_t eeprom_read(const uint32_t addr, uint8_t* buf, const uint32_t len)
 {
 #if EEPROM_DEBUG
@@ -33,42 +92,45 @@ eeprom_status_t eeprom_read(const uint32_t addr, uint8_t* buf, const uint32_t le
         return EEPROM_ERROR_OOM;
     }
 
-    uint8_t dev_addr = EEPROM_I2C_ADDR | (((addr >> 16) & 0x01) << 1);
-#if EEPROM_DEBUG
-    printTagLog(EEPROM_TAG, "eeprom read: device i2c address - 0x%02x", dev_addr);
-#endif
+    // The bus is shared with the asynchronous requests
+    if (eeprom_async_wait() != EEPROM_OK) {
+        return EEPROM_ERROR_BUSY;
+    }
 
-    HAL_StatusTypeDef status = HAL_BUSY;
-    util_old_timer_t timer = { 0 };
-    util_old_timer_start(&timer, EEPROM_TIMER_DELAY_MS);
-    while (util_old_timer_wait(&timer)) {
-        status = HAL_I2C_IsDeviceReady(&EEPROM_I2C, dev_addr, 1, EEPROM_DELAY_MS);
+    // One transaction per 64 KB block: the page boundaries are crossed by the sequential read
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t cur_addr = addr + done;
+        uint32_t chunk = __min(len - done, EEPROM_BLOCK_SIZE - (cur_addr % EEPROM_BLOCK_SIZE));
+        chunk = __min(chunk, (uint32_t)UINT16_MAX);
 
-        if (status == HAL_OK) {
-            break;
-        }
-    }
-    if (status != HAL_OK) {
+        uint8_t dev_addr = EEPROM_I2C_ADDR | (((cur_addr >> 16) & 0x01) << 1);
 #if EEPROM_DEBUG
-        printTagLog(EEPROM_TAG, "eeprom wait ready: i2c error=0x%02x", status);
+        printTagLog(EEPROM_TAG, "eeprom read: device i2c address - 0x%02x", dev_addr);
 #endif
-        return EEPROM_ERROR_BUSY;
-    }
 
-    status = HAL_I2C_Mem_Read(
-		&EEPROM_I2C,
-		dev_addr,
-		(uint16_t)(addr & 0xFFFF),
-		I2C_MEMADD_SIZE_16BIT,
-		buf,
-		(uint16_t)len,
-		EEPROM_DELAY_MS
-	);
-    if (status != HAL_OK) {
+        if (_eeprom_wait_ready(dev_addr) != EEPROM_OK) {
+            return EEPROM_ERROR_BUSY;
+        }
+
+        eeprom_stats.transfers++;
+        HAL_StatusTypeDef status = HAL_I2C_Mem_Read(
+            &EEPROM_I2C,
+            dev_addr,
+            (uint16_t)(cur_addr & 0xFFFF),
+            I2C_MEMADD_SIZE_16BIT,
+            buf + done,
+            (uint16_t)chunk,
+            EEPROM_DELAY_MS + chunk / EEPROM_BYTES_PER_MS
+        );
+        if (status != HAL_OK) {
 #if EEPROM_DEBUG
-        printTagLog(EEPROM_TAG, "eeprom read: i2c error=0x%02x", status);
+            printTagLog(EEPROM_TAG, "eeprom read: i2c error=0x%02x", status);
 #endif
-        return EEPROM_ERROR;
+            return EEPROM_ERROR;
+        }
+
+        done += chunk;
     }
 
 #if EEPROM_DEBUG
@@ -84,58 +146,327 @@ eeprom_status_t eeprom_write(const uint32_t addr, const uint8_t* buf, const uint
     printTagLog(EEPROM_TAG, "eeprom write: begin (addr=%lu, length=%lu)", addr, len);
 #endif
 
-    if (addr + len > EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE) {
+    if (len > UINT16_MAX || addr + len > EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE) {
 #if EEPROM_DEBUG
         printTagLog(EEPROM_TAG, "eeprom write: error - out of max address or length");
 #endif
         return EEPROM_ERROR_OOM;
     }
 
-    uint8_t dev_addr = EEPROM_I2C_ADDR | (uint8_t)(((addr >> 16) & 0x01) << 1) | (uint8_t)1;
+    if (eeprom_async_wait() != EEPROM_OK) {
+        return EEPROM_ERROR_BUSY;
+    }
+
+    // One transaction per page: the page write rolls over inside the page
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t cur_addr = addr + done;
+        uint32_t chunk = __min(len - done, EEPROM_PAGE_SIZE - (cur_addr % EEPROM_PAGE_SIZE));
+
+        uint8_t dev_addr = EEPROM_I2C_ADDR | (uint8_t)(((cur_addr >> 16) & 0x01) << 1) | (uint8_t)1;
+#if EEPROM_DEBUG
+        printTagLog(EEPROM_TAG, "eeprom write: device i2c address - 0x%02x", dev_addr);
+#endif
+
+        if (_eeprom_wait_ready(dev_addr) != EEPROM_OK) {
+            return EEPROM_ERROR_BUSY;
+        }
+
+        eeprom_stats.transfers++;
+        HAL_StatusTypeDef status = HAL_I2C_Mem_Write(
+            &EEPROM_I2C,
+            dev_addr,
+            (uint16_t)(cur_addr & 0xFFFF),
+            I2C_MEMADD_SIZE_16BIT,
+            (uint8_t*)buf + done,
+            (uint16_t)chunk,
+            EEPROM_DELAY_MS + chunk / EEPROM_BYTES_PER_MS
+        );
+        // The write cycle starts after the stop condition even if the transfer has failed
+        _eeprom_write_cycle_start();
+        if (status != HAL_OK) {
+#if EEPROM_DEBUG
+            printTagLog(EEPROM_TAG, "eeprom write: i2c error=0x%02x", status);
+#endif
+            return EEPROM_ERROR;
+        }
+
+        done += chunk;
+    }
+
 #if EEPROM_DEBUG
-    printTagLog(EEPROM_TAG, "eeprom write: device i2c address - 0x%02x", dev_addr);
+    printTagLog(EEPROM_TAG, "eeprom write: OK");
 #endif
 
+    return EEPROM_OK;
+}
+
+uint32_t eeprom_get_size()
+{
+    return EEPROM_PAGE_SIZE * EEPROM_PAGES_COUNT;
+}
+
+const eeprom_stats_t* eeprom_get_stats()
+{
+    return &eeprom_stats;
+}
+
+eeprom_status_t eeprom_read_async(const uint32_t addr, uint8_t* buf, const uint32_t len, eeprom_callback_t callback, void* ctx)
+{
+    return _eeprom_async_push(false, addr, buf, len, callback, ctx);
+}
+
+eeprom_status_t eeprom_write_async(const uint32_t addr, const uint8_t* buf, const uint32_t len, eeprom_callback_t callback, void* ctx)
+{
+    return _eeprom_async_push(true, addr, (uint8_t*)buf, len, callback, ctx);
+}
+
+void eeprom_async_tick()
+{
+    if (!eeprom_async.count) {
+        return;
+    }
+
+    eeprom_request_t* request = &eeprom_async.queue[eeprom_async.head];
+    uint8_t dev_addr = EEPROM_I2C_ADDR | (uint8_t)((((request->addr + request->done) >> 16) & 0x01) << 1);
+
+    switch (eeprom_async.state) {
+    case EEPROM_ASYNC_IDLE:
+        memset(&eeprom_async.poll_timer, 0, sizeof(eeprom_async.poll_timer));
+        eeprom_async.state = EEPROM_ASYNC_POLL;
+        // fall through
+    case EEPROM_ASYNC_POLL:
+        if (!eeprom_write_pending) {
+            eeprom_stats.polls_skipped++;
+            _eeprom_async_start(request);
+            return;
+        }
+        if (util_old_timer_wait(&eeprom_async.poll_timer)) {
+            return;
+        }
+        // One address byte per poll: the device NACKs it during the internal write cycle
+        eeprom_stats.polls++;
+        if (HAL_I2C_IsDeviceReady(&EEPROM_I2C, dev_addr, 1, EEPROM_ASYNC_POLL_MS) != HAL_OK) {
+            if (_eeprom_write_cycle_expired()) {
+#if EEPROM_DEBUG
+                printTagLog(EEPROM_TAG, "eeprom async: wait ready timeout (addr=%lu)", request->addr);
+#endif
+                _eeprom_async_finish(EEPROM_ERROR_BUSY);
+            } else {
+                util_old_timer_start(&eeprom_async.poll_timer, EEPROM_ASYNC_POLL_MS);
+            }
+            return;
+        }
+        eeprom_write_pending = false;
+        _eeprom_async_start(request);
+        return;
+    case EEPROM_ASYNC_TRANSFER:
+        if (!eeprom_async.irq_error && !eeprom_async.irq_done && util_old_timer_wait(&eeprom_async.wait_timer)) {
+            return;
+        }
+        if (request->write) {
+            // The write cycle starts after the stop condition even if the transfer has failed
+            _eeprom_write_cycle_start();
+        }
+        if (eeprom_async.irq_error) {
+#if EEPROM_DEBUG
+            printTagLog(EEPROM_TAG, "eeprom async: i2c error=0x%08lx", HAL_I2C_GetError(&EEPROM_I2C));
+#endif
+            _eeprom_async_finish(EEPROM_ERROR);
+        } else if (eeprom_async.irq_done) {
+            request->done += eeprom_async.chunk;
+            if (request->done < request->len) {
+                eeprom_async.state = EEPROM_ASYNC_IDLE;
+            } else {
+                _eeprom_async_finish(EEPROM_OK);
+            }
+        } else {
+#if EEPROM_DEBUG
+            printTagLog(EEPROM_TAG, "eeprom async: transfer timeout (addr=%lu)", request->addr);
+#endif
+            _eeprom_async_abort();
+            _eeprom_async_finish(EEPROM_ERROR);
+        }
+        return;
+    default:
+        _eeprom_async_finish(EEPROM_ERROR);
+        return;
+    }
+}
+
+bool eeprom_async_busy()
+{
+    return eeprom_async.count > 0;
+}
+
+eeprom_status_t eeprom_async_wait()
+{
+    // Every request is limited by its ready polling and transfer timeouts
+    while (eeprom_async_busy()) {
+        eeprom_async_tick();
+    }
+    return HAL_I2C_GetState(&EEPROM_I2C) == HAL_I2C_STATE_READY ? EEPROM_OK : EEPROM_ERROR_BUSY;
+}
+
+eeprom_status_t _eeprom_wait_ready(const uint8_t dev_addr)
+{
+    if (!eeprom_write_pending) {
+        // Only a write cycle makes the device busy
+        eeprom_stats.polls_skipped++;
+        return EEPROM_OK;
+    }
+
     HAL_StatusTypeDef status = HAL_BUSY;
     util_old_timer_t timer = { 0 };
     util_old_timer_start(&timer, EEPROM_TIMER_DELAY_MS);
-    while (util_old_timer_wait(&timer)) {
+    do {
+        eeprom_stats.polls++;
         status = HAL_I2C_IsDeviceReady(&EEPROM_I2C, dev_addr, 1, EEPROM_DELAY_MS);
         if (status == HAL_OK) {
-            break;
+            eeprom_write_pending = false;
+            return EEPROM_OK;
         }
-    }
-    if (status != HAL_OK) {
+    } while (!_eeprom_write_cycle_expired() && util_old_timer_wait(&timer));
+
 #if EEPROM_DEBUG
-        printTagLog(EEPROM_TAG, "eeprom wait ready: i2c error=0x%02x", status);
+    printTagLog(EEPROM_TAG, "eeprom wait ready: i2c error=0x%02x", status);
 #endif
+    return EEPROM_ERROR_BUSY;
+}
+
+bool _eeprom_write_cycle_expired()
+{
+    // HAL_GetTick() steps by 1 ms: the cycle is over after tWR + 1 ticks
+    return HAL_GetTick() - eeprom_write_tick > EEPROM_WRITE_CYCLE_MS;
+}
+
+void _eeprom_write_cycle_start()
+{
+    eeprom_write_pending = true;
+    eeprom_write_tick    = HAL_GetTick();
+}
+
+eeprom_status_t _eeprom_async_push(
+    const bool write,
+    const uint32_t addr,
+    uint8_t* buf,
+    const uint32_t len,
+    eeprom_callback_t callback,
+    void* ctx
+) {
+    if (!len || len > UINT16_MAX || addr + len > EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE) {
+        return EEPROM_ERROR_OOM;
+    }
+    if (eeprom_async.count >= __arr_len(eeprom_async.queue)) {
         return EEPROM_ERROR_BUSY;
     }
 
-    status = HAL_I2C_Mem_Write(
-		&EEPROM_I2C,
-		dev_addr,
-		(uint16_t)(addr & 0xFFFF),
-		I2C_MEMADD_SIZE_16BIT,
-		(uint8_t*)buf,
-		(uint16_t)len,
-		EEPROM_DELAY_MS
-	);
+    eeprom_request_t* request = &eeprom_async.queue[(eeprom_async.head + eeprom_async.count) % __arr_len(eeprom_async.queue)];
+    request->write    = write;
+    request->addr     = addr;
+    request->buf      = buf;
+    request->len      = len;
+    request->done     = 0;
+    request->callback = callback;
+    request->ctx      = ctx;
+    eeprom_async.count++;
+
+#if EEPROM_DEBUG
+    printTagLog(EEPROM_TAG, "eeprom async: %s queued (addr=%lu, length=%lu)", write ? "write" : "read", addr, len);
+#endif
+
+    return EEPROM_OK;
+}
+
+void _eeprom_async_start(eeprom_request_t* request)
+{
+    uint32_t addr = request->addr + request->done;
+    uint8_t dev_addr = EEPROM_I2C_ADDR | (uint8_t)(((addr >> 16) & 0x01) << 1);
+
+    // A write is limited by the page, a read by the 64 KB device address block
+    uint32_t limit = request->write ?
+        EEPROM_PAGE_SIZE - addr % EEPROM_PAGE_SIZE :
+        __min(EEPROM_BLOCK_SIZE - (addr % EEPROM_BLOCK_SIZE), (uint32_t)UINT16_MAX);
+    eeprom_async.chunk     = __min(request->len - request->done, limit);
+    eeprom_async.irq_done  = false;
+    eeprom_async.irq_error = false;
+    eeprom_async.state     = EEPROM_ASYNC_TRANSFER;
+    util_old_timer_start(&eeprom_async.wait_timer, EEPROM_TIMER_DELAY_MS + eeprom_async.chunk / EEPROM_BYTES_PER_MS);
+    eeprom_stats.transfers++;
+
+    HAL_StatusTypeDef status = HAL_OK;
+    if (request->write) {
+        status = HAL_I2C_Mem_Write_IT(
+            &EEPROM_I2C,
+            dev_addr,
+            (uint16_t)(addr & 0xFFFF),
+            I2C_MEMADD_SIZE_16BIT,
+            request->buf + request->done,
+            (uint16_t)eeprom_async.chunk
+        );
+    } else {
+        status = HAL_I2C_Mem_Read_IT(
+            &EEPROM_I2C,
+            dev_addr,
+            (uint16_t)(addr & 0xFFFF),
+            I2C_MEMADD_SIZE_16BIT,
+            request->buf + request->done,
+            (uint16_t)eeprom_async.chunk
+        );
+    }
     if (status != HAL_OK) {
 #if EEPROM_DEBUG
-        printTagLog(EEPROM_TAG, "eeprom write: i2c error=0x%02x", status);
+        printTagLog(EEPROM_TAG, "eeprom async: start i2c error=0x%02x", status);
 #endif
-        return EEPROM_ERROR;
+        _eeprom_async_finish(status == HAL_BUSY ? EEPROM_ERROR_BUSY : EEPROM_ERROR);
     }
+}
+
+void _eeprom_async_finish(const eeprom_status_t status)
+{
+    // The request is removed before the callback: the callback may queue the next one
+    eeprom_request_t request = eeprom_async.queue[eeprom_async.head];
+    eeprom_async.head  = (uint8_t)((eeprom_async.head + 1) % __arr_len(eeprom_async.queue));
+    eeprom_async.count--;
+    eeprom_async.state = EEPROM_ASYNC_IDLE;
 
 #if EEPROM_DEBUG
-    printTagLog(EEPROM_TAG, "eeprom write: OK");
+    printTagLog(EEPROM_TAG, "eeprom async: %s finished (addr=%lu, status=%u)", request.write ? "write" : "read", request.addr, status);
 #endif
 
-    return EEPROM_OK;
+    if (request.callback) {
+        request.callback(status, request.ctx);
+    }
 }
 
-uint32_t eeprom_get_size()
+void _eeprom_async_abort()
 {
-    return EEPROM_PAGE_SIZE * EEPROM_PAGES_COUNT;
+    // The request is finished while the IT transfer still runs: the callbacks of
+    // the transfer are ignored, the interrupts are stopped before the buffer is released
+    eeprom_async.state = EEPROM_ASYNC_IDLE;
+    __HAL_I2C_DISABLE_IT(&EEPROM_I2C, I2C_IT_EVT | I2C_IT_BUF | I2C_IT_ERR);
+    // HAL_I2C_Master_Abort_IT() does not stop the memory transfers: the I2C is reset
+    system_reset_i2c_errata();
+    eeprom_stats.aborts++;
+}
+
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c == &EEPROM_I2C && eeprom_async.state == EEPROM_ASYNC_TRANSFER) {
+        eeprom_async.irq_done = true;
+    }
+}
+
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c == &EEPROM_I2C && eeprom_async.state == EEPROM_ASYNC_TRANSFER) {
+        eeprom_async.irq_done = true;
+    }
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c == &EEPROM_I2C && eeprom_async.state == EEPROM_ASYNC_TRANSFER) {
+        eeprom_async.irq_error = true;
+    }
 }
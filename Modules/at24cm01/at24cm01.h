@@ -20,6 +20,11 @@ extern "C" {
 #   define EEPROM_DEBUG    (0)
 #endif
 
+// Pending asynchronous requests (reads and writes)
+#define EEPROM_ASYNC_QUEUE_SIZE (4)
+// Ready (ACK) polling period of the asynchronous engine
+#define EEPROM_ASYNC_POLL_MS    (1)
+
 
 typedef enum _eeprom_status_t {
     EEPROM_OK = 0x00,
@@ -29,9 +34,39 @@ typedef enum _eeprom_status_t {
 } eeprom_status_t;
 
 
+typedef struct _eeprom_stats_t {
+    uint32_t transfers;     // Read and write transactions
+    uint32_t polls;         // Ready (ACK) polls
+    uint32_t polls_skipped; // Transfers started without polling: no write cycle in progress
+    uint32_t aborts;        // Asynchronous transfers stopped by the timeout (the I2C is reset)
+} eeprom_stats_t;
+
+
+/*
+ * Asynchronous request completion callback, called from eeprom_async_tick()
+ * (never from the interrupt)
+ */
+typedef void (*eeprom_callback_t)(eeprom_status_t status, void* ctx);
+
+
+// Reads any range sequentially: one I2C transaction per 64 KB block
 eeprom_status_t eeprom_read(const uint32_t addr, uint8_t* buf, const uint32_t len);
+// Writes up to UINT16_MAX bytes: one I2C transaction per EEPROM page
 eeprom_status_t eeprom_write(const uint32_t addr, const uint8_t* buf, const uint32_t len);
 uint32_t        eeprom_get_size();
+const eeprom_stats_t* eeprom_get_stats();
+
+/*
+ * Asynchronous interrupt driven requests: the buffer must stay valid until the callback.
+ * Requests are executed in the queue order, a write is split by EEPROM pages.
+ */
+eeprom_status_t eeprom_read_async(const uint32_t addr, uint8_t* buf, const uint32_t len, eeprom_callback_t callback, void* ctx);
+eeprom_status_t eeprom_write_async(const uint32_t addr, const uint8_t* buf, const uint32_t len, eeprom_callback_t callback, void* ctx);
+// Polls the device, starts the next transfer and calls the callbacks of finished requests
+void            eeprom_async_tick();
+bool            eeprom_async_busy();
+// Blocks until all the queued requests are finished
+eeprom_status_t eeprom_async_wait();
 
 
 #ifdef __cplusplus
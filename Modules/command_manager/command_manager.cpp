@@ -16,12 +16,19 @@
 #include "main.h"
 #include "pump.h"
 #include "clock.h"
+#include "system.h"
 #include "hal_defs.h"
+#include "sim_uart.h"
+#include "uart_tx.h"
 #include "liquid_sensor.h"
 
+#include "RecordDB.h"
+#include "RollupDB.h"
 #include "StorageAT.h"
+#include "CounterDB.h"
 #include "SettingsDB.h"
 #include "LogService.h"
+#include "StorageDriver.h"
 
 
 bool _validate_command();
@@ -90,6 +97,38 @@ void _execute_command()
 		return;
 	}
 
+	if (strncmp("storage", command, CHAR_COMMAND_SIZE) == 0) {
+		RecordDB::showStorage();
+		StorageDriver::showCache();
+		_clear_command();
+		return;
+	}
+
+	if (strncmp("upload", command, CHAR_COMMAND_SIZE) == 0) {
+		LogService::showUpload();
+		_clear_command();
+		return;
+	}
+
+	if (strncmp("loop", command, CHAR_COMMAND_SIZE) == 0) {
+		system_show_loop();
+		_clear_command();
+		return;
+	}
+
+	if (strncmp("crc", command, CHAR_COMMAND_SIZE) == 0) {
+		system_show_crc();
+		_clear_command();
+		return;
+	}
+
+	if (strncmp("modem", command, CHAR_COMMAND_SIZE) == 0) {
+		sim_uart_show();
+		uart_tx_show();
+		_clear_command();
+		return;
+	}
+
 	if (strncmp("saveadcmin", command, CHAR_COMMAND_SIZE) == 0) {
 		settings.tank_ADC_min = get_level_adc();
 		isSuccess = true;
@@ -97,7 +136,10 @@ void _execute_command()
 		settings.tank_ADC_max = get_level_adc();
 		isSuccess = true;
 	}  else if (strncmp("default", command, CHAR_COMMAND_SIZE) == 0) {
+		// The log generation stays: the cleared records are not restored
+		uint32_t logFirstId = settings.log_first_id;
 		settings_reset(&settings);
+		settings.log_first_id = logFirstId;
 		isSuccess = true;
 	} else if (strncmp("clearlog", command, CHAR_COMMAND_SIZE) == 0) {
 		LogService::clear();
@@ -106,12 +148,19 @@ void _execute_command()
 		pump_clear_log();
 		isSuccess = true;
 	} else if (strncmp("reset", command, CHAR_COMMAND_SIZE) == 0) {
-		// TODO: очистка EEPROM
-		isSuccess = false;
+		LogService::clear();
+		isSuccess = true;
 	}
 #ifdef DEBUG
 	else if (strncmp("format", command, CHAR_COMMAND_SIZE) == 0) {
+		RecordDB::flush();
 		storage.format();
+		SettingsDB::invalidate();
+		CounterDB::invalidate();
+#if RECORD_DB_ROLLUP
+		RollupDB::invalidate();
+#endif
+		RecordDB::format();
 		isSuccess = true;
 	}
 #endif
@@ -14,7 +14,7 @@
 #include "hal_defs.h"
 
 
-static const char SETTINGS_TAG[] = "STNG";
+const char SETTINGS_TAG[] = "STNG";
 
 const char defaultUrl[CHAR_SETIINGS_SIZE]  = "urv.iot.turtton.ru";
 
@@ -36,6 +36,11 @@ uint32_t settings_size()
 	return sizeof(settings_t);
 }
 
+uint32_t settings_prev_size()
+{
+	return sizeof(settings_v4_t);
+}
+
 bool settings_check(settings_t* other)
 {
 	if (other->bedacode != BEDACODE) {
@@ -98,6 +103,12 @@ void settings_repair(settings_t* other)
 		other->tank_ltr_max /= MILLILITERS_IN_LITER;
 	}
 
+	if (other->sw_id == 4) {
+		other->sw_id        = 5;
+
+		other->log_first_id = 0;
+	}
+
 	if (!settings_check(other)) {
 		settings_reset(other);
 	}
@@ -132,6 +143,7 @@ void settings_reset(settings_t* other)
 	other->pump_log_date = clock_get_date();
 	other->registrated = 0;
 	other->calibrated = 0;
+	other->log_first_id = 0;
 }
 
 void settings_show()
@@ -153,6 +165,7 @@ void settings_show()
 		"Liquid level MIN: %lu l\n"
 		"Liquid level MAX: %lu l\n"
 		"Server log ID:    %lu\n"
+		"Log first ID:     %lu\n"
 		"Config ver:       %lu\n"
 		"####################SETTINGS####################\n",
 		get_clock_time_format(),
@@ -169,6 +182,7 @@ void settings_show()
 		settings.tank_ltr_min,
 		settings.tank_ltr_max,
 		settings.server_log_id,
+		settings.log_first_id,
 		settings.cf_id
 	);
 #else
@@ -35,7 +35,7 @@ extern "C" {
  * 0x0006 - Dispenser-mini
  */
 #define DEVICE_TYPE           ((uint16_t)0x0001)
-#define SW_VERSION            ((uint8_t)0x04)
+#define SW_VERSION            ((uint8_t)0x05)
 #define FW_VERSION            ((uint8_t)0x02)
 #define CF_VERSION            ((uint8_t)0x01)
 #define CHAR_SETIINGS_SIZE    (30)
@@ -92,6 +92,8 @@ typedef struct __attribute__((packed)) _settings_t  {
 	uint8_t  registrated;
 	// Is calibrated
 	uint8_t  calibrated;
+	// First record ID of the log generation: the older clusters are free space (LogService::clear())
+	uint32_t log_first_id;
 } settings_t;
 
 
@@ -140,6 +142,10 @@ typedef struct __attribute__((packed)) _settings_v3_t  {
 } settings_v3_t;
 
 
+// Version 4: the version 3 layout with the tank volumes in liters, without log_first_id
+typedef settings_v3_t settings_v4_t;
+
+
 typedef struct __attribute__((packed)) _settings_v2_t  {
 	uint32_t id;
 	char server_url[CHAR_SETIINGS_SIZE];
@@ -189,6 +195,8 @@ settings_t* settings_get();
 void settings_set(settings_t* other);
 
 uint32_t settings_size();
+/* size of the previous settings layout (version 4) */
+uint32_t settings_prev_size();
 
 bool settings_check(settings_t* other);
 void settings_repair(settings_t* other);
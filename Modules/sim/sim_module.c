@@ -19,6 +19,8 @@
 #include "fsm_gc.h"
 #include "gutils.h"
 #include "settings.h"
+#include "uart_tx.h"
+#include "sim_uart.h"
 
 #include "liquid_sensor.h"
 
@@ -29,7 +31,10 @@
 #define SIM_MAX_ERRORS   (5)
 #define SIM_DELAY_MS     (10000)
 #define SIM_HTTP_MS      (15000)
+#define SIM_HTTP_IDLE_MS (120000) // The HTTP session is kept between the uploads for this time
 #define SIM_HTTP_SIZE    (90)
+#define SIM_LINE_SIZE    (48)
+#define SIM_READ_SIZE    (256)    // AT+HTTPREAD part, the response text keeps one part
 
 
 extern settings_t settings;
@@ -53,9 +58,35 @@ typedef enum _module_type_t {
 } module_type_t;
 
 
+/*
+ * Typed modem responses: the modem output is split into lines as it arrives,
+ * the final result codes and the URCs (sim_lines[]) are turned into these
+ * events, the other lines (information responses, HTTP body) are kept as the
+ * response text. The error result code ends the wait of a state as its timeout.
+ */
+typedef enum _sim_at_event_t {
+	SIM_AT_OK          = 0x0001,
+	SIM_AT_ERROR       = 0x0002,
+	SIM_AT_DOWNLOAD    = 0x0004,
+	SIM_AT_SIM_READY   = 0x0008, // +cpin: ready
+	SIM_AT_REGISTERED  = 0x0010, // +cgreg: home or roaming network
+	SIM_AT_SIGNAL      = 0x0020, // +csq
+	SIM_AT_HTTPACTION  = 0x0040, // +httpaction: http_status, resp_len
+	SIM_AT_HEAD_LENGTH = 0x0080, // content-length: resp_len
+	SIM_AT_BODY        = 0x0100, // +httpread body part has been received
+	SIM_AT_READ_END    = 0x0200, // +httpread: 0
+} sim_at_event_t;
+
+
+typedef struct _sim_line_t {
+	const char* prefix;
+	void        (*handler)(const char* params);
+} sim_line_t;
+
+
 typedef struct _sim_command_t {
-    char request [50];
-    char response[20];
+    char     request[50];
+    uint32_t urc; // Events that must come before the final OK
 } sim_command_t;
 
 
@@ -64,11 +95,31 @@ typedef struct _sim_state_t {
 	unsigned counter;
 
 	char     url[CHAR_SETIINGS_SIZE];
+	char     session_url[CHAR_SETIINGS_SIZE]; // settings.url when the HTTP session was opened
 
 	char     request[SIM_LOG_SIZE];
-	char     response[RESPONSE_SIZE];
+	uint32_t body_len;
+	uint32_t body_sent;
+	bool     body_over;   // The reader has no more data, the body is padded
+	sim_body_reader_t body_reader;
+	sim_response_handler_t response_handler;
+
+	char     response[RESPONSE_SIZE]; // Response text without the result codes and the URCs
 	unsigned resp_cnt;
-	unsigned resp_len;
+	unsigned resp_len;                // HTTP response body length
+	unsigned read_offset;             // HTTP response body bytes passed to the handler
+	unsigned read_len;                // Body bytes of the current AT+HTTPREAD
+	unsigned read_start;              // Their position in the response text
+	unsigned resp_dropped;            // Text bytes that did not fit
+
+	char     line[SIM_LINE_SIZE];     // Current line head for the dispatch
+	unsigned line_len;
+	unsigned line_start;              // Current line position in the response text
+	uint32_t body_left;               // +httpread body bytes that are not split into lines
+
+	uint32_t events;                  // sim_at_event_t
+	unsigned http_status;
+	unsigned rssi;
 
 	unsigned errors;
 
@@ -76,52 +127,87 @@ typedef struct _sim_state_t {
 	util_old_timer_t timer;
 
 	bool     http_error;
+	bool     http_idle;               // The session is closed after the idle timeout until the next request
 } sim_state_t;
 
 
 sim_state_t sim_state = {0};
 
+uint32_t sim_at_count = 0;
+
 
 const sim_command_t start_cmds[] = {
-	{"AT",          "ok"},
-	{"ATE0",        "ok"},
-	{"AT+CGMR",     "ok"},
-	{"AT+CSQ",      "ok"},
+	{"AT",          0},
+	{"ATE0",        0},
+	{"AT+CGMR",     0},
+	{"AT+CSQ",      SIM_AT_SIGNAL},
 //#if A7670_ENABLE
-//	{"AT+CPIN?",    "+cpin: ready"},
-//	{"AT+CGREG?",   "+cgreg: 0,1"},
-//	{"AT+CPSI?",    "ok"},
-//	{"AT+CGDCONT?", "ok"}
+//	{"AT+CPIN?",    SIM_AT_SIM_READY},
+//	{"AT+CGREG?",   SIM_AT_REGISTERED},
+//	{"AT+CPSI?",    0},
+//	{"AT+CGDCONT?", 0}
 //#elif SIM868E_ENABLE
-//	{"AT+COPS?",     "ok"},
-//	{"AT+SAPBR=2,1", "ok"},
-//	{"AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", "ok"},
-//	{"AT+SAPBR=3,1,\"APN\",\"internet\"", "ok"},
-//	{"AT+SAPBR=1,1", "ok"}
+//	{"AT+COPS?",     0},
+//	{"AT+SAPBR=2,1", 0},
+//	{"AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", 0},
+//	{"AT+SAPBR=3,1,\"APN\",\"internet\"", 0},
+//	{"AT+SAPBR=1,1", 0}
 //#else
 //#   error "Please select your modem"
 //#endif
 };
 
 const sim_command_t sim868_cmds[] = {
-	{"AT+COPS?",     "ok"},
-	{"AT+SAPBR=2,1", "ok"},
-	{"AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", "ok"},
-	{"AT+SAPBR=3,1,\"APN\",\"internet\"", "ok"},
-	{"AT+SAPBR=1,1", "ok"}
+	{"AT+COPS?",     0},
+	{"AT+SAPBR=2,1", 0},
+	{"AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", 0},
+	{"AT+SAPBR=3,1,\"APN\",\"internet\"", 0},
+	{"AT+SAPBR=1,1", 0}
 };
 
 const sim_command_t a7670_cmds[] = {
-	{"AT+CPIN?",    "+cpin: ready"},
-	{"AT+CGREG?",   "+cgreg: 0,1"},
-	{"AT+CPSI?",    "ok"},
-	{"AT+CGDCONT?", "ok"}
+	{"AT+CPIN?",    SIM_AT_SIM_READY},
+	{"AT+CGREG?",   SIM_AT_REGISTERED},
+	{"AT+CPSI?",    0},
+	{"AT+CGDCONT?", 0}
+};
+
+
+void _sim_ok_h(const char* params);
+void _sim_error_h(const char* params);
+void _sim_download_h(const char* params);
+void _sim_cpin_h(const char* params);
+void _sim_cgreg_h(const char* params);
+void _sim_csq_h(const char* params);
+void _sim_httpaction_h(const char* params);
+void _sim_httpread_h(const char* params);
+void _sim_content_length_h(const char* params);
+
+// The line prefixes are lowercased
+const sim_line_t sim_lines[] = {
+	{"ok",               _sim_ok_h},
+	{"error",            _sim_error_h},
+	{"+cme error",       _sim_error_h},
+	{"download",         _sim_download_h},
+	{"+cpin: ",          _sim_cpin_h},
+	{"+cgreg: ",         _sim_cgreg_h},
+	{"+csq: ",           _sim_csq_h},
+	{"+httpaction: ",    _sim_httpaction_h},
+	{"+httpread: ",      _sim_httpread_h},
+	{"content-length: ", _sim_content_length_h},
 };
 
 
-void _sim_send_cmd(const char* cmd);
+bool _sim_send_cmd(const char* cmd);
+bool _sim_send_body();
+bool _sim_read_next();
 void _sim_clear_response();
-bool _sim_validate(const char* target);
+void _sim_append_text(char chr);
+void _sim_parse_line();
+void _sim_push_at_event(uint32_t event);
+bool _sim_take_at_event(uint32_t events);
+bool _sim_command_done(const sim_command_t* command);
+bool _sim_http_ready();
 
 void _sim_init_s(void);
 void _sim_start_s(void);
@@ -141,8 +227,8 @@ void _sim_send_post_s(void);
 void _sim_wait_post_s(void);
 void _sim_read_data_s(void);
 void _sim_wait_data_s(void);
-void _sim_wait_user_s(void);
 void _sim_close_http_s(void);
+void _sim_http_idle_s(void);
 void _sim_change_url_s(void);
 void _sim_count_error_s(void);
 void _sim_reset_s(void);
@@ -155,6 +241,7 @@ FSM_GC_CREATE_EVENT(sim_end_e ,    0)
 FSM_GC_CREATE_EVENT(sim_change_e,  0)
 FSM_GC_CREATE_EVENT(sim_a7670e_e,  0)
 FSM_GC_CREATE_EVENT(sim_868e_e,    0)
+FSM_GC_CREATE_EVENT(sim_idle_e,    0)
 FSM_GC_CREATE_EVENT(sim_success_e, 1)
 FSM_GC_CREATE_EVENT(sim_timeout_e, 2)
 FSM_GC_CREATE_EVENT(sim_error_e,   3)
@@ -177,8 +264,8 @@ FSM_GC_CREATE_STATE(sim_send_post_s,      _sim_send_post_s)
 FSM_GC_CREATE_STATE(sim_wait_post_s,      _sim_wait_post_s)
 FSM_GC_CREATE_STATE(sim_read_data_s,      _sim_read_data_s)
 FSM_GC_CREATE_STATE(sim_wait_data_s,      _sim_wait_data_s)
-FSM_GC_CREATE_STATE(sim_wait_user_s,      _sim_wait_user_s)
 FSM_GC_CREATE_STATE(sim_close_http_s,     _sim_close_http_s)
+FSM_GC_CREATE_STATE(sim_http_idle_s,      _sim_http_idle_s)
 FSM_GC_CREATE_STATE(sim_change_url_s,     _sim_change_url_s)
 FSM_GC_CREATE_STATE(sim_count_error_s,    _sim_count_error_s)
 FSM_GC_CREATE_STATE(sim_reset_s,          _sim_reset_s)
@@ -226,6 +313,7 @@ FSM_GC_CREATE_TABLE(
 
 	{&sim_send_http_s,      &sim_success_e,  &sim_send_post_s,      NULL},
 	{&sim_send_http_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+	{&sim_send_http_s,      &sim_idle_e,     &sim_close_http_s,     NULL},
 
 	{&sim_send_post_s,      &sim_success_e,  &sim_wait_post_s,      NULL},
 	{&sim_send_post_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
@@ -236,15 +324,16 @@ FSM_GC_CREATE_TABLE(
 	{&sim_read_data_s,      &sim_success_e,  &sim_wait_data_s,      NULL},
 	{&sim_read_data_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
 
-	{&sim_wait_data_s,      &sim_success_e,  &sim_wait_user_s,      NULL},
+	{&sim_wait_data_s,      &sim_success_e,  &sim_send_http_s,      NULL},
 	{&sim_wait_data_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
 
-	{&sim_wait_user_s,      &sim_success_e,  &sim_close_http_s,     NULL},
-
 	{&sim_close_http_s,     &sim_success_e,  &sim_init_http_s,      NULL},
 	{&sim_close_http_s,     &sim_change_e,   &sim_change_url_s,      NULL},
+	{&sim_close_http_s,     &sim_end_e,      &sim_http_idle_s,      NULL},
 	{&sim_close_http_s,     &sim_timeout_e,  &sim_count_error_s,    NULL},
 
+	{&sim_http_idle_s,      &sim_success_e,  &sim_init_http_s,      NULL},
+
 	{&sim_change_url_s,     &sim_success_e,  &sim_init_http_s,      NULL},
 	{&sim_change_url_s,     &sim_error_e,    &sim_error_s,          NULL},
 
@@ -263,20 +352,44 @@ void sim_begin() {
 
 void sim_proccess()
 {
+	// The modem output received since the last call
+	char input[32];
+	uint32_t len = 0;
+	while ((len = sim_uart_read(input, sizeof(input)))) {
+		for (uint32_t i = 0; i < len; i++) {
+			sim_proccess_input(input[i]);
+		}
+	}
+
 	fsm_gc_proccess(&sim_fsm);
 }
 
 void sim_proccess_input(const char input_chr)
 {
-    sim_state.response[sim_state.resp_cnt++] = (uint8_t)tolower(input_chr);
-    if (sim_state.resp_cnt >= sizeof(sim_state.response) - 1) {
-		_sim_clear_response();
-    }
+	char chr = (char)tolower(input_chr);
+
+	if (sim_state.body_left) {
+		// The body may have any bytes, it is not split into lines
+		_sim_append_text(chr);
+		sim_state.read_len++;
+		if (!--sim_state.body_left) {
+			sim_state.line_start = sim_state.resp_cnt;
+			_sim_push_at_event(SIM_AT_BODY);
+		}
+		return;
+	}
+
+	_sim_append_text(chr);
+	if (chr == '\n') {
+		_sim_parse_line();
+	} else if (chr != '\r' && sim_state.line_len < sizeof(sim_state.line) - 1) {
+		sim_state.line[sim_state.line_len++] = chr;
+	}
 }
 
-void send_sim_http_post(const char* data)
+void send_sim_http_post(const char* data, sim_response_handler_t handler)
 {
-    if (!fsm_gc_is_state(&sim_fsm, &sim_send_http_s) || sim_state.done) {
+    if (!_sim_http_ready()) {
         return;
     }
     memset(sim_state.request, 0, sizeof(sim_state.request));
@@ -288,13 +401,24 @@ void send_sim_http_post(const char* data)
         data,
         END_OF_STRING
     );
+    sim_state.body_len    = 0;
+    sim_state.body_reader = NULL;
+    sim_state.response_handler = handler;
     sim_state.done = true;
 }
 
-char* get_response()
+void send_sim_http_stream(uint32_t length, sim_body_reader_t reader, sim_response_handler_t handler)
 {
-	sim_state.done = true;
-    return sim_state.response;
+    if (!_sim_http_ready() || !reader) {
+        return;
+    }
+    memset(sim_state.request, 0, sizeof(sim_state.request));
+    sim_state.body_len    = length;
+    sim_state.body_sent   = 0;
+    sim_state.body_over   = false;
+    sim_state.body_reader = reader;
+    sim_state.response_handler = handler;
+    sim_state.done = true;
 }
 
 char* get_sim_url()
@@ -304,38 +428,247 @@ char* get_sim_url()
 
 bool if_network_ready()
 {
-	return fsm_gc_is_state(&sim_fsm, &sim_send_http_s);
+	return _sim_http_ready();
 }
 
-bool has_http_response()
+uint32_t sim_at_commands()
 {
-    return fsm_gc_is_state(&sim_fsm, &sim_wait_user_s);
+	return sim_at_count;
 }
 
-void _sim_send_cmd(const char* cmd)
+// Queues the command with its line break or nothing if the modem transmit queue is full
+bool _sim_send_cmd(const char* cmd)
 {
-    HAL_UART_Transmit(&SIM_MODULE_UART, (uint8_t*)cmd, (uint16_t)strlen(cmd), GENERAL_TIMEOUT_MS);
-    HAL_UART_Transmit(&SIM_MODULE_UART, (uint8_t*)LINE_BREAK, (uint16_t)strlen(LINE_BREAK), GENERAL_TIMEOUT_MS);
+	uint32_t len = strlen(cmd);
+	if (uart_tx_free(&SIM_MODULE_UART) < len + strlen(LINE_BREAK)) {
+#if SIM_MODULE_DEBUG
+		printTagLog(SIM_TAG, "send - queue is full\r\n");
+#endif
+		return false;
+	}
+	if (!strncmp(cmd, "AT", strlen("AT"))) {
+		sim_at_count++;
+	}
+	uart_tx_write(&SIM_MODULE_UART, (const uint8_t*)cmd, len);
+	uart_tx_write(&SIM_MODULE_UART, (const uint8_t*)LINE_BREAK, strlen(LINE_BREAK));
 #if SIM_MODULE_DEBUG
     printTagLog(SIM_TAG, "send - %s\r\n", cmd);
 #endif
+	return true;
 }
 
-bool _sim_validate(const char* target)
+// Queues the next body parts that fit, true when the whole body has been queued
+bool _sim_send_body()
 {
-    if (strnstr(sim_state.response, target, sizeof(sim_state.response))) {
+	while (sim_state.body_sent < sim_state.body_len) {
+		if (uart_tx_free(&SIM_MODULE_UART) < sizeof(sim_state.request)) {
+			return false;
+		}
+
+		uint32_t len = 0;
+		if (!sim_state.body_over) {
+			len = sim_state.body_reader(sim_state.request, sizeof(sim_state.request));
+			sim_state.body_over = !len;
+		}
+		if (sim_state.body_over) {
+			// The modem waits for exactly the declared body length
+			memset(sim_state.request, '\n', sizeof(sim_state.request));
+			len = sizeof(sim_state.request);
+		}
+
+		len = __min(len, __min(sizeof(sim_state.request), sim_state.body_len - sim_state.body_sent));
+		uart_tx_write(&SIM_MODULE_UART, (const uint8_t*)sim_state.request, len);
+		sim_state.body_sent += len;
+	}
+
+	const char end[] = { END_OF_STRING, 0 };
+	if (!_sim_send_cmd(end)) {
+		return false;
+	}
+
 #if SIM_MODULE_DEBUG
-        printTagLog(SIM_TAG, "success - [%s]\n", sim_state.response);
+    printTagLog(SIM_TAG, "send - %lu body bytes\r\n", sim_state.body_sent);
 #endif
-        return true;
-    }
-    return false;
+	memset(sim_state.request, 0, sizeof(sim_state.request));
+	sim_state.body_len    = 0;
+	sim_state.body_sent   = 0;
+	sim_state.body_over   = false;
+	sim_state.body_reader = NULL;
+	return true;
+}
+
+// Requests the next response body part, the text is cleared for it. False if the transmit queue is full
+bool _sim_read_next()
+{
+	_sim_clear_response();
+	sim_state.read_len = 0;
+
+	char request[SIM_HTTP_SIZE] = { 0 };
+	snprintf(
+		request,
+		sizeof(request),
+		"AT+HTTPREAD=%u,%u",
+		sim_state.read_offset,
+		__min(sim_state.resp_len - sim_state.read_offset, SIM_READ_SIZE)
+	);
+	if (!_sim_send_cmd(request)) {
+		return false;
+	}
+	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	return true;
 }
 
 void _sim_clear_response()
 {
-    memset(sim_state.response, 0, sizeof(sim_state.response));
-    sim_state.resp_cnt = 0;
+	sim_state.response[0] = 0;
+	sim_state.resp_cnt    = 0;
+	sim_state.line_len    = 0;
+	sim_state.line_start  = 0;
+	sim_state.body_left   = 0;
+	sim_state.events      = 0;
+}
+
+void _sim_append_text(char chr)
+{
+	if (sim_state.resp_cnt >= sizeof(sim_state.response) - 1) {
+		// The text tail is lost, the result codes are still parsed
+		sim_state.resp_dropped++;
+		return;
+	}
+	sim_state.response[sim_state.resp_cnt++] = chr;
+	sim_state.response[sim_state.resp_cnt]   = 0;
+}
+
+void _sim_parse_line()
+{
+	sim_state.line[sim_state.line_len] = 0;
+
+	const sim_line_t* match = NULL;
+	for (unsigned i = 0; !match && sim_state.line_len && i < __arr_len(sim_lines); i++) {
+		if (!strncmp(sim_state.line, sim_lines[i].prefix, strlen(sim_lines[i].prefix))) {
+			match = &sim_lines[i];
+		}
+	}
+	if (match || !sim_state.line_len) {
+		// The empty lines, the result codes and the URCs are not kept as text
+		sim_state.resp_cnt = sim_state.line_start;
+		sim_state.response[sim_state.resp_cnt] = 0;
+	}
+	if (match) {
+#if SIM_MODULE_DEBUG
+		printTagLog(SIM_TAG, "line - [%s]\n", sim_state.line);
+#endif
+		match->handler(sim_state.line + strlen(match->prefix));
+	}
+
+	sim_state.line_len   = 0;
+	sim_state.line_start = sim_state.resp_cnt;
+}
+
+void _sim_push_at_event(uint32_t event)
+{
+	sim_state.events |= event;
+}
+
+bool _sim_take_at_event(uint32_t events)
+{
+	if ((sim_state.events & events) != events) {
+		return false;
+	}
+	sim_state.events &= ~events;
+	return true;
+}
+
+// A request may be queued: the session is open or closed after the idle timeout
+bool _sim_http_ready()
+{
+	return (fsm_gc_is_state(&sim_fsm, &sim_send_http_s) || fsm_gc_is_state(&sim_fsm, &sim_http_idle_s)) &&
+		!sim_state.done;
+}
+
+bool _sim_command_done(const sim_command_t* command)
+{
+	if (!_sim_take_at_event(SIM_AT_OK)) {
+		return false;
+	}
+	// The command is repeated after the timeout if its URC has not come
+	return _sim_take_at_event(command->urc);
+}
+
+void _sim_ok_h(const char* params)
+{
+	(void)params;
+	_sim_push_at_event(SIM_AT_OK);
+}
+
+void _sim_error_h(const char* params)
+{
+	(void)params;
+	_sim_push_at_event(SIM_AT_ERROR);
+}
+
+void _sim_download_h(const char* params)
+{
+	(void)params;
+	_sim_push_at_event(SIM_AT_DOWNLOAD);
+}
+
+void _sim_cpin_h(const char* params)
+{
+	if (!strncmp(params, "ready", strlen("ready"))) {
+		_sim_push_at_event(SIM_AT_SIM_READY);
+	}
+}
+
+void _sim_cgreg_h(const char* params)
+{
+	// "+cgreg: <n>,<stat>" answer or "+cgreg: <stat>" URC
+	const char* comma = strchr(params, ',');
+	int stat = atoi(comma ? comma + 1 : params);
+	if (stat == 1 || stat == 5) {
+		_sim_push_at_event(SIM_AT_REGISTERED);
+	}
+}
+
+void _sim_csq_h(const char* params)
+{
+	sim_state.rssi = (unsigned)atoi(params);
+	_sim_push_at_event(SIM_AT_SIGNAL);
+}
+
+void _sim_httpaction_h(const char* params)
+{
+	// "+httpaction: <method>,<status>,<length>"
+	const char* status = strchr(params, ',');
+	const char* length = status ? strchr(status + 1, ',') : NULL;
+	if (!length) {
+		return;
+	}
+	sim_state.http_status = (unsigned)atoi(status + 1);
+	sim_state.resp_len    = (unsigned)atoi(length + 1);
+	_sim_push_at_event(SIM_AT_HTTPACTION);
+}
+
+void _sim_httpread_h(const char* params)
+{
+	// A7670: "+httpread: 0,<length>" before each body part and "+httpread: 0" at the end,
+	// SIM868: "+httpread: <length>" before the body
+	const char* comma = strchr(params, ',');
+	uint32_t length = (uint32_t)atoi(comma ? comma + 1 : params);
+	if (!length) {
+		_sim_push_at_event(SIM_AT_READ_END);
+		return;
+	}
+	if (!sim_state.read_len) {
+		sim_state.read_start = sim_state.resp_cnt;
+	}
+	sim_state.body_left = length;
+}
+
+void _sim_content_length_h(const char* params)
+{
+	sim_state.resp_len = (unsigned)atoi(params);
+	_sim_push_at_event(SIM_AT_HEAD_LENGTH);
 }
 
 
@@ -352,15 +685,18 @@ void _sim_init_s(void)
 
 void _sim_start_s(void)
 {
-	memset(sim_state.response, 0, sizeof(sim_state.response));
-	_sim_send_cmd(start_cmds[sim_state.counter].request);
+	_sim_clear_response();
+	if (!_sim_send_cmd(start_cmds[sim_state.counter].request)) {
+		// The transmit queue is full: the command is sent on the next loop
+		return;
+	}
 	util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
 	fsm_gc_push_event(&sim_fsm, &sim_success_e);
 }
 
 void _sim_start_iterate_s(void)
 {
-	if (_sim_validate(start_cmds[sim_state.counter].response)) {
+	if (_sim_command_done(&start_cmds[sim_state.counter])) {
 		sim_state.counter++;
 		sim_state.errors = 0;
 		_sim_clear_response();
@@ -376,7 +712,7 @@ void _sim_start_iterate_s(void)
 		fsm_gc_push_event(&sim_fsm, &sim_end_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -385,8 +721,10 @@ void _sim_start_iterate_s(void)
 
 void _sim_check_sim_s(void)
 {
-	memset(sim_state.response, 0, sizeof(sim_state.response));
-	_sim_send_cmd("AT+CGMR");
+	_sim_clear_response();
+	if (!_sim_send_cmd("AT+CGMR")) {
+		return;
+	}
 
 	util_old_timer_start(&sim_state.timer,SIM_DELAY_MS);
 
@@ -396,7 +734,10 @@ void _sim_check_sim_s(void)
 
 void _sim_check_sim_wait_s(void)
 {
-	if (_sim_validate("a7670")) {
+	// The model name is in the AT+CGMR answer text
+	bool answered = _sim_take_at_event(SIM_AT_OK);
+
+	if (answered && strnstr(sim_state.response, "a7670", sim_state.resp_cnt)) {
 		sim_state.counter = 0;
 		sim_state.module = A7670;
 		_sim_clear_response();
@@ -404,7 +745,7 @@ void _sim_check_sim_wait_s(void)
 		return;
 	}
 
-	if (_sim_validate("sim868")) {
+	if (answered && strnstr(sim_state.response, "sim868", sim_state.resp_cnt)) {
 		sim_state.counter = 0;
 		sim_state.module  = SIM868;
 		_sim_clear_response();
@@ -412,7 +753,7 @@ void _sim_check_sim_wait_s(void)
 		return;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!answered && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -421,8 +762,11 @@ void _sim_check_sim_wait_s(void)
 
 void _sim_868e_start_s(void)
 {
-	memset(sim_state.response, 0, sizeof(sim_state.response));
-	_sim_send_cmd(sim868_cmds[sim_state.counter].request);
+	_sim_clear_response();
+	if (!_sim_send_cmd(sim868_cmds[sim_state.counter].request)) {
+		// The transmit queue is full: the command is sent on the next loop
+		return;
+	}
 	util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
 	fsm_gc_push_event(&sim_fsm, &sim_success_e);
 }
@@ -446,7 +790,7 @@ void _sim_868e_error_s(void)
 
 void _sim_868e_iterate_s(void)
 {
-	if (_sim_validate(sim868_cmds[sim_state.counter].response)) {
+	if (_sim_command_done(&sim868_cmds[sim_state.counter])) {
 		sim_state.counter++;
 		_sim_clear_response();
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
@@ -459,7 +803,7 @@ void _sim_868e_iterate_s(void)
 		fsm_gc_push_event(&sim_fsm, &sim_end_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -469,8 +813,11 @@ void _sim_868e_iterate_s(void)
 
 void _sim_a7670e_start_s(void)
 {
-	memset(sim_state.response, 0, sizeof(sim_state.response));
-	_sim_send_cmd(a7670_cmds[sim_state.counter].request);
+	_sim_clear_response();
+	if (!_sim_send_cmd(a7670_cmds[sim_state.counter].request)) {
+		// The transmit queue is full: the command is sent on the next loop
+		return;
+	}
 	util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
 	fsm_gc_push_event(&sim_fsm, &sim_success_e);
 }
@@ -494,7 +841,7 @@ void _sim_a7670e_error_s(void)
 
 void _sim_a7670e_iterate_s(void)
 {
-	if (_sim_validate(a7670_cmds[sim_state.counter].response)) {
+	if (_sim_command_done(&a7670_cmds[sim_state.counter])) {
 		sim_state.counter++;
 		_sim_clear_response();
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
@@ -507,7 +854,7 @@ void _sim_a7670e_iterate_s(void)
 		fsm_gc_push_event(&sim_fsm, &sim_end_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -519,14 +866,16 @@ void _sim_init_http_s(void)
 	sim_state.http_error = false;
 
 	if (!sim_state.counter) {
-		sim_state.counter++;
 		_sim_clear_response();
 
-		_sim_send_cmd("AT+HTTPINIT");
+		if (!_sim_send_cmd("AT+HTTPINIT")) {
+			return;
+		}
+		sim_state.counter++;
 		util_old_timer_start(&sim_state.timer, 5000);
 	}
 
-	if (_sim_validate("ok")) {
+	if (_sim_take_at_event(SIM_AT_OK)) {
 		_sim_clear_response();
 
 		sim_state.counter = 0;
@@ -535,7 +884,7 @@ void _sim_init_http_s(void)
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -549,25 +898,29 @@ void _sim_init_http_s(void)
 void _sim_start_http_s(void)
 {
 	if (!sim_state.counter) {
-		sim_state.counter++;
 		_sim_clear_response();
 
 		char httppara[SIM_HTTP_SIZE] = { 0 };
 		snprintf(httppara, sizeof(httppara), "AT+HTTPPARA=\"URL\",\"http://%s/api/log/ep\"", sim_state.url);
 
-		_sim_send_cmd(httppara);
+		if (!_sim_send_cmd(httppara)) {
+			return;
+		}
+		sim_state.counter++;
 		util_old_timer_start(&sim_state.timer, 5000);
 	}
 
-	if (_sim_validate("ok")) {
-		sim_state.done = false;
+	if (_sim_take_at_event(SIM_AT_OK)) {
 		sim_state.counter = 0;
 		_sim_clear_response();
+		strncpy(sim_state.session_url, settings.url, sizeof(sim_state.session_url) - 1);
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_IDLE_MS);
 		fsm_gc_clear(&sim_fsm);
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		return;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -580,32 +933,50 @@ void _sim_start_http_s(void)
 void _sim_send_http_s(void)
 {
 	if (!sim_state.done) {
+		// The session is kept until the idle timeout or the server URL change in the settings
+		if (util_old_timer_wait(&sim_state.timer) &&
+			!strncmp(sim_state.session_url, settings.url, sizeof(sim_state.session_url))
+		) {
+			return;
+		}
+
+		sim_state.counter   = 0;
+		sim_state.http_idle = true;
+		fsm_gc_push_event(&sim_fsm, &sim_idle_e);
 		return;
 	}
 
 	if (!sim_state.counter) {
-		sim_state.counter++;
 		_sim_clear_response();
 
+		uint32_t length = sim_state.body_reader ? sim_state.body_len + 1 : strlen(sim_state.request);
 		char httpdata[SIM_HTTP_SIZE] = { 0 };
-		snprintf(httpdata, sizeof(httpdata), "AT+HTTPDATA=%d,%d", strlen(sim_state.request), 1000);
-		memset(sim_state.response, 0, sizeof(sim_state.response));
-		_sim_send_cmd(httpdata);
+		snprintf(httpdata, sizeof(httpdata), "AT+HTTPDATA=%lu,%d", length, 1000);
+		if (!_sim_send_cmd(httpdata)) {
+			return;
+		}
+		sim_state.counter++;
 		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 	}
 
-	if (_sim_validate("download")) {
+	if (sim_state.counter == 1 && _sim_take_at_event(SIM_AT_DOWNLOAD)) {
+		sim_state.counter++;
 		_sim_clear_response();
+	}
 
+	// The body is queued through the next loops as the transmit queue drains
+	if (sim_state.counter == 2 &&
+		(sim_state.body_reader ? _sim_send_body() : _sim_send_cmd(sim_state.request))
+	) {
+		sim_state.counter++;
 		fsm_gc_clear(&sim_fsm);
 
-		_sim_send_cmd(sim_state.request);
 		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -617,22 +988,24 @@ void _sim_send_http_s(void)
 
 void _sim_send_post_s(void)
 {
-	if (_sim_validate("ok")) {
+	if (_sim_take_at_event(SIM_AT_OK)) {
 		_sim_clear_response();
-		sim_state.done = false;
+		sim_state.done    = false;
+		sim_state.counter = 0;
 
 		fsm_gc_clear(&sim_fsm);
 
-		_sim_send_cmd("AT+HTTPACTION=1");
+		// AT+HTTPACTION is sent by the next state, the transmit queue may be full
 		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
+	sim_state.counter = 0;
 	sim_state.http_error = true;
 	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
@@ -640,32 +1013,33 @@ void _sim_send_post_s(void)
 
 void _sim_wait_post_s(void)
 {
-	const char* httpaction = "+httpaction: 1,200,";
-
-	if (!sim_state.done && _sim_validate(httpaction)) {
-		sim_state.done = true;
-	} else if (sim_state.done) {
-		char* ptr = strnstr(
-			sim_state.response,
-			httpaction,
-			sizeof(sim_state.response)
-		) + strlen(httpaction);
-		char format[32] = {0};
-		snprintf(format, sizeof(format) - 1, "%s%u\r\n", httpaction, (unsigned)atoi(ptr));
-		if (strnstr(sim_state.response, format, sizeof(sim_state.response))) {
-			sim_state.resp_len = (unsigned)atoi(ptr);
-			sim_state.done = false;
+	if (!sim_state.counter) {
+		if (!_sim_send_cmd("AT+HTTPACTION=1")) {
+			return;
+		}
+		sim_state.counter++;
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	}
+
+	bool failed = _sim_take_at_event(SIM_AT_ERROR);
+
+	if (_sim_take_at_event(SIM_AT_HTTPACTION)) {
+		if (sim_state.http_status == 200) {
+			_sim_clear_response();
+			sim_state.done    = false;
+			sim_state.counter = 0;
 
 			fsm_gc_clear(&sim_fsm);
 
-			_sim_send_cmd("AT+HTTPHEAD");
 			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 
 			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+			return;
 		}
+		failed = true;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!failed && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -677,35 +1051,26 @@ void _sim_wait_post_s(void)
 
 void _sim_read_data_s(void)
 {
-	const char* contentlength = "content-length: ";
-
-	if (!sim_state.done && _sim_validate(contentlength)) {
-		sim_state.done = true;
-	} else if (sim_state.done) {
-		char* ptr = strnstr(
-			sim_state.response,
-			contentlength,
-			sizeof(sim_state.response)
-		) + strlen(contentlength);
-		char format[32] = {0};
-		snprintf(format, sizeof(format) - 1, "%s%u\r\n", contentlength, (unsigned)atoi(ptr));
-		if (strnstr(sim_state.response, format, sizeof(sim_state.response))) {
-			sim_state.resp_len = (unsigned)atoi(ptr);
-			sim_state.done = false;
-			_sim_clear_response();
+	if (!sim_state.counter) {
+		if (!_sim_send_cmd("AT+HTTPHEAD")) {
+			return;
+		}
+		sim_state.counter++;
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	}
 
-			fsm_gc_clear(&sim_fsm);
+	if (_sim_take_at_event(SIM_AT_HEAD_LENGTH)) {
+		sim_state.done        = false;
+		sim_state.counter     = 0;
+		sim_state.read_offset = 0;
 
-			char request[SIM_HTTP_SIZE] = { 0 };
-			snprintf(request, sizeof(request), "AT+HTTPREAD=0,%u", sim_state.resp_len);
-			_sim_send_cmd(request);
-			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+		fsm_gc_clear(&sim_fsm);
 
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
-		}
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		return;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
@@ -717,82 +1082,108 @@ void _sim_read_data_s(void)
 
 void _sim_wait_data_s(void)
 {
-	if (sim_state.module == A7670) {
-		if (_sim_validate("+httpread: 0")) {
-			fsm_gc_clear(&sim_fsm);
-
-			sim_state.done = false;
-			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	if (!sim_state.counter) {
+		if (!_sim_read_next()) {
+			return;
 		}
-	} else if (sim_state.module == SIM868) {
-		if (_sim_validate("ok")) {
-			fsm_gc_clear(&sim_fsm);
+		sim_state.counter++;
+	}
 
-			sim_state.done = false;
-			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	// A7670 ends the read by "+httpread: 0", SIM868 sends one body part
+	bool part_read = _sim_take_at_event(sim_state.module == A7670 ? SIM_AT_READ_END : SIM_AT_BODY);
 
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	if (part_read && sim_state.read_len) {
+		if (sim_state.response_handler) {
+			sim_state.response_handler(
+				sim_state.response + sim_state.read_start,
+				__min(sim_state.read_len, sim_state.resp_cnt - sim_state.read_start)
+			);
 		}
+		sim_state.read_offset += sim_state.read_len;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (part_read && sim_state.read_len && sim_state.read_offset < sim_state.resp_len) {
+		// The next part is requested by the next loop
+		sim_state.counter = 0;
 		return;
 	}
 
-	sim_state.counter = 0;
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
-}
+	if (part_read) {
+		if (sim_state.response_handler) {
+			sim_state.response_handler(NULL, 0);
+		}
+		_sim_clear_response();
 
-void _sim_wait_user_s(void)
-{
-	if (!sim_state.done && util_old_timer_wait(&sim_state.timer)) {
+		fsm_gc_clear(&sim_fsm);
+
+		sim_state.done    = false;
+		sim_state.counter = 0;
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_IDLE_MS);
+
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 		return;
 	}
 
-	_sim_clear_response();
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
+		return;
+	}
 
 	sim_state.counter = 0;
-
-	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	sim_state.http_error = true;
+	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
 }
 
 void _sim_close_http_s(void)
 {
 	if (!sim_state.counter) {
 		_sim_clear_response();
+		// The request of a failed session is dropped, the next one opens the session again
+		sim_state.done = false;
 
+		if (!_sim_send_cmd("AT+HTTPTERM")) {
+			return;
+		}
 		sim_state.counter++;
-
-		_sim_send_cmd("AT+HTTPTERM");
 		util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
 	}
 
-	if (_sim_validate("ok")) {
+	if (_sim_take_at_event(SIM_AT_OK)) {
 		_sim_clear_response();
 
 		sim_state.counter = 0;
 
 		fsm_gc_clear(&sim_fsm);
-		if (sim_state.http_error ||
-			strncmp(sim_state.url, settings.url, strlen(sim_state.url))
-		) {
+		if (sim_state.http_error) {
 			fsm_gc_push_event(&sim_fsm, &sim_change_e);
 		} else {
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+			// The default URL is kept until an error, a new URL in the settings is used at once
+			if (strncmp(sim_state.session_url, settings.url, sizeof(sim_state.session_url))) {
+				strncpy(sim_state.url, settings.url, sizeof(sim_state.url) - 1);
+			}
+			fsm_gc_push_event(&sim_fsm, sim_state.http_idle ? &sim_end_e : &sim_success_e);
 		}
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (!_sim_take_at_event(SIM_AT_ERROR) && util_old_timer_wait(&sim_state.timer)) {
 		return;
 	}
 
 	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
 }
 
+void _sim_http_idle_s(void)
+{
+	// The session is opened again by the next request
+	if (!sim_state.done) {
+		return;
+	}
+
+	sim_state.counter   = 0;
+	sim_state.http_idle = false;
+	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+}
+
 void _sim_change_url_s(void)
 {
 #if SIM_MODULE_DEBUG
@@ -831,6 +1222,7 @@ void _sim_count_error_s(void)
 	sim_state.errors++;
 	sim_state.counter    = 0;
     sim_state.http_error = false;
+    sim_state.http_idle  = false;
 
 	if (sim_state.errors > SIM_MAX_ERRORS) {
 		fsm_gc_push_event(&sim_fsm, &sim_error_e);
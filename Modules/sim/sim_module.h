@@ -7,6 +7,7 @@ extern "C" {
 #endif
 
 
+#include <stdint.h>
 #include <stdbool.h>
 
 
@@ -23,14 +24,27 @@ extern "C" {
 extern char sim_response[RESPONSE_SIZE];
 
 
+/*
+ * HTTP body reader for streamed requests: writes the next body part to buf
+ * and returns its length, 0 when the body is over
+ */
+typedef uint32_t (*sim_body_reader_t)(char* buf, uint32_t size);
+/*
+ * HTTP response handler: gets the response body in bounded parts (not
+ * terminated) as the modem reads them, len == 0 when the body is over
+ */
+typedef void (*sim_response_handler_t)(const char* data, uint32_t len);
+
+
 void sim_begin();
 void sim_proccess();
 void sim_proccess_input(const char input_chr);
-void send_sim_http_post(const char* data);
-bool has_http_response();
+void send_sim_http_post(const char* data, sim_response_handler_t handler);
+void send_sim_http_stream(uint32_t length, sim_body_reader_t reader, sim_response_handler_t handler);
 bool if_network_ready();
-char* get_response();
 char* get_sim_url();
+// AT commands sent to the modem
+uint32_t sim_at_commands();
 
 
 #ifdef __cplusplus
@@ -0,0 +1,117 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "sim_uart.h"
+
+#include "main.h"
+#include "glog.h"
+#include "gutils.h"
+
+
+#if SIM_UART_RING_SIZE & (SIM_UART_RING_SIZE - 1)
+#   error "SIM_UART_RING_SIZE must be a power of two"
+#endif
+
+
+typedef struct _sim_uart_t {
+	uint8_t           dma[SIM_UART_DMA_SIZE];
+	uint16_t          dma_pos;  // Next DMA buffer byte to copy
+
+	char              ring[SIM_UART_RING_SIZE];
+	volatile uint32_t head;     // Written by the interrupt only
+	volatile uint32_t tail;     // Written by the main loop only
+
+	uint32_t          events;   // Receive interrupts
+	uint32_t          bytes;
+	uint32_t          dropped;  // Bytes lost on the full ring
+	uint32_t          errors;   // DMA restarts after the UART errors
+	uint32_t          max_used; // Ring fill high-water mark
+} sim_uart_t;
+
+
+static sim_uart_t sim_uart = {0};
+
+
+static void _sim_uart_push(const uint8_t* data, uint32_t len);
+
+
+void sim_uart_begin(void)
+{
+	sim_uart.dma_pos = 0;
+	HAL_UARTEx_ReceiveToIdle_DMA(&SIM_MODULE_UART, sim_uart.dma, sizeof(sim_uart.dma));
+}
+
+void sim_uart_rx_event(uint16_t pos)
+{
+	sim_uart.events++;
+
+	pos = __min(pos, sizeof(sim_uart.dma));
+	if (pos < sim_uart.dma_pos) {
+		// The DMA has wrapped: the buffer end goes first
+		_sim_uart_push(&sim_uart.dma[sim_uart.dma_pos], sizeof(sim_uart.dma) - sim_uart.dma_pos);
+		sim_uart.dma_pos = 0;
+	}
+	_sim_uart_push(&sim_uart.dma[sim_uart.dma_pos], pos - sim_uart.dma_pos);
+	sim_uart.dma_pos = pos % sizeof(sim_uart.dma);
+}
+
+void sim_uart_error(void)
+{
+	sim_uart.errors++;
+	sim_uart_begin();
+}
+
+uint32_t sim_uart_read(char* dst, uint32_t size)
+{
+	uint32_t tail = sim_uart.tail;
+	uint32_t len  = __min(sim_uart.head - tail, size);
+	// The ring bytes are read after the head
+	__DMB();
+	for (uint32_t i = 0; i < len; i++) {
+		dst[i] = sim_uart.ring[(tail + i) & (SIM_UART_RING_SIZE - 1)];
+	}
+	// The bytes are taken before the space is given back
+	__DMB();
+	sim_uart.tail = tail + len;
+	return len;
+}
+
+void sim_uart_show(void)
+{
+	uint32_t per_event_x100 = sim_uart.events ? (sim_uart.bytes * 100) / sim_uart.events : 0;
+	gprint(
+		"\n####################MODEM RX####################\n"
+		"Received:         %lu bytes\n"
+		"Interrupts:       %lu (%lu.%02lu bytes per interrupt)\n"
+		"Ring use:         %lu max of %u bytes\n"
+		"Dropped:          %lu bytes\n"
+		"UART errors:      %lu\n"
+		"####################MODEM RX####################\n",
+		sim_uart.bytes,
+		sim_uart.events,
+		per_event_x100 / 100,
+		per_event_x100 % 100,
+		sim_uart.max_used,
+		SIM_UART_RING_SIZE,
+		sim_uart.dropped,
+		sim_uart.errors
+	);
+}
+
+static void _sim_uart_push(const uint8_t* data, uint32_t len)
+{
+	uint32_t head = sim_uart.head;
+	uint32_t free = SIM_UART_RING_SIZE - (head - sim_uart.tail);
+	if (len > free) {
+		sim_uart.dropped += len - free;
+		len = free;
+	}
+	for (uint32_t i = 0; i < len; i++) {
+		sim_uart.ring[(head + i) & (SIM_UART_RING_SIZE - 1)] = (char)data[i];
+	}
+	// The bytes are in the ring before the consumer sees the head
+	__DMB();
+	sim_uart.head = head + len;
+
+	sim_uart.bytes   += len;
+	sim_uart.max_used = __max(sim_uart.max_used, head + len - sim_uart.tail);
+}
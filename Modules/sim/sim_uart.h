@@ -0,0 +1,42 @@
+#ifndef INC_SIM_UART_H_
+#define INC_SIM_UART_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+
+
+/*
+ * Modem receive path: USART1 RX runs on a circular DMA buffer, its half and
+ * full transfer events and the IDLE line event copy the new bytes to a
+ * single producer single consumer ring (the interrupt is the only producer,
+ * sim_proccess() is the only consumer).
+ * The interrupt comes once per SIM_UART_DMA_SIZE / 2 bytes or per pause in
+ * the modem output instead of once per byte, and the bytes are kept by the
+ * DMA while the interrupts are masked (up to SIM_UART_DMA_SIZE bytes).
+ */
+#define SIM_UART_DMA_SIZE  (128)
+#define SIM_UART_RING_SIZE (512) // Power of two
+
+
+// Starts the circular DMA reception
+void sim_uart_begin(void);
+// Interrupt side: copies the DMA buffer up to pos (HAL_UARTEx_RxEventCallback())
+void sim_uart_rx_event(uint16_t pos);
+// Interrupt side: the HAL stops the DMA reception on a UART error, it is started again
+void sim_uart_error(void);
+// Main loop side: takes up to size received bytes
+uint32_t sim_uart_read(char* dst, uint32_t size);
+void sim_uart_show(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
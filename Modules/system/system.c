@@ -14,6 +14,27 @@ const char SYSTEM_TAG[] = "SYS";
 
 uint16_t SYSTEM_ADC_VOLTAGE[3] = {0};
 
+static uint32_t system_loop_start = 0;
+static uint32_t system_loop_count = 0;
+static uint64_t system_loop_total = 0;
+static uint32_t system_loop_max   = 0;
+static uint32_t system_boot_ms    = 0;
+
+#define SYSTEM_CRC_POLY (0x04C11DB7)
+
+static const uint32_t system_crc_nibbles[16] = {
+	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+	0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+};
+
+
+static void _system_dwt_enable(void);
+static uint32_t _system_crc32_sw(uint32_t state, const uint8_t* ptr, uint32_t len);
+#if SYSTEM_CRC_HW
+static uint32_t _system_crc32_unshift(uint32_t state);
+static uint32_t _system_crc32_hw(uint32_t state, const uint8_t* ptr, uint32_t words);
+#endif
+
 
 extern RTC_HandleTypeDef hrtc;
 
@@ -570,3 +591,156 @@ char* get_system_serial_str(void)
 
 	return str_uid;
 }
+
+void system_loop_begin(void)
+{
+	_system_dwt_enable();
+	system_loop_start = DWT->CYCCNT;
+}
+
+void system_loop_end(void)
+{
+	uint32_t cycles = DWT->CYCCNT - system_loop_start;
+	system_loop_count++;
+	system_loop_total += cycles;
+	if (cycles > system_loop_max) {
+		system_loop_max = cycles;
+	}
+}
+
+void system_show_loop(void)
+{
+	uint32_t cycles_per_us = HAL_RCC_GetHCLKFreq() / 1000000;
+	if (!cycles_per_us) {
+		cycles_per_us = 1;
+	}
+	gprint(
+		"\n###################MAIN LOOP######################\n"
+		"Iterations:       %lu\n"
+		"Average:          %lu us\n"
+		"Worst:            %lu us\n"
+		"Boot time:        %lu ms\n"
+		"###################MAIN LOOP######################\n",
+		system_loop_count,
+		system_loop_count ? (uint32_t)(system_loop_total / system_loop_count) / cycles_per_us : 0,
+		system_loop_max / cycles_per_us,
+		system_boot_ms
+	);
+}
+
+void system_boot_done(void)
+{
+	system_boot_ms = HAL_GetTick();
+}
+
+uint32_t system_crc32(uint32_t crc, const void* data, uint32_t len)
+{
+	const uint8_t* ptr = (const uint8_t*)data;
+	uint32_t state = ~crc;
+#if SYSTEM_CRC_HW
+	uint32_t words = len / sizeof(uint32_t);
+	if (words) {
+		state = _system_crc32_hw(state, ptr, words);
+		ptr += words * sizeof(uint32_t);
+		len -= words * sizeof(uint32_t);
+	}
+#endif
+	return ~_system_crc32_sw(state, ptr, len);
+}
+
+void system_show_crc(void)
+{
+	// The flash is a page of the data without a RAM buffer
+	const uint8_t* page = (const uint8_t*)FLASH_BASE;
+	const uint32_t size = 256;
+	const uint32_t runs = 100;
+
+	uint32_t cycles_per_us = HAL_RCC_GetHCLKFreq() / 1000000;
+	if (!cycles_per_us) {
+		cycles_per_us = 1;
+	}
+	_system_dwt_enable();
+
+	uint32_t sw_crc = 0;
+	uint32_t start  = DWT->CYCCNT;
+	for (uint32_t i = 0; i < runs; i++) {
+		sw_crc = ~_system_crc32_sw(0xFFFFFFFF, page, size);
+	}
+	uint32_t sw_cycles = (DWT->CYCCNT - start) / runs;
+
+	uint32_t hw_crc = 0;
+	start = DWT->CYCCNT;
+	for (uint32_t i = 0; i < runs; i++) {
+		hw_crc = system_crc32(0, page, size);
+	}
+	uint32_t hw_cycles = (DWT->CYCCNT - start) / runs;
+
+	gprint(
+		"\n######################CRC32#######################\n"
+		"Page:             %lu bytes\n"
+		"CRC unit:         %lu cycles (%lu us)%s\n"
+		"Software:         %lu cycles (%lu us)\n"
+		"Results:          %s\n"
+		"######################CRC32#######################\n",
+		size,
+		hw_cycles,
+		hw_cycles / cycles_per_us,
+		SYSTEM_CRC_HW ? "" : " - disabled",
+		sw_cycles,
+		sw_cycles / cycles_per_us,
+		hw_crc == sw_crc ? "match" : "MISMATCH"
+	);
+}
+
+static void _system_dwt_enable(void)
+{
+	if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CYCCNT = 0;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	}
+}
+
+// MSB-first CRC with the state as is (no inversions)
+static uint32_t _system_crc32_sw(uint32_t state, const uint8_t* ptr, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		state ^= (uint32_t)ptr[i] << 24;
+		state = (state << 4) ^ system_crc_nibbles[state >> 28];
+		state = (state << 4) ^ system_crc_nibbles[state >> 28];
+	}
+	return state;
+}
+
+#if SYSTEM_CRC_HW
+
+// The CRC unit has no initial value register: the state is loaded as a data
+// word which the reset value 0xFFFFFFFF shifts to the state
+static uint32_t _system_crc32_unshift(uint32_t state)
+{
+	for (unsigned i = 0; i < 32; i++) {
+		state = (state & 1) ? (((state ^ SYSTEM_CRC_POLY) >> 1) | 0x80000000) : (state >> 1);
+	}
+	return state;
+}
+
+static uint32_t _system_crc32_hw(uint32_t state, const uint8_t* ptr, uint32_t words)
+{
+	if (!(RCC->AHBENR & RCC_AHBENR_CRCEN)) {
+		__HAL_RCC_CRC_CLK_ENABLE();
+	}
+
+	CRC->CR = CRC_CR_RESET;
+	if (state != 0xFFFFFFFF) {
+		CRC->DR = _system_crc32_unshift(state) ^ 0xFFFFFFFF;
+	}
+	for (uint32_t i = 0; i < words; i++) {
+		// The unit takes the word MSB first: the bytes are fed in the memory order
+		uint32_t word = 0;
+		memcpy(&word, ptr + i * sizeof(word), sizeof(word));
+		CRC->DR = __REV(word);
+	}
+	return CRC->DR;
+}
+
+#endif
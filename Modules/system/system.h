@@ -17,6 +17,15 @@ extern "C" {
 #   define SYSTEM_BEDUG (1)
 #endif
 
+/*
+ * system_crc32() feeds the data words to the STM32 CRC unit, the software
+ * implementation (the tail bytes and the host builds) gives the same results.
+ * The CRC unit is not reentrant: the CRC is calculated in the main loop only.
+ */
+#ifndef SYSTEM_CRC_HW
+#   define SYSTEM_CRC_HW (1)
+#endif
+
 
 extern uint16_t SYSTEM_ADC_VOLTAGE[3];
 
@@ -36,6 +45,19 @@ void system_reset_i2c_errata(void);
 
 char* get_system_serial_str(void);
 
+// Main loop iteration time (DWT cycle counter)
+void system_loop_begin(void);
+void system_loop_end(void);
+void system_show_loop(void);
+
+// Time from the reset to the WORKING status
+void system_boot_done(void);
+
+// CRC-32/BZIP2 (the CRC unit polynomial): crc is 0 or the CRC of the previous data
+uint32_t system_crc32(uint32_t crc, const void* data, uint32_t len);
+// CRC32 cost of a storage page: the CRC unit and the software implementation
+void system_show_crc(void);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,182 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "uart_tx.h"
+
+#include "main.h"
+#include "glog.h"
+#include "gutils.h"
+
+
+#if (UART_TX_SIM_SIZE & (UART_TX_SIM_SIZE - 1)) || (UART_TX_BEDUG_SIZE & (UART_TX_BEDUG_SIZE - 1))
+#   error "UART_TX_SIM_SIZE and UART_TX_BEDUG_SIZE must be powers of two"
+#endif
+
+
+typedef struct _uart_tx_t {
+	UART_HandleTypeDef* huart;
+	uint8_t*            ring;
+	uint32_t            size;
+
+	volatile uint32_t   head;      // Next byte to queue
+	volatile uint32_t   tail;      // Next byte to send
+	volatile uint32_t   sending;   // Bytes of the DMA transfer, 0 - the DMA is idle
+
+	uint32_t            bytes;
+	uint32_t            transfers;
+	uint32_t            full;      // Writes that have not fit
+	uint32_t            errors;    // Parts skipped after the DMA errors
+	uint32_t            max_used;  // Queue fill high-water mark
+} uart_tx_t;
+
+
+static uint8_t uart_tx_sim_ring[UART_TX_SIM_SIZE];
+static uint8_t uart_tx_bedug_ring[UART_TX_BEDUG_SIZE];
+
+static uart_tx_t uart_tx_queues[] = {
+	{&SIM_MODULE_UART, uart_tx_sim_ring,   sizeof(uart_tx_sim_ring)},
+	{&BEDUG_UART,      uart_tx_bedug_ring, sizeof(uart_tx_bedug_ring)},
+};
+
+
+static uart_tx_t* _uart_tx_find(UART_HandleTypeDef* huart);
+static uint32_t _uart_tx_push(uart_tx_t* tx, const uint8_t* data, uint32_t len);
+static void _uart_tx_start(uart_tx_t* tx);
+
+
+uart_tx_status_t uart_tx_write(UART_HandleTypeDef* huart, const uint8_t* data, uint32_t len)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	if (!tx || len > tx->size) {
+		return UART_TX_ERROR;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uart_tx_status_t status = UART_TX_FULL;
+	if (tx->size - (tx->head - tx->tail) >= len) {
+		_uart_tx_push(tx, data, len);
+		status = UART_TX_OK;
+	} else {
+		tx->full++;
+	}
+
+	__set_PRIMASK(primask);
+
+	return status;
+}
+
+uint32_t uart_tx_write_some(UART_HandleTypeDef* huart, const uint8_t* data, uint32_t len)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	if (!tx) {
+		return 0;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t queued = _uart_tx_push(tx, data, len);
+	if (queued < len) {
+		tx->full++;
+	}
+
+	__set_PRIMASK(primask);
+
+	return queued;
+}
+
+uint32_t uart_tx_free(UART_HandleTypeDef* huart)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	return tx ? tx->size - (tx->head - tx->tail) : 0;
+}
+
+bool uart_tx_empty(UART_HandleTypeDef* huart)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	return !tx || tx->head == tx->tail;
+}
+
+void uart_tx_complete(UART_HandleTypeDef* huart)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	if (!tx || !tx->sending) {
+		return;
+	}
+	tx->tail   += tx->sending;
+	tx->sending = 0;
+	_uart_tx_start(tx);
+}
+
+void uart_tx_error(UART_HandleTypeDef* huart)
+{
+	uart_tx_t* tx = _uart_tx_find(huart);
+	// The receive errors do not stop the transfer
+	if (!tx || !tx->sending || huart->gState != HAL_UART_STATE_READY) {
+		return;
+	}
+	tx->errors++;
+	uart_tx_complete(huart);
+}
+
+void uart_tx_show(void)
+{
+	gprint("\n####################UART TX#####################\n");
+	for (unsigned i = 0; i < __arr_len(uart_tx_queues); i++) {
+		uart_tx_t* tx = &uart_tx_queues[i];
+		gprint(
+			"%s: %lu bytes in %lu transfers, %lu max of %lu queued, %lu full, %lu errors\n",
+			tx->huart == &SIM_MODULE_UART ? "Modem" : "Debug",
+			tx->bytes,
+			tx->transfers,
+			tx->max_used,
+			tx->size,
+			tx->full,
+			tx->errors
+		);
+	}
+	gprint("####################UART TX#####################\n");
+}
+
+static uart_tx_t* _uart_tx_find(UART_HandleTypeDef* huart)
+{
+	for (unsigned i = 0; i < __arr_len(uart_tx_queues); i++) {
+		if (uart_tx_queues[i].huart == huart) {
+			return &uart_tx_queues[i];
+		}
+	}
+	return NULL;
+}
+
+// Interrupts are disabled by the caller
+static uint32_t _uart_tx_push(uart_tx_t* tx, const uint8_t* data, uint32_t len)
+{
+	uint32_t head = tx->head;
+	len = __min(len, tx->size - (head - tx->tail));
+	for (uint32_t i = 0; i < len; i++) {
+		tx->ring[(head + i) & (tx->size - 1)] = data[i];
+	}
+	tx->head     = head + len;
+	tx->bytes   += len;
+	tx->max_used = __max(tx->max_used, tx->head - tx->tail);
+
+	_uart_tx_start(tx);
+
+	return len;
+}
+
+// Called with the interrupts disabled or from the transfer complete interrupt
+static void _uart_tx_start(uart_tx_t* tx)
+{
+	if (tx->sending || tx->head == tx->tail) {
+		return;
+	}
+	// The DMA sends up to the ring end, the wrapped part goes next
+	uint32_t offset = tx->tail & (tx->size - 1);
+	uint32_t len    = __min(tx->head - tx->tail, tx->size - offset);
+	if (HAL_UART_Transmit_DMA(tx->huart, &tx->ring[offset], (uint16_t)len) == HAL_OK) {
+		tx->sending = len;
+		tx->transfers++;
+	}
+}
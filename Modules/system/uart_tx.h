@@ -0,0 +1,55 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _UART_TX_H_
+#define _UART_TX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "main.h"
+
+
+/*
+ * Transmit queues of the modem and the debug UARTs: the bytes are copied to
+ * a ring and the DMA sends its contiguous parts, the next part is started
+ * from the transfer complete interrupt. The writers do not wait for the
+ * line, a full queue is reported to them (UART_TX_FULL).
+ * The writes are short critical sections, the queues may be written from
+ * the interrupts too.
+ */
+#define UART_TX_SIM_SIZE   (256)  // Power of two, fits the sim_module.c body part
+#define UART_TX_BEDUG_SIZE (1024) // Power of two
+
+
+typedef enum _uart_tx_status_t {
+	UART_TX_OK = 0,
+	UART_TX_FULL,    // Not enough free space, nothing has been queued
+	UART_TX_ERROR    // No queue for the UART or the data is longer than the queue
+} uart_tx_status_t;
+
+
+// Queues all the data or nothing
+uart_tx_status_t uart_tx_write(UART_HandleTypeDef* huart, const uint8_t* data, uint32_t len);
+// Queues the data part that fits, returns its length
+uint32_t uart_tx_write_some(UART_HandleTypeDef* huart, const uint8_t* data, uint32_t len);
+uint32_t uart_tx_free(UART_HandleTypeDef* huart);
+// All the queued bytes have been sent
+bool uart_tx_empty(UART_HandleTypeDef* huart);
+// Interrupt side: the DMA transfer is over (HAL_UART_TxCpltCallback())
+void uart_tx_complete(UART_HandleTypeDef* huart);
+// Interrupt side: the HAL stops the DMA transfer on a DMA error, its part is skipped
+void uart_tx_error(UART_HandleTypeDef* huart);
+void uart_tx_show(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Cluster density (RECORD_DB_PACKED): a 15 min record trace with the RTC
+ * jitter, power loss gaps, pump cycles and sensor errors is saved to the empty
+ * memory and read back field by field, the records per cluster page and the
+ * I2C bytes written per record are printed.
+ * The test is built for both cluster formats in both layouts.
+ */
+
+#include <string.h>
+
+#include "host.h"
+#include "clock.h"
+#include "settings.h"
+#include "StorageAT.h"
+#include "RecordDB.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+#define RECORD_PERIOD_S  (RECORD_PERIOD_MS / 1000)
+
+// Fits the ring log in the plain format without the wrap
+static const uint32_t RECORDS_COUNT = 1500;
+
+
+extern StorageAT storage;
+
+
+static RecordDB::Record trace[RECORDS_COUNT] = {};
+static uint32_t randState = 1;
+static uint32_t seconds   = 24 * DAYS_PER_YEAR * 24 * 60 * 60;
+static int32_t  level     = 150000;
+
+
+static uint32_t host_rand()
+{
+	randState = randState * 1103515245 + 12345;
+	return randState >> 8;
+}
+
+static void make_record(RecordDB::Record* record)
+{
+	// The RTC drifts by a second, the power is lost for an hour now and then
+	seconds += RECORD_PERIOD_S + host_rand() % 3 - 1;
+	if (host_rand() % 97 == 0) {
+		seconds += 60 * 60;
+	}
+	RTC_DateTypeDef date = {};
+	RTC_TimeTypeDef time = {};
+	clock_seconds_to_datetime(seconds, &date, &time);
+	record->time[0] = date.Year;
+	record->time[1] = date.Month;
+	record->time[2] = date.Date;
+	record->time[3] = time.Hours;
+	record->time[4] = time.Minutes;
+	record->time[5] = time.Seconds;
+	if (host_rand() % 200 == 0) {
+		// The RTC has failed
+		memset(record->time, 0, sizeof(record->time));
+	}
+
+	bool pump = host_rand() % 4 == 0;
+	level += pump ? -static_cast<int32_t>(host_rand() % 3000) : static_cast<int32_t>(host_rand() % 200);
+	record->cf_id = 7 + static_cast<uint32_t>(record - trace) / 500;
+	record->level = level;
+	if (host_rand() % 50 == 0) {
+		// The sensor error
+		record->level = -1;
+	}
+	if (host_rand() % 300 == 0) {
+		record->level = host_rand() % 2 ? INT32_MAX : INT32_MIN;
+	}
+	record->press_1       = static_cast<uint16_t>(250 + host_rand() % 20);
+	record->pump_wok_time = pump ? 100 + host_rand() % 800 : 0;
+	record->pump_downtime = RECORD_PERIOD_S - record->pump_wok_time + host_rand() % 3 - 1;
+}
+
+static uint32_t used_pages()
+{
+	// The records are the only data in the memory: every written page is a cluster
+#if RECORD_DB_RING_LOG
+	uint32_t first = RECORD_LOG_ADDRESS / EEPROM_PAGE_SIZE;
+#else
+	uint32_t first = 0;
+#endif
+	uint32_t pages = 0;
+	for (uint32_t page = first; page < EEPROM_PAGES_COUNT; page++) {
+		uint8_t data[EEPROM_PAGE_SIZE] = {};
+		HOST_CHECK(eeprom_read(page * EEPROM_PAGE_SIZE, data, sizeof(data)) == EEPROM_OK);
+		for (uint32_t i = 0; i < sizeof(data); i++) {
+			if (data[i] != 0xFF) {
+				pages++;
+				break;
+			}
+		}
+	}
+	return pages;
+}
+
+static void boot_save()
+{
+	settings.sleep_time = RECORD_PERIOD_MS;
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+
+	for (uint32_t i = 0; i < RECORDS_COUNT; i++) {
+		RecordDB record(0);
+		make_record(&trace[i]);
+		record.record = trace[i];
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == i + 1);
+	}
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	host_i2c_stats_t stats = host_i2c_stats();
+
+	// Every record is read back as it was saved
+	HOST_CHECK(RecordDB::buildIndex() == RecordDB::RECORD_OK);
+	uint32_t id = 0;
+	while (true) {
+		RecordDB record(id);
+		if (record.loadNext() != RecordDB::RECORD_OK) {
+			break;
+		}
+		HOST_CHECK(record.record.id == id + 1);
+		const RecordDB::Record* saved = &trace[id];
+		HOST_CHECK(!memcmp(record.record.time, saved->time, sizeof(saved->time)));
+		HOST_CHECK(record.record.cf_id == saved->cf_id);
+		HOST_CHECK(record.record.level == saved->level);
+		HOST_CHECK(record.record.press_1 == saved->press_1);
+		HOST_CHECK(record.record.pump_wok_time == saved->pump_wok_time);
+		HOST_CHECK(record.record.pump_downtime == saved->pump_downtime);
+		id = record.record.id;
+	}
+	HOST_CHECK(id == RECORDS_COUNT);
+
+	uint32_t pages = used_pages();
+	printf(
+		"%s %s: %.1f records per cluster page, %.1f I2C bytes written per record\n",
+		RECORD_DB_RING_LOG ? "ring log" : "StorageAT",
+		RECORD_DB_PACKED ? "packed" : "plain",
+		(double)RECORDS_COUNT / pages,
+		(double)stats.write_bytes / RECORDS_COUNT
+	);
+#if RECORD_DB_PACKED
+	// More records than a page keeps unpacked
+	HOST_CHECK(RECORDS_COUNT / pages > EEPROM_PAGE_SIZE / sizeof(RecordDB::Record));
+#endif
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "clust_density_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
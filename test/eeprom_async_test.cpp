@@ -0,0 +1,82 @@
+/*
+ * AT24CM01 asynchronous engine: a transfer without the completion interrupt
+ * ends by the timeout, the I2C is reset and the next requests work.
+ */
+
+#include <string.h>
+
+#include "host.h"
+#include "main.h"
+#include "at24cm01.h"
+
+
+#define TEST_ADDRESS (0x100)
+#define TEST_SIZE    (64)
+#define TICKS_MAX    (2000)
+
+
+typedef struct _request_result_t {
+	uint32_t        calls;
+	eeprom_status_t status;
+} request_result_t;
+
+
+static void request_done(eeprom_status_t status, void* ctx)
+{
+	request_result_t* result = static_cast<request_result_t*>(ctx);
+	result->calls++;
+	result->status = status;
+}
+
+static void run_requests()
+{
+	for (uint32_t i = 0; i < TICKS_MAX && eeprom_async_busy(); i++) {
+		eeprom_async_tick();
+		host_delay_ms(1);
+	}
+	HOST_CHECK(!eeprom_async_busy());
+}
+
+static void boot_timeout()
+{
+	uint8_t saved[TEST_SIZE] = {};
+	uint8_t data[TEST_SIZE]  = {};
+	memset(saved, 0xA5, sizeof(saved));
+	memset(data, 0x5A, sizeof(data));
+	HOST_CHECK(eeprom_write(TEST_ADDRESS, saved, sizeof(saved)) == EEPROM_OK);
+
+	// The write has no completion interrupt: the request ends by the timeout once
+	request_result_t hung = {};
+	host_i2c_hang();
+	HOST_CHECK(eeprom_write_async(TEST_ADDRESS, data, sizeof(data), request_done, &hung) == EEPROM_OK);
+	run_requests();
+	HOST_CHECK(hung.calls == 1 && hung.status == EEPROM_ERROR);
+	HOST_CHECK(host_i2c_stats().resets == 1 && eeprom_get_stats()->aborts == 1);
+	HOST_CHECK(HAL_I2C_GetState(&EEPROM_I2C) == HAL_I2C_STATE_READY);
+
+	// The I2C is free again: the next requests are done
+	uint8_t loaded[TEST_SIZE] = {};
+	request_result_t read = {};
+	HOST_CHECK(eeprom_read_async(TEST_ADDRESS, loaded, sizeof(loaded), request_done, &read) == EEPROM_OK);
+	HOST_CHECK(eeprom_async_wait() == EEPROM_OK);
+	HOST_CHECK(read.calls == 1 && read.status == EEPROM_OK);
+	HOST_CHECK(!memcmp(loaded, saved, sizeof(saved)));
+
+	request_result_t write = {};
+	HOST_CHECK(eeprom_write_async(TEST_ADDRESS, data, sizeof(data), request_done, &write) == EEPROM_OK);
+	HOST_CHECK(eeprom_async_wait() == EEPROM_OK);
+	HOST_CHECK(write.calls == 1 && write.status == EEPROM_OK);
+	HOST_CHECK(eeprom_read(TEST_ADDRESS, loaded, sizeof(loaded)) == EEPROM_OK);
+	HOST_CHECK(!memcmp(loaded, data, sizeof(data)));
+	HOST_CHECK(hung.calls == 1);
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "eeprom_async_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_timeout) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * AT24CM01 sequential reads: the whole memory is read page by page and with
+ * one eeprom_read(), the I2C transactions and the read speed of both are
+ * printed, an unaligned range across the 64 KB blocks is read back.
+ */
+
+#include <string.h>
+
+#include "host.h"
+#include "main.h"
+#include "at24cm01.h"
+
+
+#define MEMORY_SIZE    (EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE)
+// The range crosses the device address bit of the second 64 KB block
+#define BLOCK_ADDRESS  (0xFF10)
+#define BLOCK_SIZE     (0x300)
+
+
+static uint8_t memory[MEMORY_SIZE] = {};
+static uint8_t buffer[MEMORY_SIZE] = {};
+
+
+static double read_speed(uint32_t bytes, uint32_t ms)
+{
+	return (bytes / 1024.0) / (ms / 1000.0);
+}
+
+static void boot_bulk()
+{
+	for (uint32_t i = 0; i < MEMORY_SIZE; i++) {
+		memory[i] = static_cast<uint8_t>(i * 7 + (i >> 16));
+	}
+	for (uint32_t page = 0; page < EEPROM_PAGES_COUNT; page++) {
+		HOST_CHECK(eeprom_write(page * EEPROM_PAGE_SIZE, memory + page * EEPROM_PAGE_SIZE, EEPROM_PAGE_SIZE) == EEPROM_OK);
+	}
+	// The last write cycle is over
+	host_delay_ms(10);
+
+	host_i2c_stats_t start = host_i2c_stats();
+	uint32_t tick = HAL_GetTick();
+	for (uint32_t page = 0; page < EEPROM_PAGES_COUNT; page++) {
+		HOST_CHECK(eeprom_read(page * EEPROM_PAGE_SIZE, buffer + page * EEPROM_PAGE_SIZE, EEPROM_PAGE_SIZE) == EEPROM_OK);
+	}
+	HOST_CHECK(!memcmp(buffer, memory, MEMORY_SIZE));
+	uint32_t pageTransactions = host_i2c_stats().transactions - start.transactions;
+	double   pageSpeed        = read_speed(MEMORY_SIZE, HAL_GetTick() - tick);
+
+	memset(buffer, 0, sizeof(buffer));
+	start = host_i2c_stats();
+	tick  = HAL_GetTick();
+	HOST_CHECK(eeprom_read(0, buffer, MEMORY_SIZE) == EEPROM_OK);
+	HOST_CHECK(!memcmp(buffer, memory, MEMORY_SIZE));
+	uint32_t bulkTransactions = host_i2c_stats().transactions - start.transactions;
+	double   bulkSpeed        = read_speed(MEMORY_SIZE, HAL_GetTick() - tick);
+
+	printf("per page: %u transactions, %.1f KB/s\n", static_cast<unsigned>(pageTransactions), pageSpeed);
+	printf("bulk:     %u transactions, %.1f KB/s\n", static_cast<unsigned>(bulkTransactions), bulkSpeed);
+	HOST_CHECK(bulkTransactions < pageTransactions);
+
+	memset(buffer, 0, sizeof(buffer));
+	HOST_CHECK(eeprom_read(BLOCK_ADDRESS, buffer, BLOCK_SIZE) == EEPROM_OK);
+	HOST_CHECK(!memcmp(buffer, memory + BLOCK_ADDRESS, BLOCK_SIZE));
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "eeprom_bulk_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_bulk) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * AT24CM01 ready polls: the reads after the write cycle start without the ACK
+ * polling, the I2C transactions and the ready polls per RecordDB::load() and
+ * per record save are printed.
+ */
+
+#include "host.h"
+#include "settings.h"
+#include "at24cm01.h"
+#include "RecordDB.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+
+
+static const uint32_t RECORDS_COUNT = 300;
+static const uint32_t SAVES_COUNT   = 100;
+// Every 7th record is loaded: the loads go through the clusters and the page cache
+static const uint32_t LOAD_STEP     = 7;
+
+
+static void boot_polls()
+{
+	settings.sleep_time = RECORD_PERIOD_MS;
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+	for (uint32_t i = 0; i < RECORDS_COUNT; i++) {
+		RecordDB record(0);
+		record.record.level = static_cast<int32_t>(i);
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+	}
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	{
+		RecordDB record(1);
+		HOST_CHECK(record.load() == RecordDB::RECORD_OK);
+	}
+
+	host_i2c_stats_t start = host_i2c_stats();
+	uint32_t polls = eeprom_get_stats()->polls;
+	uint32_t loads = 0;
+	for (uint32_t id = 1; id <= RECORDS_COUNT; id += LOAD_STEP) {
+		RecordDB record(id);
+		HOST_CHECK(record.load() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == id);
+		loads++;
+	}
+	uint32_t loadTransactions = host_i2c_stats().transactions - start.transactions;
+	uint32_t loadPolls        = eeprom_get_stats()->polls - polls;
+	printf(
+		"load: %.2f I2C transactions (%.2f ready polls) per RecordDB::load\n",
+		(double)loadTransactions / loads,
+		(double)loadPolls / loads
+	);
+	// No write cycle before the reads
+	HOST_CHECK(loadPolls == 0);
+
+	start = host_i2c_stats();
+	polls = eeprom_get_stats()->polls;
+	for (uint32_t i = 0; i < SAVES_COUNT; i++) {
+		RecordDB record(0);
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+	}
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	printf(
+		"save: %.2f I2C transactions (%.2f ready polls) per record\n",
+		(double)(host_i2c_stats().transactions - start.transactions) / SAVES_COUNT,
+		(double)(eeprom_get_stats()->polls - polls) / SAVES_COUNT
+	);
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "eeprom_poll_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_polls) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
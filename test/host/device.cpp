@@ -0,0 +1,17 @@
+/* The storage objects of main.cpp */
+
+#include "RecordDB.h"
+#include "StorageAT.h"
+#include "StorageDriver.h"
+
+
+StorageDriver storageDriver;
+StorageAT storage(
+#if RECORD_DB_RING_LOG
+	(eeprom_get_size() - RECORD_LOG_SIZE) / STORAGE_PAGE_SIZE,
+#else
+	eeprom_get_size() / STORAGE_PAGE_SIZE,
+#endif
+	&storageDriver,
+	EEPROM_PAGE_SIZE
+);
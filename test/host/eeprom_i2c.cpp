@@ -0,0 +1,246 @@
+/* Host test stand-in of the AT24CM01 on I2C1: the HAL calls of at24cm01.c work on the image file */
+
+#include "host.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "main.h"
+#include "system.h"
+#include "at24cm01.h"
+
+
+#define HOST_EEPROM_SIZE    (EEPROM_PAGES_COUNT * EEPROM_PAGE_SIZE)
+#define HOST_BYTE_US        (23)
+#define HOST_TRANSACTION_US (10)
+#define HOST_WRITE_CYCLE_US (5000)
+
+
+// The interrupt enable bits of the transfers are kept in the registers
+static I2C_TypeDef host_i2c_regs = {};
+I2C_HandleTypeDef hi2c1 = { &host_i2c_regs };
+
+static uint8_t  host_eeprom[HOST_EEPROM_SIZE];
+static int      host_fd          = -1;
+static int64_t  host_tear_bytes  = -1;
+static int64_t  host_tear_page   = -1;
+static uint32_t host_tear_erased = 0;
+static uint64_t host_us          = 0;
+static uint64_t host_busy_us     = 0;
+static bool     host_hang        = false;
+static bool     host_hung        = false;
+static host_i2c_stats_t host_stats = {};
+
+
+static void _host_eeprom_load()
+{
+	HOST_CHECK(pread(host_fd, host_eeprom, sizeof(host_eeprom), 0) == (ssize_t)sizeof(host_eeprom));
+}
+
+static void _host_bus_spend(uint32_t bytes)
+{
+	host_stats.transactions++;
+	host_us += HOST_TRANSACTION_US + bytes * HOST_BYTE_US;
+}
+
+static uint32_t _host_address(uint16_t dev_addr, uint16_t mem_addr)
+{
+	return ((uint32_t)((dev_addr >> 1) & 0x01) << 16) | mem_addr;
+}
+
+void host_eeprom_open(const char* path, bool erase)
+{
+	host_fd = open(path, O_RDWR | O_CREAT, 0644);
+	HOST_CHECK(host_fd >= 0);
+	if (erase || lseek(host_fd, 0, SEEK_END) != (off_t)sizeof(host_eeprom)) {
+		memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+		HOST_CHECK(ftruncate(host_fd, 0) == 0);
+		HOST_CHECK(pwrite(host_fd, host_eeprom, sizeof(host_eeprom), 0) == (ssize_t)sizeof(host_eeprom));
+	}
+	_host_eeprom_load();
+}
+
+void host_eeprom_tear(uint32_t bytes)
+{
+	host_tear_bytes = bytes;
+}
+
+void host_eeprom_tear_page(uint32_t address, uint32_t bytes)
+{
+	host_tear_page   = address - address % EEPROM_PAGE_SIZE;
+	host_tear_erased = bytes;
+}
+
+void host_i2c_hang()
+{
+	host_hang = true;
+}
+
+host_i2c_stats_t host_i2c_stats()
+{
+	return host_stats;
+}
+
+void host_delay_ms(uint32_t ms)
+{
+	host_us += (uint64_t)ms * 1000;
+}
+
+host_boot_status_t host_boot(void (*boot)(void))
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	HOST_CHECK(pid >= 0);
+	if (!pid) {
+		_host_eeprom_load();
+		memset(&host_stats, 0, sizeof(host_stats));
+		boot();
+		fflush(stdout);
+		_exit(HOST_BOOT_OK);
+	}
+
+	int status = 0;
+	HOST_CHECK(waitpid(pid, &status, 0) == pid);
+	if (!WIFEXITED(status)) {
+		return HOST_BOOT_FAILED;
+	}
+	return (host_boot_status_t)WEXITSTATUS(status);
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return (uint32_t)(host_us / 1000);
+}
+
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef*, uint16_t, uint32_t, uint32_t)
+{
+	if (host_hung) {
+		return HAL_BUSY;
+	}
+	_host_bus_spend(1);
+	return host_us < host_busy_us ? HAL_ERROR : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef*, uint16_t dev_addr, uint16_t mem_addr, uint16_t, uint8_t* data, uint16_t len, uint32_t)
+{
+	if (host_hung) {
+		return HAL_BUSY;
+	}
+	_host_bus_spend(3 + len);
+	if (host_us < host_busy_us) {
+		// No ACK in the write cycle
+		return HAL_ERROR;
+	}
+
+	// The address rolls over inside the 64 KB block
+	uint32_t address = _host_address(dev_addr, mem_addr);
+	for (uint32_t i = 0; i < len; i++) {
+		data[i] = host_eeprom[(address & 0x10000) | ((address + i) & 0xFFFF)];
+	}
+	host_stats.read_bytes += len;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef*, uint16_t dev_addr, uint16_t mem_addr, uint16_t, uint8_t* data, uint16_t len, uint32_t)
+{
+	if (host_hung) {
+		return HAL_BUSY;
+	}
+	_host_bus_spend(2 + len);
+	if (host_us < host_busy_us) {
+		return HAL_ERROR;
+	}
+
+	// The address rolls over inside the page
+	uint32_t address = _host_address(dev_addr, mem_addr);
+	uint32_t page    = address - address % EEPROM_PAGE_SIZE;
+	bool     torn    = host_tear_bytes >= 0 && host_tear_bytes < len;
+	uint32_t count   = torn ? (uint32_t)host_tear_bytes : len;
+	if (host_tear_page == (int64_t)page && host_tear_erased < len) {
+		// The write cycle is interrupted after the erase: the bytes not programmed stay 0xFF
+		torn  = true;
+		count = host_tear_erased;
+		for (uint32_t i = count; i < len; i++) {
+			uint32_t target = page + (address + i) % EEPROM_PAGE_SIZE;
+			host_eeprom[target] = 0xFF;
+			HOST_CHECK(pwrite(host_fd, &host_eeprom[target], 1, target) == 1);
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t target = page + (address + i) % EEPROM_PAGE_SIZE;
+		host_eeprom[target] = data[i];
+		HOST_CHECK(pwrite(host_fd, &host_eeprom[target], 1, target) == 1);
+	}
+	if (torn) {
+		fflush(stdout);
+		_exit(HOST_BOOT_POWER_LOSS);
+	}
+	if (host_tear_bytes >= 0) {
+		host_tear_bytes -= len;
+	}
+
+	host_busy_us = host_us + HOST_WRITE_CYCLE_US;
+	host_stats.write_bytes += len;
+	host_stats.page_writes++;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read_IT(I2C_HandleTypeDef* hi2c, uint16_t dev_addr, uint16_t mem_addr, uint16_t mem_size, uint8_t* data, uint16_t len)
+{
+	if (host_hung) {
+		return HAL_BUSY;
+	}
+	if (host_hang) {
+		// No interrupt comes until the I2C reset
+		host_hang = false;
+		host_hung = true;
+		return HAL_OK;
+	}
+	// The transfer interrupt comes at once
+	if (HAL_I2C_Mem_Read(hi2c, dev_addr, mem_addr, mem_size, data, len, 0) == HAL_OK) {
+		HAL_I2C_MemRxCpltCallback(hi2c);
+	} else {
+		HAL_I2C_ErrorCallback(hi2c);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write_IT(I2C_HandleTypeDef* hi2c, uint16_t dev_addr, uint16_t mem_addr, uint16_t mem_size, uint8_t* data, uint16_t len)
+{
+	if (host_hung) {
+		return HAL_BUSY;
+	}
+	if (host_hang) {
+		host_hang = false;
+		host_hung = true;
+		return HAL_OK;
+	}
+	if (HAL_I2C_Mem_Write(hi2c, dev_addr, mem_addr, mem_size, data, len, 0) == HAL_OK) {
+		HAL_I2C_MemTxCpltCallback(hi2c);
+	} else {
+		HAL_I2C_ErrorCallback(hi2c);
+	}
+	return HAL_OK;
+}
+
+HAL_I2C_StateTypeDef HAL_I2C_GetState(I2C_HandleTypeDef*)
+{
+	return host_hung ? HAL_I2C_STATE_BUSY : HAL_I2C_STATE_READY;
+}
+
+void system_reset_i2c_errata(void)
+{
+	// The stopped transfer ends with the error interrupt as in the HAL abort
+	if (host_hung) {
+		host_hung = false;
+		HAL_I2C_ErrorCallback(&hi2c1);
+	}
+	host_stats.resets++;
+}
+
+uint32_t HAL_I2C_GetError(I2C_HandleTypeDef*)
+{
+	return HAL_I2C_ERROR_NONE;
+}
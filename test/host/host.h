@@ -0,0 +1,56 @@
+/*
+ * Host test support: the AT24CM01 on I2C1 is a memory image kept in a file,
+ * every boot of the device runs in a child process, so the RAM starts clean
+ * and only the EEPROM image goes to the next boot.
+ */
+
+#pragma once
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define HOST_CHECK(condition) do { \
+		if (!(condition)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			fflush(stdout); \
+			exit(HOST_BOOT_FAILED); \
+		} \
+	} while (0)
+
+
+typedef enum _host_boot_status_t {
+	HOST_BOOT_OK = 0,
+	HOST_BOOT_FAILED,
+	HOST_BOOT_POWER_LOSS
+} host_boot_status_t;
+
+typedef struct _host_i2c_stats_t {
+	uint32_t transactions; // Memory reads, memory writes and ready polls
+	uint32_t read_bytes;
+	uint32_t write_bytes;
+	uint32_t page_writes;
+	uint32_t resets;       // system_reset_i2c_errata() calls
+} host_i2c_stats_t;
+
+
+// Opens the EEPROM image file, the erased image (0xFF) is written if erase or if there is no file
+void host_eeprom_open(const char* path, bool erase);
+// The power is lost after `bytes` more written bytes: the write is torn and the boot ends
+void host_eeprom_tear(uint32_t bytes);
+// The power is lost in the write cycle of the next write to the page of `address`:
+// `bytes` bytes are written, the other written bytes are left erased (0xFF)
+void host_eeprom_tear_page(uint32_t address, uint32_t bytes);
+
+// The next IT transfer starts and never ends: the I2C stays busy until system_reset_i2c_errata()
+void host_i2c_hang();
+// I2C counters since the boot start
+host_i2c_stats_t host_i2c_stats();
+// The I2C time is 23 us per byte (400 kHz) and 5 ms per write cycle, HAL_GetTick() follows it
+void host_delay_ms(uint32_t ms);
+
+// Runs one boot of the device in a child process
+host_boot_status_t host_boot(void (*boot)(void));
@@ -0,0 +1,126 @@
+/*
+ * Host test stand-in of StorageAT: a page keeps the header (magic, prefix, ID)
+ * and STORAGE_PAGE_PAYLOAD_SIZE bytes of data, find() scans the page headers.
+ */
+
+#include "StorageAT.h"
+
+#include <string.h>
+
+
+#define STORAGE_MAGIC       ((uint8_t)0x5A)
+#define STORAGE_PREFIX_SIZE (4)
+#define STORAGE_HEADER_SIZE (STORAGE_PAGE_SIZE - STORAGE_PAGE_PAYLOAD_SIZE)
+
+
+typedef struct __attribute__((packed)) _storage_header_t {
+	uint8_t  magic;
+	char     prefix[STORAGE_PREFIX_SIZE];
+	uint32_t id;
+} storage_header_t;
+
+
+StorageAT::StorageAT(uint32_t pagesCount, IStorageDriver* driver, uint32_t):
+	m_pagesCount(pagesCount), m_driver(driver)
+{}
+
+StorageStatus StorageAT::find(StorageFindMode mode, uint32_t* address, const char* prefix, uint32_t id)
+{
+	bool     found   = false;
+	uint32_t foundId = 0;
+	for (uint32_t page = 0; page < m_pagesCount; page++) {
+		storage_header_t header = {};
+		StorageStatus status = m_driver->read(page * STORAGE_PAGE_SIZE, reinterpret_cast<uint8_t*>(&header), sizeof(header));
+		if (status != STORAGE_OK) {
+			return status;
+		}
+
+		bool used = header.magic == STORAGE_MAGIC;
+		if (mode == FIND_MODE_EMPTY) {
+			if (!used) {
+				*address = page * STORAGE_PAGE_SIZE;
+				return STORAGE_OK;
+			}
+			continue;
+		}
+		if (!used || (prefix[0] && strncmp(header.prefix, prefix, STORAGE_PREFIX_SIZE))) {
+			continue;
+		}
+
+		bool better = false;
+		switch (mode) {
+		case FIND_MODE_EQUAL:
+			better = header.id == id;
+			break;
+		case FIND_MODE_NEXT:
+			better = header.id > id && (!found || header.id < foundId);
+			break;
+		case FIND_MODE_MIN:
+			better = !found || header.id < foundId;
+			break;
+		case FIND_MODE_MAX:
+			better = !found || header.id > foundId;
+			break;
+		default:
+			break;
+		}
+		if (better) {
+			found    = true;
+			foundId  = header.id;
+			*address = page * STORAGE_PAGE_SIZE;
+		}
+		if (found && mode == FIND_MODE_EQUAL) {
+			break;
+		}
+	}
+	return found ? STORAGE_OK : STORAGE_NOT_FOUND;
+}
+
+StorageStatus StorageAT::load(uint32_t address, uint8_t* data, uint32_t len)
+{
+	uint8_t page[STORAGE_PAGE_SIZE] = {};
+	if (len > STORAGE_PAGE_PAYLOAD_SIZE) {
+		return STORAGE_OOM;
+	}
+	StorageStatus status = m_driver->read(address, page, sizeof(page));
+	if (status != STORAGE_OK) {
+		return status;
+	}
+	if (reinterpret_cast<storage_header_t*>(page)->magic != STORAGE_MAGIC) {
+		return STORAGE_NOT_FOUND;
+	}
+	memcpy(data, page + STORAGE_HEADER_SIZE, len);
+	return STORAGE_OK;
+}
+
+StorageStatus StorageAT::save(uint32_t address, const char* prefix, uint32_t id, uint8_t* data, uint32_t len)
+{
+	return rewrite(address, prefix, id, data, len);
+}
+
+StorageStatus StorageAT::rewrite(uint32_t address, const char* prefix, uint32_t id, uint8_t* data, uint32_t len)
+{
+	uint8_t page[STORAGE_PAGE_SIZE] = {};
+	if (len > STORAGE_PAGE_PAYLOAD_SIZE || address / STORAGE_PAGE_SIZE >= m_pagesCount) {
+		return STORAGE_OOM;
+	}
+	storage_header_t* header = reinterpret_cast<storage_header_t*>(page);
+	header->magic = STORAGE_MAGIC;
+	strncpy(header->prefix, prefix, STORAGE_PREFIX_SIZE);
+	header->id    = id;
+	memcpy(page + STORAGE_HEADER_SIZE, data, len);
+	return m_driver->write(address, page, sizeof(page));
+}
+
+StorageStatus StorageAT::format()
+{
+	uint8_t page[STORAGE_PAGE_SIZE];
+	memset(page, 0xFF, sizeof(page));
+	for (uint32_t i = 0; i < m_pagesCount; i++) {
+		StorageStatus status = m_driver->write(i * STORAGE_PAGE_SIZE, page, sizeof(page));
+		if (status != STORAGE_OK) {
+			return status;
+		}
+	}
+	return STORAGE_OK;
+}
@@ -0,0 +1,145 @@
+/* Host test stand-ins of the Utils log and timers, the system CRC and serial and the DS1307 */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "main.h"
+#include "glog.h"
+#include "gutils.h"
+#include "system.h"
+#include "ds1307_driver.h"
+
+
+#define HOST_CRC_POLY  (0x04C11DB7)
+#define HOST_BASE_YEAR (2024)
+
+
+static const uint8_t host_month_days[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+
+void printTagLog(const char* tag, const char* format, ...)
+{
+	if (!getenv("HOST_LOG")) {
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	printf("%s: ", tag);
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+}
+
+void printPretty(const char*, ...) {}
+
+void gprint(const char* format, ...)
+{
+	if (!getenv("HOST_LOG")) {
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+void util_old_timer_start(util_old_timer_t* timer, uint32_t delay)
+{
+	timer->start = HAL_GetTick();
+	timer->delay = delay;
+}
+
+bool util_old_timer_wait(util_old_timer_t* timer)
+{
+	return HAL_GetTick() - timer->start < timer->delay;
+}
+
+uint32_t system_crc32(uint32_t crc, const void* data, uint32_t len)
+{
+	// The software path of system.c: CRC-32/MPEG-2 bit order, the state is kept inverted
+	const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+	uint32_t state = ~crc;
+	for (uint32_t i = 0; i < len; i++) {
+		state ^= (uint32_t)ptr[i] << 24;
+		for (unsigned bit = 0; bit < BITS_IN_BYTE; bit++) {
+			state = (state & 0x80000000) ? (state << 1) ^ HOST_CRC_POLY : state << 1;
+		}
+	}
+	return ~state;
+}
+
+char* get_system_serial_str(void)
+{
+	static char serial[] = "HOST";
+	return serial;
+}
+
+// The DS1307 counts from the start of 2024 by HAL_GetTick(), the time is not set
+static uint32_t _host_seconds()
+{
+	return HAL_GetTick() / 1000;
+}
+
+static uint32_t _host_days()
+{
+	return _host_seconds() / (24 * 60 * 60);
+}
+
+static uint32_t _host_year_days(uint16_t year)
+{
+	return (year % 4) ? 365 : 366;
+}
+
+static uint32_t _host_month_days(uint16_t year, uint8_t month)
+{
+	return (month == 1 && (year % 4)) ? 28 : host_month_days[month];
+}
+
+static void _host_date(uint16_t* year, uint8_t* month, uint8_t* date)
+{
+	uint32_t days = _host_days();
+	for (*year = HOST_BASE_YEAR; days >= _host_year_days(*year); (*year)++) {
+		days -= _host_year_days(*year);
+	}
+	for (*month = 0; days >= _host_month_days(*year, *month); (*month)++) {
+		days -= _host_month_days(*year, *month);
+	}
+	(*month)++;
+	*date = (uint8_t)(days + 1);
+}
+
+uint16_t DS1307_GetYear(void)
+{
+	uint16_t year = 0;
+	uint8_t  month = 0, date = 0;
+	_host_date(&year, &month, &date);
+	return year;
+}
+
+uint8_t DS1307_GetMonth(void)
+{
+	uint16_t year = 0;
+	uint8_t  month = 0, date = 0;
+	_host_date(&year, &month, &date);
+	return month;
+}
+
+uint8_t DS1307_GetDate(void)
+{
+	uint16_t year = 0;
+	uint8_t  month = 0, date = 0;
+	_host_date(&year, &month, &date);
+	return date;
+}
+
+uint8_t DS1307_GetHour(void)   { return (uint8_t)(_host_seconds() / 3600 % 24); }
+uint8_t DS1307_GetMinute(void) { return (uint8_t)(_host_seconds() / 60 % 60); }
+uint8_t DS1307_GetSecond(void) { return (uint8_t)(_host_seconds() % 60); }
+
+void DS1307_SetYear(uint16_t) {}
+void DS1307_SetMonth(uint8_t) {}
+void DS1307_SetDate(uint8_t) {}
+void DS1307_SetHour(uint8_t) {}
+void DS1307_SetMinute(uint8_t) {}
+void DS1307_SetSecond(uint8_t) {}
@@ -0,0 +1,173 @@
+/*
+ * RecordDB fast mount (RECORD_DB_FAST_MOUNT): the index is restored from the
+ * directory after RecordDB::unmount(), rebuilt after a dirty shutdown and
+ * after a torn unmount, I2C traffic and bus time of both paths.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "host.h"
+#include "settings.h"
+#include "RecordDB.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+
+
+static const uint32_t RECORDS_COUNT = 1000;
+
+static uint32_t lastId   = 0;
+static uint32_t tearSize = 0;
+
+
+
+typedef struct _mount_result_t {
+	host_i2c_stats_t stats;
+	uint32_t         ms;
+} mount_result_t;
+
+// The boots run in child processes: the results are kept in the shared memory
+static mount_result_t* cleanResult = nullptr;
+static mount_result_t* dirtyResult = nullptr;
+
+
+static mount_result_t boot_mount()
+{
+	settings.sleep_time = RECORD_PERIOD_MS;
+	host_i2c_stats_t start = host_i2c_stats();
+	uint32_t tick = HAL_GetTick();
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+
+	mount_result_t result = {};
+	host_i2c_stats_t stats = host_i2c_stats();
+	result.stats.transactions = stats.transactions - start.transactions;
+	result.stats.read_bytes   = stats.read_bytes - start.read_bytes;
+	result.stats.write_bytes  = stats.write_bytes - start.write_bytes;
+	result.stats.page_writes  = stats.page_writes - start.page_writes;
+	result.ms = HAL_GetTick() - tick;
+	return result;
+}
+
+static void save_records(uint32_t count)
+{
+	// The saved IDs are counted by the parent process after the boot
+	for (uint32_t id = lastId + 1; id <= lastId + count; id++) {
+		RecordDB record(0);
+		record.record.level = id;
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == id);
+	}
+}
+
+static void check_log()
+{
+	// Every saved record is found by its ID through the index
+	for (uint32_t id = 1; id <= lastId; id += 37) {
+		RecordDB record(id);
+		HOST_CHECK(record.load() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == id && record.record.level == static_cast<int32_t>(id));
+	}
+	RecordDB last(lastId);
+	HOST_CHECK(last.load() == RecordDB::RECORD_OK);
+	RecordDB next(lastId);
+	HOST_CHECK(next.loadNext() != RecordDB::RECORD_OK);
+}
+
+static void print_mount(const char* path, const mount_result_t& result)
+{
+	printf(
+		"%s mount: %lu ms, %lu I2C transactions, %lu read bytes, %lu page writes\n",
+		path,
+		(unsigned long)result.ms,
+		(unsigned long)result.stats.transactions,
+		(unsigned long)result.stats.read_bytes,
+		(unsigned long)result.stats.page_writes
+	);
+}
+
+static void boot_save()
+{
+	boot_mount();
+	save_records(RECORDS_COUNT);
+	HOST_CHECK(RecordDB::unmount() == RecordDB::RECORD_OK);
+}
+
+static void boot_clean()
+{
+	mount_result_t result = boot_mount();
+	print_mount("clean", result);
+	check_log();
+	*cleanResult = result;
+	// The shutdown stays clean without new records
+	HOST_CHECK(RecordDB::unmount() == RecordDB::RECORD_OK);
+	HOST_CHECK(host_i2c_stats().page_writes == 0);
+}
+
+static void boot_write_dirty()
+{
+	boot_mount();
+	// The first write clears the clean shutdown mark, no RecordDB::unmount() after it
+	save_records(RECORDS_COUNT / 10);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+}
+
+static void boot_dirty()
+{
+	mount_result_t result = boot_mount();
+	print_mount("dirty", result);
+	check_log();
+	*dirtyResult = result;
+	HOST_CHECK(RecordDB::unmount() == RecordDB::RECORD_OK);
+}
+
+static void boot_torn_unmount()
+{
+	boot_mount();
+	save_records(1);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	host_eeprom_tear(tearSize);
+	HOST_CHECK(RecordDB::unmount() == RecordDB::RECORD_OK);
+}
+
+static void boot_check()
+{
+	boot_mount();
+	check_log();
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "mount_test.eeprom", true);
+	void* shared = mmap(nullptr, 2 * sizeof(mount_result_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	HOST_CHECK(shared != MAP_FAILED);
+	cleanResult = static_cast<mount_result_t*>(shared);
+	dirtyResult = cleanResult + 1;
+
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	lastId += RECORDS_COUNT;
+	HOST_CHECK(host_boot(boot_clean) == HOST_BOOT_OK);
+	HOST_CHECK(host_boot(boot_clean) == HOST_BOOT_OK);
+
+	HOST_CHECK(host_boot(boot_write_dirty) == HOST_BOOT_OK);
+	lastId += RECORDS_COUNT / 10;
+	HOST_CHECK(host_boot(boot_dirty) == HOST_BOOT_OK);
+	HOST_CHECK(host_boot(boot_clean) == HOST_BOOT_OK);
+	// The clean mount reads the summary and the directory instead of the clusters
+	HOST_CHECK(cleanResult->stats.read_bytes * 4 < dirtyResult->stats.read_bytes);
+	HOST_CHECK(cleanResult->ms < dirtyResult->ms);
+
+	// The directory and the summary are torn at every written byte: the next mount
+	// restores the index or rebuilds it, no record is lost
+	for (tearSize = 0; host_boot(boot_torn_unmount) == HOST_BOOT_POWER_LOSS; tearSize++) {
+		lastId++;
+		HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	}
+	lastId++;
+	HOST_CHECK(tearSize > 0);
+	HOST_CHECK(host_boot(boot_clean) == HOST_BOOT_OK);
+	printf("torn unmount: %lu power loss points\n", (unsigned long)tearSize);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * StorageDriver page cache: the main loop cycle of the device (the settings
+ * check, a new record, the upload of the next records) runs with the
+ * settings journal and the record clusters in the memory, the I2C bytes read
+ * per cycle and the cache counters are printed.
+ * The test is also built with a single cached page.
+ */
+
+#include <string.h>
+
+#include "host.h"
+#include "settings.h"
+#include "RecordDB.h"
+#include "SettingsDB.h"
+#include "StorageDriver.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+#define CYCLES_COUNT     (2000)
+// Records sent to the server per cycle
+#define UPLOAD_COUNT     (2)
+
+
+static SettingsDB settings_db()
+{
+	return SettingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
+}
+
+static void boot_cycles()
+{
+	settings_repair(&settings);
+	settings.sleep_time = RECORD_PERIOD_MS;
+	// Both journal slots are written
+	HOST_CHECK(settings_db().save() == SETTINGS_OK);
+	HOST_CHECK(settings_db().save() == SETTINGS_OK);
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+
+	StorageDriver::cacheHits      = 0;
+	StorageDriver::cacheMisses    = 0;
+	StorageDriver::cacheEvictions = 0;
+	host_i2c_stats_t start = host_i2c_stats();
+
+	uint32_t serverId      = 0;
+	uint32_t settingsBytes = 0;
+	uint32_t uploadBytes   = 0;
+	for (uint32_t i = 0; i < CYCLES_COUNT; i++) {
+		// The settings watchdog
+		uint32_t readBytes = host_i2c_stats().read_bytes;
+		HOST_CHECK(settings_db().load() == SETTINGS_OK);
+		if (i) {
+			// The first load after the mount fills the cache
+			settingsBytes += host_i2c_stats().read_bytes - readBytes;
+		}
+
+		RecordDB record(0);
+		record.record.level = static_cast<int32_t>(i);
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+
+		readBytes = host_i2c_stats().read_bytes;
+
+		// The upload reads the records after the last one acknowledged by the server
+		for (uint32_t j = 0; j < UPLOAD_COUNT; j++) {
+			RecordDB next(serverId);
+			if (next.loadNext() == RecordDB::RECORD_OK) {
+				serverId = next.record.id;
+			}
+		}
+		uploadBytes += host_i2c_stats().read_bytes - readBytes;
+		HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	}
+	HOST_CHECK(serverId == CYCLES_COUNT);
+
+	host_i2c_stats_t stats = host_i2c_stats();
+	uint32_t requests = StorageDriver::cacheHits + StorageDriver::cacheMisses;
+	printf(
+		"%u cached pages: %u I2C bytes read per cycle (settings %u, upload %u), %u%% hits, %u evictions\n",
+		STORAGE_DRIVER_CACHE_SIZE,
+		(stats.read_bytes - start.read_bytes) / CYCLES_COUNT,
+		settingsBytes / CYCLES_COUNT,
+		uploadBytes / CYCLES_COUNT,
+		requests ? static_cast<unsigned>(StorageDriver::cacheHits * 100 / requests) : 0,
+		static_cast<unsigned>(StorageDriver::cacheEvictions)
+	);
+#if STORAGE_DRIVER_CACHE_SIZE > 2
+	// Both settings slots stay cached next to the record cluster: the new clusters evict the old ones
+	HOST_CHECK(settingsBytes == 0);
+#endif
+	HOST_CHECK(uploadBytes == 0);
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "page_cache_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_cycles) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * CRC-protected clusters (RECORD_DB_CRC): the clusters of the firmware before
+ * the CRC are read and get the CRC on the next write, a broken cluster is not read.
+ */
+
+#include <string.h>
+
+#include "host.h"
+#include "settings.h"
+#include "StorageAT.h"
+#include "RecordDB.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+
+
+// The cluster layout before the CRC: the magic and the records
+typedef struct __attribute__((packed)) _legacy_clust_t {
+	uint8_t          record_magic;
+	RecordDB::Record records[(STORAGE_PAGE_PAYLOAD_SIZE - sizeof(uint8_t)) / sizeof(RecordDB::Record)];
+} legacy_clust_t;
+
+static const uint32_t LEGACY_COUNT  = 3 * (sizeof(legacy_clust_t::records) / sizeof(RecordDB::Record)) - 4;
+static const uint32_t RECORDS_COUNT = 10;
+
+
+extern StorageAT storage;
+
+
+static uint32_t lastId = 0;
+
+
+static void boot_start()
+{
+	settings.sleep_time = RECORD_PERIOD_MS;
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+}
+
+static void check_log(uint32_t last)
+{
+	for (uint32_t id = 1; id <= last; id++) {
+		RecordDB record(id);
+		HOST_CHECK(record.load() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == id && record.record.level == static_cast<int32_t>(id));
+	}
+	RecordDB next(last);
+	HOST_CHECK(next.loadNext() != RecordDB::RECORD_OK);
+}
+
+static uint8_t page_magic(uint32_t address)
+{
+	uint8_t magic = 0;
+	HOST_CHECK(storage.load(address, &magic, sizeof(magic)) == STORAGE_OK);
+	return magic;
+}
+
+static void boot_legacy()
+{
+	// The clusters as the previous firmware saved them: the header ID is the last record ID
+	legacy_clust_t clust = {};
+	uint32_t address = 0;
+	for (uint32_t id = 1; id <= LEGACY_COUNT; id++) {
+		uint32_t idx = (id - 1) % __arr_len(clust.records);
+		clust.record_magic = sizeof(RecordDB::Record);
+		clust.records[idx].id    = id;
+		clust.records[idx].level = static_cast<int32_t>(id);
+		if (idx == __arr_len(clust.records) - 1 || id == LEGACY_COUNT) {
+			HOST_CHECK(storage.rewrite(address, "RCR", id, reinterpret_cast<uint8_t*>(&clust), sizeof(clust)) == STORAGE_OK);
+			address += STORAGE_PAGE_SIZE;
+			memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+		}
+	}
+}
+
+static void boot_check()
+{
+	boot_start();
+	check_log(lastId);
+}
+
+static void boot_save()
+{
+	boot_start();
+	for (uint32_t i = 0; i < RECORDS_COUNT; i++) {
+		RecordDB record(0);
+		record.record.level = static_cast<int32_t>(lastId + i + 1);
+		HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+		HOST_CHECK(record.record.id == lastId + i + 1);
+	}
+	HOST_CHECK(RecordDB::unmount() == RecordDB::RECORD_OK);
+}
+
+static void boot_check_upgraded()
+{
+	boot_start();
+	check_log(lastId);
+	// The last legacy cluster is written again with the CRC, the full ones stay as they were
+	HOST_CHECK(page_magic(0) == sizeof(RecordDB::Record));
+	HOST_CHECK(page_magic(2 * STORAGE_PAGE_SIZE) != sizeof(RecordDB::Record));
+}
+
+static void boot_broken()
+{
+	// A flipped byte of the upgraded cluster: its records are not read
+	uint8_t page[STORAGE_PAGE_PAYLOAD_SIZE] = {};
+	HOST_CHECK(storage.load(2 * STORAGE_PAGE_SIZE, page, sizeof(page)) == STORAGE_OK);
+	page[sizeof(page) / 2] ^= 0x01;
+	HOST_CHECK(storage.rewrite(2 * STORAGE_PAGE_SIZE, "RCR", LEGACY_COUNT + 4, page, sizeof(page)) == STORAGE_OK);
+
+	boot_start();
+	RecordDB broken(LEGACY_COUNT);
+	HOST_CHECK(broken.load() != RecordDB::RECORD_OK);
+	RecordDB legacy(1);
+	HOST_CHECK(legacy.load() == RecordDB::RECORD_OK);
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "record_crc_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_legacy) == HOST_BOOT_OK);
+	lastId = LEGACY_COUNT;
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	lastId += RECORDS_COUNT;
+	HOST_CHECK(host_boot(boot_check_upgraded) == HOST_BOOT_OK);
+
+	HOST_CHECK(host_boot(boot_broken) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Ring log (RECORD_DB_RING_LOG): the write head is found again after a reboot,
+ * a torn append loses only its own records, a torn slot re-open after the wrap
+ * keeps the log, the format drops the log, I2C traffic per saved record.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "host.h"
+#include "settings.h"
+#include "RecordDB.h"
+#include "StorageAT.h"
+#include "at24cm01.h"
+
+
+#define RECORD_PERIOD_MS (15 * 60 * 1000)
+
+
+extern StorageAT storage;
+
+
+static const uint32_t RECORDS_COUNT = 300;
+// More than the ring log keeps
+static const uint32_t WRAP_COUNT    = 2000;
+
+static uint32_t lastId    = 0;
+static uint32_t saveCount = RECORDS_COUNT;
+static uint32_t tearSize  = 0;
+// The last record committed before the power loss: the boots run in child processes
+static uint32_t* committedId = nullptr;
+
+
+static void boot_start()
+{
+	settings.sleep_time = RECORD_PERIOD_MS;
+	HOST_CHECK(RecordDB::mount() == RecordDB::RECORD_OK);
+}
+
+static uint32_t save_record(uint32_t level)
+{
+	RecordDB record(0);
+	record.record.level = level;
+	HOST_CHECK(record.save() == RecordDB::RECORD_OK);
+	return record.record.id;
+}
+
+static uint32_t check_log(uint32_t last)
+{
+	// IDs follow each other from the oldest kept record: nothing lost, nothing repeated
+	RecordDB first(0);
+	HOST_CHECK(first.loadNext() == RecordDB::RECORD_OK);
+	uint32_t id = first.record.id - 1;
+	while (true) {
+		RecordDB record(id);
+		if (record.loadNext() != RecordDB::RECORD_OK) {
+			break;
+		}
+		HOST_CHECK(record.record.id == id + 1);
+		HOST_CHECK(record.record.level == static_cast<int32_t>(record.record.id));
+		id = record.record.id;
+	}
+	HOST_CHECK(id == last);
+	return first.record.id;
+}
+
+static void boot_save()
+{
+	boot_start();
+	for (uint32_t i = 0; i < saveCount; i++) {
+		host_delay_ms(RECORD_PERIOD_MS);
+		HOST_CHECK(save_record(lastId + i + 1) == lastId + i + 1);
+		RecordDB::update();
+	}
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+
+	host_i2c_stats_t stats = host_i2c_stats();
+	printf(
+		"save: %lu records, %.1f written bytes, %.2f page writes, %.1f I2C transactions per record\n",
+		(unsigned long)saveCount,
+		(double)stats.write_bytes / saveCount,
+		(double)stats.page_writes / saveCount,
+		(double)stats.transactions / saveCount
+	);
+}
+
+static void boot_check()
+{
+	boot_start();
+	HOST_CHECK(check_log(lastId) == 1);
+}
+
+static void boot_check_wrapped()
+{
+	boot_start();
+	uint32_t first = check_log(lastId);
+	HOST_CHECK(first > 1);
+	printf("wrapped: records %lu..%lu are kept\n", (unsigned long)first, (unsigned long)lastId);
+}
+
+static void boot_torn()
+{
+	boot_start();
+	// The first record is committed, the append of the second one is torn
+	HOST_CHECK(save_record(lastId + 1) == lastId + 1);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	HOST_CHECK(save_record(lastId + 2) == lastId + 2);
+	host_eeprom_tear(tearSize);
+	RecordDB::flush();
+}
+
+static void boot_after_torn()
+{
+	boot_start();
+	check_log(lastId + 1);
+	RecordDB lost(lastId + 2);
+	HOST_CHECK(lost.load() != RecordDB::RECORD_OK);
+
+	// The next record takes the place of the lost one
+	HOST_CHECK(save_record(lastId + 2) == lastId + 2);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+}
+
+static uint32_t log_seq(uint32_t slot)
+{
+	// The slot sequence number is the first field of the slot
+	uint32_t seq = 0;
+	HOST_CHECK(eeprom_read(RECORD_LOG_ADDRESS + slot * RECORD_LOG_SLOT_SIZE, reinterpret_cast<uint8_t*>(&seq), sizeof(seq)) == EEPROM_OK);
+	return seq;
+}
+
+static void commit_record()
+{
+	HOST_CHECK(save_record(*committedId + 1) == *committedId + 1);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	(*committedId)++;
+}
+
+static void boot_torn_reopen()
+{
+	boot_start();
+	// The head leaves slot 0, the records fill the lap up to the re-open of slot 0
+	while (log_seq(1) != log_seq(0) + 1) {
+		commit_record();
+	}
+	host_eeprom_tear_page(RECORD_LOG_ADDRESS, tearSize);
+	while (true) {
+		commit_record();
+	}
+}
+
+static void boot_after_reopen()
+{
+	boot_start();
+	HOST_CHECK(check_log(*committedId) > 1);
+	commit_record();
+}
+
+static void boot_format()
+{
+	boot_start();
+	// As the format command: the ring log is out of the StorageAT area
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+	HOST_CHECK(storage.format() == STORAGE_OK);
+	HOST_CHECK(RecordDB::format() == RecordDB::RECORD_OK);
+	HOST_CHECK(settings.log_first_id == 0);
+	HOST_CHECK(save_record(1) == 1);
+	HOST_CHECK(RecordDB::flush() == RecordDB::RECORD_OK);
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "ring_log_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	lastId += RECORDS_COUNT;
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+
+	// The power is lost at every byte of the record bytes and their CRC
+	for (tearSize = 0; tearSize < sizeof(RecordDB::Record) + sizeof(uint32_t); tearSize++) {
+		HOST_CHECK(host_boot(boot_torn) == HOST_BOOT_POWER_LOSS);
+		HOST_CHECK(host_boot(boot_after_torn) == HOST_BOOT_OK);
+		lastId += 2;
+		HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	}
+
+	// The ring wraps around: the oldest slots are reused, the head is found after the wrap
+	saveCount = WRAP_COUNT;
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	lastId += WRAP_COUNT;
+	HOST_CHECK(host_boot(boot_check_wrapped) == HOST_BOOT_OK);
+	saveCount = RECORDS_COUNT;
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	lastId += RECORDS_COUNT;
+	HOST_CHECK(host_boot(boot_check_wrapped) == HOST_BOOT_OK);
+
+	// The re-open of slot 0 after the wrap is torn in the header and the first record:
+	// the head stays in the last slot, slot 0 is opened again by the next record
+	void* shared = mmap(nullptr, sizeof(*committedId), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	HOST_CHECK(shared != MAP_FAILED);
+	committedId  = static_cast<uint32_t*>(shared);
+	*committedId = lastId;
+	for (tearSize = 0; tearSize <= sizeof(uint32_t) + sizeof(RecordDB::Record) / 4; tearSize++) {
+		HOST_CHECK(host_boot(boot_torn_reopen) == HOST_BOOT_POWER_LOSS);
+		HOST_CHECK(host_boot(boot_after_reopen) == HOST_BOOT_OK);
+	}
+	lastId = *committedId;
+	HOST_CHECK(host_boot(boot_check_wrapped) == HOST_BOOT_OK);
+
+	// The formatted log starts from the first ID, the old slots are not found again
+	HOST_CHECK(host_boot(boot_format) == HOST_BOOT_OK);
+	lastId = 1;
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+
+	printf("OK\n");
+	return 0;
+}
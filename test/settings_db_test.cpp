@@ -0,0 +1,196 @@
+/*
+ * SettingsDB A/B journal: one page write per save, the previous settings
+ * after a torn write, the version 4 settings migration, a torn first journal
+ * save over the settings saved before the journal.
+ */
+
+#include <string.h>
+#include <stddef.h>
+
+#include "host.h"
+#include "system.h"
+#include "settings.h"
+#include "StorageAT.h"
+#include "SettingsDB.h"
+
+
+#define SAVES_COUNT (100)
+
+
+extern StorageAT storage;
+
+
+static uint32_t sleepTime = 0;
+static uint32_t tearSize  = 0;
+
+
+static SettingsDB settings_db()
+{
+	return SettingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size(), settings_prev_size());
+}
+
+static void boot_start()
+{
+	// The settings watchdog init state
+	SettingsDB settingsDB = settings_db();
+	memset(reinterpret_cast<void*>(&settings), 0, sizeof(settings));
+	SettingsStatus status = settingsDB.load();
+	if (status != SETTINGS_OK || !settings_check(&settings)) {
+		settings_repair(&settings);
+		HOST_CHECK(settingsDB.save() == SETTINGS_OK);
+	}
+}
+
+static void boot_first()
+{
+	boot_start();
+	HOST_CHECK(settings_check(&settings));
+}
+
+static void boot_save()
+{
+	boot_start();
+	HOST_CHECK(settings.sleep_time == sleepTime);
+
+	// The second slot is placed by the first save
+	SettingsDB settingsDB = settings_db();
+	HOST_CHECK(settingsDB.save() == SETTINGS_OK);
+
+	host_i2c_stats_t start = host_i2c_stats();
+	for (uint32_t i = 0; i < SAVES_COUNT; i++) {
+		settings.sleep_time = sleepTime + i + 1;
+		HOST_CHECK(settingsDB.save() == SETTINGS_OK);
+	}
+	host_i2c_stats_t stats = host_i2c_stats();
+	printf(
+		"save: %.2f page writes, %.1f I2C transactions (ready polls included), %.1f read bytes per save\n",
+		(double)(stats.page_writes - start.page_writes) / SAVES_COUNT,
+		(double)(stats.transactions - start.transactions) / SAVES_COUNT,
+		(double)(stats.read_bytes - start.read_bytes) / SAVES_COUNT
+	);
+	// Both slots are known after the mount: no page header scans
+	HOST_CHECK(stats.page_writes - start.page_writes == SAVES_COUNT);
+	HOST_CHECK(stats.read_bytes == start.read_bytes);
+}
+
+static void boot_check()
+{
+	boot_start();
+	HOST_CHECK(settings.sleep_time == sleepTime);
+}
+
+static void boot_torn()
+{
+	boot_start();
+	settings.sleep_time = sleepTime + 1;
+	host_eeprom_tear(tearSize);
+	HOST_CHECK(settings_db().save() == SETTINGS_OK);
+}
+
+static void boot_after_torn()
+{
+	// The slot of the torn write is skipped: the previous settings are loaded
+	boot_start();
+	HOST_CHECK(settings.sleep_time == sleepTime);
+	settings.sleep_time = sleepTime + 2;
+	HOST_CHECK(settings_db().save() == SETTINGS_OK);
+}
+
+static void boot_legacy()
+{
+	// A journal slot of the version 4 layout: without log_first_id
+	settings_t legacy = {};
+	settings_reset(&legacy);
+	legacy.sw_id      = 4;
+	legacy.sleep_time = sleepTime;
+
+	uint8_t  slot[STORAGE_PAGE_PAYLOAD_SIZE] = {};
+	uint32_t seq = 1;
+	memcpy(slot, &legacy, settings_prev_size());
+	memcpy(slot + settings_prev_size(), &seq, sizeof(seq));
+	uint32_t crc = system_crc32(0, slot, settings_prev_size() + sizeof(seq));
+	memcpy(slot + settings_prev_size() + sizeof(seq), &crc, sizeof(crc));
+	HOST_CHECK(storage.rewrite(0, "STG", 1, slot, sizeof(slot)) == STORAGE_OK);
+}
+
+static void boot_migrate()
+{
+	memset(reinterpret_cast<void*>(&settings), 0xA5, sizeof(settings));
+	HOST_CHECK(settings_db().load() == SETTINGS_OK);
+	HOST_CHECK(settings.sw_id == 4 && settings.sleep_time == sleepTime && settings.log_first_id == 0);
+
+	boot_start();
+	HOST_CHECK(settings.sw_id == SW_VERSION && settings.sleep_time == sleepTime && settings.log_first_id == 0);
+}
+
+static void boot_pre_journal()
+{
+	// The settings saved before the journal: two copies ("STG" 1 and 2) without the trailer
+	settings_t legacy = {};
+	settings_reset(&legacy);
+	legacy.sw_id      = 4;
+	legacy.sleep_time = sleepTime;
+
+	uint8_t slot[STORAGE_PAGE_PAYLOAD_SIZE] = {};
+	memcpy(slot, &legacy, settings_prev_size());
+	HOST_CHECK(storage.rewrite(0, "STG", 1, slot, settings_prev_size()) == STORAGE_OK);
+	HOST_CHECK(storage.rewrite(STORAGE_PAGE_SIZE, "STG", 2, slot, settings_prev_size()) == STORAGE_OK);
+}
+
+static void boot_torn_journal()
+{
+	// The conversion to the journal is the first save: the write cycle of slot 0 is interrupted
+	host_eeprom_tear_page(0, tearSize);
+	boot_start();
+}
+
+int main(int argc, char** argv)
+{
+	host_eeprom_open(argc > 1 ? argv[1] : "settings_db_test.eeprom", true);
+
+	HOST_CHECK(host_boot(boot_first) == HOST_BOOT_OK);
+	settings_t defaults = {};
+	settings_reset(&defaults);
+	sleepTime = defaults.sleep_time;
+
+	HOST_CHECK(host_boot(boot_save) == HOST_BOOT_OK);
+	sleepTime += SAVES_COUNT;
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+
+	// The diff write covers the changed settings and the trailer: the power
+	// is lost after every byte of it until the save completes
+	for (tearSize = 0; host_boot(boot_torn) == HOST_BOOT_POWER_LOSS; tearSize++) {
+		HOST_CHECK(tearSize < STORAGE_PAGE_SIZE);
+		HOST_CHECK(host_boot(boot_after_torn) == HOST_BOOT_OK);
+		sleepTime += 2;
+		HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	}
+	HOST_CHECK(tearSize > 0);
+	sleepTime += 1;
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	printf("torn: %u power loss points\n", tearSize);
+
+	host_eeprom_open(argc > 1 ? argv[1] : "settings_db_test.eeprom", true);
+	sleepTime = 111;
+	HOST_CHECK(host_boot(boot_legacy) == HOST_BOOT_OK);
+	HOST_CHECK(host_boot(boot_migrate) == HOST_BOOT_OK);
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+
+	// The copy the first journal save has not touched is loaded after the power loss
+	sleepTime = 222;
+	for (tearSize = 0; ; tearSize++) {
+		HOST_CHECK(tearSize < STORAGE_PAGE_SIZE);
+		host_eeprom_open(argc > 1 ? argv[1] : "settings_db_test.eeprom", true);
+		HOST_CHECK(host_boot(boot_pre_journal) == HOST_BOOT_OK);
+		if (host_boot(boot_torn_journal) == HOST_BOOT_OK) {
+			break;
+		}
+		HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	}
+	HOST_CHECK(tearSize > 0);
+	HOST_CHECK(host_boot(boot_check) == HOST_BOOT_OK);
+	printf("torn journal conversion: %u power loss points\n", tearSize);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Modem receive path (sim_uart.c): a modem session (AT responses and HTTPREAD
+ * bodies) is replayed through a model of the circular DMA with its half
+ * transfer, full transfer and IDLE line events, with the interrupts masked
+ * for 150 us every 5 ms and the main loop reading the ring every 1 ms with a
+ * stall every 200 ms. The old receive interrupt per byte is replayed on the
+ * same session. The interrupts and the lost bytes of both are printed.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "host.h"
+#include "main.h"
+
+// The CMSIS barrier is an ARM instruction
+#define __DMB() __sync_synchronize()
+
+#include "sim_uart.c"
+
+
+#define SESSION_CYCLES     (40)
+#define SESSION_BODY_SIZE  (2048)
+#define MASK_PERIOD_S      (0.005)
+#define MASK_TIME_S        (0.00015)
+#define POLL_PERIOD_S      (0.001)
+#define STALL_PERIOD_S     (0.2)
+// The IDLE line event comes after one idle character time after the last byte
+#define IDLE_CHARS         (1)
+
+
+typedef struct _rx_byte_t {
+	double t;
+	char   c;
+} rx_byte_t;
+
+typedef struct _rx_result_t {
+	uint32_t irqs;
+	uint32_t lost;
+	bool     intact;
+} rx_result_t;
+
+
+UART_HandleTypeDef huart1 = {};
+
+static uint8_t* dmaBuffer = nullptr;
+static uint16_t dmaSize   = 0;
+static double   modelTime = 0;
+
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef*, uint8_t* data, uint16_t size)
+{
+	dmaBuffer = data;
+	dmaSize   = size;
+	return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return static_cast<uint32_t>(modelTime * 1000);
+}
+
+static std::vector<rx_byte_t> session(double baud)
+{
+	static const char* responses[] = {
+		"\r\nOK\r\n",
+		"\r\n+CSQ: 21,99\r\n\r\nOK\r\n",
+		"\r\n+CPIN: READY\r\n\r\nOK\r\n",
+		"\r\n+CGREG: 0,1\r\n\r\nOK\r\n",
+		"\r\nDOWNLOAD\r\n",
+		"\r\nOK\r\n\r\n+HTTPACTION: 1,200,2048\r\n",
+	};
+	static const char bodyChars[] = "0123456789abcdefghij=&t";
+
+	std::string body = "\r\n+HTTPREAD: 0,2048\r\n";
+	for (unsigned i = 0; i < SESSION_BODY_SIZE; i++) {
+		body += bodyChars[i % (sizeof(bodyChars) - 1)];
+	}
+	body += "\r\n+HTTPREAD: 0\r\n";
+
+	std::vector<rx_byte_t> bytes;
+	double charTime = 10 / baud;
+	double t = 0;
+	uint32_t seed = 1;
+	auto burst = [&](const std::string& data) {
+		for (char c : data) {
+			bytes.push_back({t, c});
+			t += charTime;
+		}
+	};
+	for (unsigned cycle = 0; cycle < SESSION_CYCLES; cycle++) {
+		for (const char* response : responses) {
+			// The modem answers in 5-25 ms
+			seed = seed * 1103515245 + 12345;
+			t += 0.005 + ((seed >> 8) % 20) * 0.001;
+			burst(response);
+		}
+		t += 0.010;
+		burst(body);
+	}
+	return bytes;
+}
+
+static bool irq_masked(double t)
+{
+	return fmod(t, MASK_PERIOD_S) < MASK_TIME_S;
+}
+
+static double next_poll(double t, double stall)
+{
+	double next = t + POLL_PERIOD_S;
+	if (fmod(next, STALL_PERIOD_S) < POLL_PERIOD_S) {
+		next += stall;
+	}
+	return next;
+}
+
+static rx_result_t replay_dma(const std::vector<rx_byte_t>& bytes, double baud, double stall)
+{
+	memset(&sim_uart, 0, sizeof(sim_uart));
+	sim_uart_begin();
+	HOST_CHECK(dmaBuffer && dmaSize);
+
+	rx_result_t result = {};
+	double charTime = 10 / baud;
+	double end      = bytes.back().t + 0.1;
+	double poll     = 0;
+	double lastByte = 0;
+	bool   idleArmed = false;
+	bool   halfEvent = false;
+	bool   fullEvent = false;
+	bool   idleEvent = false;
+	uint16_t pos    = 0;
+	size_t   next   = 0;
+
+	std::string received;
+	for (modelTime = 0; modelTime < end; modelTime += charTime / 4) {
+		// The DMA takes every byte, the interrupts stay pending while masked
+		for (; next < bytes.size() && bytes[next].t <= modelTime; next++) {
+			dmaBuffer[pos++] = static_cast<uint8_t>(bytes[next].c);
+			lastByte  = bytes[next].t;
+			idleArmed = true;
+			if (pos == dmaSize / 2) {
+				halfEvent = true;
+			}
+			if (pos == dmaSize) {
+				fullEvent = true;
+				pos = 0;
+			}
+		}
+		if (idleArmed && modelTime - lastByte > (IDLE_CHARS + 1) * charTime) {
+			idleEvent = true;
+			idleArmed = false;
+		}
+
+		// The HAL reports the DMA position of the event, the IDLE line at the buffer end is not reported
+		if (!irq_masked(modelTime)) {
+			if (halfEvent) {
+				halfEvent = false;
+				sim_uart_rx_event(dmaSize / 2);
+				result.irqs++;
+			}
+			if (fullEvent) {
+				fullEvent = false;
+				sim_uart_rx_event(dmaSize);
+				result.irqs++;
+			}
+			if (idleEvent) {
+				idleEvent = false;
+				if (pos > 0) {
+					sim_uart_rx_event(pos);
+				}
+				result.irqs++;
+			}
+		}
+
+		if (modelTime >= poll) {
+			char data[32] = {};
+			uint32_t len = 0;
+			while ((len = sim_uart_read(data, sizeof(data)))) {
+				received.append(data, len);
+			}
+			poll = next_poll(modelTime, stall);
+		}
+	}
+
+	std::string sent;
+	for (const rx_byte_t& byte : bytes) {
+		sent += byte.c;
+	}
+
+	result.lost   = static_cast<uint32_t>(sent.size() - received.size());
+	result.intact = received == sent;
+	HOST_CHECK(sim_uart.dropped == result.lost);
+	return result;
+}
+
+static rx_result_t replay_it(const std::vector<rx_byte_t>& bytes, double baud)
+{
+	// One data register: a byte is lost if the next one is received before the interrupt reads it
+	rx_result_t result = {};
+	double charTime = 10 / baud;
+	bool   full     = false;
+	double fullTime = 0;
+	for (const rx_byte_t& byte : bytes) {
+		double t = byte.t + charTime;
+		if (full) {
+			double served = fullTime;
+			while (irq_masked(served)) {
+				served += 1e-6;
+			}
+			if (served > t) {
+				result.lost++;
+				fullTime = t;
+				continue;
+			}
+			result.irqs++;
+		}
+		full     = true;
+		fullTime = t;
+	}
+	result.irqs++;
+	result.intact = !result.lost;
+	return result;
+}
+
+static rx_result_t replay(double baud, double stallMs)
+{
+	std::vector<rx_byte_t> bytes = session(baud);
+	rx_result_t it  = replay_it(bytes, baud);
+	rx_result_t dma = replay_dma(bytes, baud, stallMs / 1000);
+	printf(
+		"%6.0f baud, %2.0f ms stall: %u bytes, IT %u irqs %u lost, DMA %u irqs (%.1f bytes/irq) %u lost\n",
+		baud,
+		stallMs,
+		static_cast<unsigned>(bytes.size()),
+		static_cast<unsigned>(it.irqs),
+		static_cast<unsigned>(it.lost),
+		static_cast<unsigned>(dma.irqs),
+		static_cast<double>(bytes.size()) / dma.irqs,
+		static_cast<unsigned>(dma.lost)
+	);
+	return dma;
+}
+
+int main()
+{
+	HOST_CHECK(replay(115200, 0).intact);
+	HOST_CHECK(replay(115200, 30).intact);
+	HOST_CHECK(replay(921600, 0).intact);
+	// 92 bytes per ms: a 5 ms stall overflows the ring, the lost bytes are counted as dropped
+	HOST_CHECK(!replay(921600, 5).intact);
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,17 @@
+/* Host test stand-in of the Utils stopwatch */
+
+#pragma once
+
+
+#include <stdint.h>
+
+
+namespace utl
+{
+
+struct CodeStopwatch
+{
+	CodeStopwatch(const char*, uint32_t) {}
+};
+
+}
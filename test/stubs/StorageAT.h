@@ -0,0 +1,25 @@
+/* Host test stand-in of StorageAT: the pages are found by a linear header scan (host/storage_at.cpp) */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "StorageType.h"
+
+
+class StorageAT
+{
+public:
+	StorageAT(uint32_t pagesCount, IStorageDriver* driver, uint32_t eraseSize);
+
+	StorageStatus find(StorageFindMode mode, uint32_t* address, const char* prefix = "", uint32_t id = 0);
+	StorageStatus load(uint32_t address, uint8_t* data, uint32_t len);
+	StorageStatus save(uint32_t address, const char* prefix, uint32_t id, uint8_t* data, uint32_t len);
+	StorageStatus rewrite(uint32_t address, const char* prefix, uint32_t id, uint8_t* data, uint32_t len);
+	StorageStatus format();
+
+private:
+	uint32_t        m_pagesCount;
+	IStorageDriver* m_driver;
+};
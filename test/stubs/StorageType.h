@@ -0,0 +1,35 @@
+/* Host test stand-in of the StorageAT types */
+
+#pragma once
+
+
+#include <stdint.h>
+
+
+#define STORAGE_PAGE_SIZE         (256)
+#define STORAGE_PAGE_PAYLOAD_SIZE (230)
+
+
+typedef enum _StorageStatus {
+	STORAGE_OK = 0,
+	STORAGE_ERROR,
+	STORAGE_BUSY,
+	STORAGE_OOM,
+	STORAGE_NOT_FOUND
+} StorageStatus;
+
+typedef enum _StorageFindMode {
+	FIND_MODE_EQUAL = 1,
+	FIND_MODE_NEXT,
+	FIND_MODE_MIN,
+	FIND_MODE_MAX,
+	FIND_MODE_EMPTY
+} StorageFindMode;
+
+
+struct IStorageDriver
+{
+	virtual StorageStatus read(const uint32_t address, uint8_t* data, const uint32_t len) = 0;
+	virtual StorageStatus write(const uint32_t address, const uint8_t* data, const uint32_t len) = 0;
+	virtual StorageStatus erase(const uint32_t* addresses, const uint32_t count) = 0;
+};
@@ -0,0 +1,29 @@
+/* Host test stand-in of the Utils timer */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "main.h"
+
+
+namespace utl
+{
+
+struct Timer
+{
+	Timer(uint32_t delay = 0): m_start(0), m_delay(delay) {}
+
+	void start() { m_start = HAL_GetTick(); }
+	void start(uint32_t delay) { m_delay = delay; start(); }
+	bool wait() { return HAL_GetTick() - m_start < m_delay; }
+	void reset() { m_start = HAL_GetTick() - m_delay; }
+	void changeDelay(uint32_t delay) { m_delay = delay; }
+
+private:
+	uint32_t m_start;
+	uint32_t m_delay;
+};
+
+}
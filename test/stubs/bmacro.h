@@ -0,0 +1,6 @@
+/* Host test stand-in of the Utils assert header */
+
+#pragma once
+
+
+#define BEDUG_ASSERT(condition, message)
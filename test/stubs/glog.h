@@ -0,0 +1,18 @@
+/* Host test stand-in of the Utils log header */
+
+#pragma once
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+void printTagLog(const char* tag, const char* format, ...);
+void printPretty(const char* format, ...);
+void gprint(const char* format, ...);
+
+
+#ifdef __cplusplus
+}
+#endif
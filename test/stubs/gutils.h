@@ -0,0 +1,37 @@
+/* Host test stand-in of the Utils header: only what the storage modules use */
+
+#pragma once
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define __arr_len(arr)   (sizeof(arr) / sizeof(*(arr)))
+#define __min(a, b)      ((a) < (b) ? (a) : (b))
+#define __max(a, b)      ((a) > (b) ? (a) : (b))
+#define __div_up(a, b)   (((a) + (b) - 1) / (b))
+#define __abs_dif(a, b)  ((a) > (b) ? (a) - (b) : (b) - (a))
+#define __percent(a, b)  ((a) * 100 / (b))
+
+#define BITS_IN_BYTE     (8)
+
+
+typedef struct _util_old_timer_t {
+	uint32_t start;
+	uint32_t delay;
+} util_old_timer_t;
+
+void util_old_timer_start(util_old_timer_t* timer, uint32_t delay);
+bool util_old_timer_wait(util_old_timer_t* timer);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,14 @@
+/* Host test stand-in of the Utils HAL definitions */
+
+#pragma once
+
+
+#include <stdbool.h>
+
+#include "main.h"
+
+
+#define STM_MIN_VOLTAGEx10 (27)
+#define STM_MAX_VOLTAGEx10 (36)
+#define STM_ADC_MAX        (4095)
+#define STM_REF_VOLTAGEx10 (12)